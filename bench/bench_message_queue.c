@@ -0,0 +1,506 @@
+/*****************************************************************************/
+/*    vsock-shell - Message queue micro-benchmarks                          */
+/*****************************************************************************/
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "../lib/message_queue.h"
+#include "../lib/message_ring.h"
+#include "../include/message.h"
+#include "../include/common.h"
+
+#define DEFAULT_TARGET_BYTES (64 * 1024 * 1024)
+#define MIN_FRAME_COUNT 100000
+#define DRAIN_BUFFER_SIZE (1024 * 1024)
+#define RING_CAPACITY 256
+#define MAX_RING_PRODUCERS 4
+
+/* How the writer splits the encoded stream for the parse benchmark */
+typedef enum {
+    PATTERN_FRAME = 0,                 /* One write per frame */
+    PATTERN_TINY,                      /* 97 byte writes */
+    PATTERN_RANDOM                     /* Random 1..8192 byte writes */
+} FragmentPattern;
+
+static const char *pattern_names[] = {"frame", "tiny", "random"};
+
+static const int payload_sizes[] = {1, 16, 64, 256, 1024, 4096};
+
+#define PAYLOAD_SIZE_COUNT (int)(sizeof(payload_sizes) / sizeof(payload_sizes[0]))
+
+static long target_bytes = DEFAULT_TARGET_BYTES;
+static long frames_override = 0;
+
+/* Ring benchmark producer thread */
+typedef struct {
+    MessageRing *ring;
+    int payload_size;
+    long frames;
+} RingProducer;
+
+/* Parse benchmark state */
+static long frames_received = 0;
+static long bytes_received = 0;
+
+/*****************************************************************************/
+static double now_seconds(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*****************************************************************************/
+static long frame_count_for(int payload_size)
+{
+    long count;
+    
+    if (frames_override > 0) {
+        return frames_override;
+    }
+    
+    count = target_bytes / (MESSAGE_HEADER_SIZE + payload_size);
+    return (count < MIN_FRAME_COUNT) ? MIN_FRAME_COUNT : count;
+}
+
+/*****************************************************************************/
+static void report(const char *name, int payload_size, const char *pattern,
+                   long frames, long bytes, double seconds)
+{
+    /* One JSON object per line so results can be diffed and tracked */
+    printf("{\"bench\":\"%s\",\"payload\":%d,\"pattern\":\"%s\","
+           "\"frames\":%ld,\"bytes\":%ld,\"seconds\":%.6f,"
+           "\"frames_per_sec\":%.0f,\"bytes_per_sec\":%.0f}\n",
+           name, payload_size, pattern, frames, bytes, seconds,
+           frames / seconds, bytes / seconds);
+    fflush(stdout);
+}
+
+/*****************************************************************************/
+static pid_t spawn_drain_process(int sock_fd, int peer_fd)
+{
+    char *buffer;
+    pid_t pid;
+    
+    pid = fork();
+    if (pid < 0) {
+        VSOCK_LOG_FATAL("Failed to fork: %s", strerror(errno));
+    }
+    
+    if (pid == 0) {
+        /* Child: discard everything until the writer closes */
+        close(sock_fd);
+        buffer = malloc(DRAIN_BUFFER_SIZE);
+        while (read(peer_fd, buffer, DRAIN_BUFFER_SIZE) > 0) {
+        }
+        _exit(EXIT_SUCCESS);
+    }
+    
+    close(peer_fd);
+    return pid;
+}
+
+/*****************************************************************************/
+static void open_socket_pair(int fds[2])
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        VSOCK_LOG_FATAL("Failed to create socket pair: %s", strerror(errno));
+    }
+}
+
+/*****************************************************************************/
+static void finish_drain(int sock_fd, pid_t pid)
+{
+    message_queue_destroy(sock_fd);
+    close(sock_fd);
+    waitpid(pid, NULL, 0);
+}
+
+/*****************************************************************************/
+static void fill_frame(Message *msg, int payload_size)
+{
+    memset(msg->data, 0xA5, payload_size);
+}
+
+/*****************************************************************************/
+static void drain_queue(int sock_fd)
+{
+    while (message_queue_flush_writes(sock_fd) > 0) {
+    }
+}
+
+/*****************************************************************************/
+static void bench_encode(int payload_size)
+{
+    int fds[2];
+    pid_t pid;
+    Message *msg;
+    long frames = frame_count_for(payload_size);
+    long sent;
+    double start, elapsed = 0;
+    
+    open_socket_pair(fds);
+    pid = spawn_drain_process(fds[0], fds[1]);
+    message_queue_init(fds[0]);
+    
+    /* Time reserve/fill/commit only, flush between timed batches */
+    for (sent = 0; sent < frames; ) {
+        start = now_seconds();
+        while (sent < frames && !message_queue_is_saturated(fds[0])) {
+            msg = message_queue_reserve(fds[0], MSG_TYPE_FILE_DATA, 
+                                        payload_size);
+            if (!msg) {
+                VSOCK_LOG_FATAL("Frame rejected after %ld frames", sent);
+            }
+            fill_frame(msg, payload_size);
+            message_queue_commit(fds[0], msg, payload_size);
+            sent++;
+        }
+        elapsed += now_seconds() - start;
+        drain_queue(fds[0]);
+    }
+    
+    finish_drain(fds[0], pid);
+    report("encode", payload_size, "-", frames,
+           frames * (MESSAGE_HEADER_SIZE + payload_size), elapsed);
+}
+
+/*****************************************************************************/
+static void bench_flush(int payload_size)
+{
+    int fds[2];
+    pid_t pid;
+    Message *msg;
+    long frames = frame_count_for(payload_size);
+    long sent;
+    double start, elapsed = 0;
+    
+    open_socket_pair(fds);
+    pid = spawn_drain_process(fds[0], fds[1]);
+    message_queue_init(fds[0]);
+    
+    /* Fill the queue untimed, time draining it into the socket */
+    for (sent = 0; sent < frames; ) {
+        while (sent < frames && !message_queue_is_saturated(fds[0])) {
+            msg = message_queue_reserve(fds[0], MSG_TYPE_FILE_DATA, 
+                                        payload_size);
+            if (!msg) {
+                VSOCK_LOG_FATAL("Frame rejected after %ld frames", sent);
+            }
+            fill_frame(msg, payload_size);
+            message_queue_commit(fds[0], msg, payload_size);
+            sent++;
+        }
+        start = now_seconds();
+        drain_queue(fds[0]);
+        elapsed += now_seconds() - start;
+    }
+    
+    finish_drain(fds[0], pid);
+    report("flush", payload_size, "-", frames,
+           frames * (MESSAGE_HEADER_SIZE + payload_size), elapsed);
+}
+
+/*****************************************************************************/
+static void write_fully(int fd, const char *data, long length)
+{
+    ssize_t written;
+    
+    while (length > 0) {
+        written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            VSOCK_LOG_FATAL("Write failed: %s", strerror(errno));
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+/*****************************************************************************/
+static void run_stream_writer(int fd, int payload_size, long frames,
+                              FragmentPattern pattern)
+{
+    int frame_length = MESSAGE_HEADER_SIZE + payload_size;
+    long batch_frames = DRAIN_BUFFER_SIZE / frame_length;
+    long stream_length;
+    long offset;
+    long piece;
+    long sent = 0;
+    char *stream;
+    Message *msg;
+    long i;
+    
+    /* Pre-encode one batch of frames and send it repeatedly */
+    stream = malloc(batch_frames * frame_length);
+    for (i = 0; i < batch_frames; i++) {
+        msg = (Message *)&stream[i * frame_length];
+        msg->magic = PROTOCOL_MAGIC;
+        msg->type = MSG_TYPE_FILE_DATA;
+        msg->channel = 0;
+        msg->length = payload_size;
+        memset(msg->data, 0x5A, payload_size);
+    }
+    
+    srand(1);
+    
+    while (sent < frames) {
+        if (frames - sent < batch_frames) {
+            batch_frames = frames - sent;
+        }
+        stream_length = batch_frames * frame_length;
+        
+        for (offset = 0; offset < stream_length; offset += piece) {
+            switch (pattern) {
+                case PATTERN_FRAME:
+                    piece = frame_length;
+                    break;
+                case PATTERN_TINY:
+                    piece = 97;
+                    break;
+                default:
+                    piece = 1 + rand() % 8192;
+                    break;
+            }
+            if (piece > stream_length - offset) {
+                piece = stream_length - offset;
+            }
+            write_fully(fd, &stream[offset], piece);
+        }
+        
+        sent += batch_frames;
+    }
+    
+    free(stream);
+}
+
+/*****************************************************************************/
+static int count_message(void *context, int fd, Message *msg)
+{
+    UNUSED(context);
+    UNUSED(fd);
+    
+    frames_received++;
+    bytes_received += MESSAGE_HEADER_SIZE + msg->length;
+    return 0;
+}
+
+/*****************************************************************************/
+static void parse_error(void *context, const char *error)
+{
+    UNUSED(context);
+    VSOCK_LOG_FATAL("Parse error: %s", error);
+}
+
+/*****************************************************************************/
+static void bench_parse(int payload_size, FragmentPattern pattern)
+{
+    int fds[2];
+    pid_t pid;
+    long frames = frame_count_for(payload_size);
+    double start, elapsed;
+    
+    open_socket_pair(fds);
+    
+    pid = fork();
+    if (pid < 0) {
+        VSOCK_LOG_FATAL("Failed to fork: %s", strerror(errno));
+    }
+    
+    if (pid == 0) {
+        close(fds[0]);
+        run_stream_writer(fds[1], payload_size, frames, pattern);
+        _exit(EXIT_SUCCESS);
+    }
+    
+    close(fds[1]);
+    message_queue_init(fds[0]);
+    frames_received = 0;
+    bytes_received = 0;
+    
+    start = now_seconds();
+    while (frames_received < frames) {
+        message_queue_read(NULL, fds[0], count_message, parse_error);
+    }
+    elapsed = now_seconds() - start;
+    
+    message_queue_destroy(fds[0]);
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    
+    report("parse", payload_size, pattern_names[pattern], frames_received,
+           bytes_received, elapsed);
+}
+
+/*****************************************************************************/
+static void *run_ring_producer(void *argument)
+{
+    RingProducer *producer = (RingProducer *)argument;
+    Message *msg;
+    long sent;
+    
+    for (sent = 0; sent < producer->frames; sent++) {
+        msg = message_ring_reserve(producer->payload_size);
+        if (!msg) {
+            VSOCK_LOG_FATAL("Frame rejected after %ld frames", sent);
+        }
+        fill_frame(msg, producer->payload_size);
+        
+        /* Ring full, let the consumer catch up */
+        while (message_ring_commit(producer->ring, msg, 
+                                   producer->payload_size) < 0) {
+            sched_yield();
+        }
+    }
+    
+    return NULL;
+}
+
+/*****************************************************************************/
+static void bench_ring(int payload_size, int producer_count)
+{
+    RingProducer producers[MAX_RING_PRODUCERS];
+    pthread_t threads[MAX_RING_PRODUCERS];
+    struct pollfd wakeup;
+    MessageRing *ring;
+    int fds[2];
+    pid_t pid;
+    long frames = frame_count_for(payload_size);
+    long moved = 0;
+    int result;
+    int i;
+    double start, elapsed;
+    
+    open_socket_pair(fds);
+    pid = spawn_drain_process(fds[0], fds[1]);
+    message_queue_init(fds[0]);
+    ring = message_ring_create(RING_CAPACITY, producer_count > 1 ? 
+                               MESSAGE_RING_MPSC : MESSAGE_RING_SPSC);
+    if (!ring) {
+        VSOCK_LOG_FATAL("Failed to create message ring");
+    }
+    
+    wakeup.fd = message_ring_event_fd(ring);
+    wakeup.events = POLLIN;
+    
+    /* Producers build frames on their own threads, this thread stands in
+     * for the event loop and sleeps only when there is nothing to send */
+    start = now_seconds();
+    for (i = 0; i < producer_count; i++) {
+        producers[i].ring = ring;
+        producers[i].payload_size = payload_size;
+        producers[i].frames = frames / producer_count + 
+                              (i < frames % producer_count);
+        pthread_create(&threads[i], NULL, run_ring_producer, &producers[i]);
+    }
+    
+    while (moved < frames) {
+        result = message_ring_drain(ring, fds[0]);
+        if (result < 0) {
+            VSOCK_LOG_FATAL("Drain failed after %ld frames", moved);
+        }
+        moved += result;
+        
+        if (message_queue_flush_writes(fds[0]) == 0 && result == 0) {
+            poll(&wakeup, 1, -1);
+        }
+    }
+    drain_queue(fds[0]);
+    elapsed = now_seconds() - start;
+    
+    for (i = 0; i < producer_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    
+    message_ring_destroy(ring);
+    finish_drain(fds[0], pid);
+    report("ring", payload_size, producer_count > 1 ? "mpsc" : "spsc", 
+           frames, frames * (MESSAGE_HEADER_SIZE + payload_size), elapsed);
+}
+
+/*****************************************************************************/
+static void print_usage(const char *program_name)
+{
+    printf("Usage: %s [OPTIONS]\n\n", program_name);
+    printf("Options:\n");
+    printf("  --bytes N      Approximate bytes per case (default: %d)\n",
+           DEFAULT_TARGET_BYTES);
+    printf("  --frames N     Fixed frame count per case\n");
+    printf("  --help         Show this help message\n\n");
+    printf("Each case prints one JSON object per line.\n");
+}
+
+/*****************************************************************************/
+int main(int argc, char *argv[])
+{
+    int option_index = 0;
+    int c;
+    int i;
+    int pattern;
+    
+    static struct option long_options[] = {
+        {"bytes",  required_argument, 0, 'b'},
+        {"frames", required_argument, 0, 'f'},
+        {"help",   no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+    
+    while (1) {
+        c = getopt_long(argc, argv, "b:f:h", long_options, &option_index);
+        
+        if (c == -1) {
+            break;
+        }
+        
+        switch (c) {
+            case 'b':
+                target_bytes = parse_integer(optarg);
+                break;
+            case 'f':
+                frames_override = parse_integer(optarg);
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    
+    for (i = 0; i < PAYLOAD_SIZE_COUNT; i++) {
+        bench_encode(payload_sizes[i]);
+    }
+    
+    for (i = 0; i < PAYLOAD_SIZE_COUNT; i++) {
+        bench_flush(payload_sizes[i]);
+    }
+    
+    for (i = 0; i < PAYLOAD_SIZE_COUNT; i++) {
+        bench_ring(payload_sizes[i], 1);
+        bench_ring(payload_sizes[i], MAX_RING_PRODUCERS);
+    }
+    
+    for (pattern = PATTERN_FRAME; pattern <= PATTERN_RANDOM; pattern++) {
+        for (i = 0; i < PAYLOAD_SIZE_COUNT; i++) {
+            bench_parse(payload_sizes[i], (FragmentPattern)pattern);
+        }
+    }
+    
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,390 @@
+/*****************************************************************************/
+/*    vsock-shell - Message queue stress test                               */
+/*****************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "../lib/message_queue.h"
+#include "../include/message.h"
+#include "../include/common.h"
+#include "../include/protocol.h"
+
+#define DEFAULT_FRAME_COUNT 300000
+#define MIN_PAYLOAD 4                  /* Room for the sequence number */
+#define MAX_PAYLOAD MAX_MESSAGE_DATA
+#define SOCKET_BUFFER_SIZE 4096        /* Keeps the queue backed up */
+#define LANE_COUNT 2
+#define CHANNEL_COUNT 256              /* Frames run on sequence & 0xFF */
+#define CLOSE_INTERVAL 16              /* One close per this many frames */
+
+/* How a frame is put into the queue */
+typedef enum {
+    WRITE_COMMIT = 0,                  /* Reserve exactly, commit */
+    WRITE_SHORT_COMMIT,                /* Reserve more than is committed */
+    WRITE_COPY,                        /* message_queue_write_channel() */
+    WRITE_DISCARD,                     /* Reserve, discard, then write */
+    WRITE_METHOD_COUNT
+} WriteMethod;
+
+/* One frame type per lane, each lane keeps its own order */
+static const uint32_t lane_types[LANE_COUNT] = {
+    MSG_TYPE_PTY_DATA, MSG_TYPE_FILE_DATA
+};
+
+typedef struct {
+    uint32_t sent[LANE_COUNT];
+    uint32_t received[LANE_COUNT];
+    uint32_t channel_end[LANE_COUNT][CHANNEL_COUNT]; /* After last frame */
+    long frames_received;
+    long bytes_received;
+    long closes_sent;
+    long closes_received;
+    int pending;                       /* Bytes the writer queue holds */
+} StressState;
+
+/*****************************************************************************/
+static uint32_t mix(uint32_t value)
+{
+    value ^= value >> 16;
+    value *= 0x7FEB352D;
+    value ^= value >> 15;
+    value *= 0x846CA68B;
+    value ^= value >> 16;
+    return value;
+}
+
+/*****************************************************************************/
+static uint32_t payload_length(int lane, uint32_t sequence)
+{
+    /* Derived from the frame itself, so the reader can check it */
+    return MIN_PAYLOAD + mix(sequence * LANE_COUNT + lane) %
+                         (MAX_PAYLOAD - MIN_PAYLOAD + 1);
+}
+
+/*****************************************************************************/
+static uint8_t payload_byte(int lane, uint32_t sequence, uint32_t index)
+{
+    return (uint8_t)(sequence + index * 7 + lane);
+}
+
+/*****************************************************************************/
+static void fill_frame(Message *msg, int lane, uint32_t sequence)
+{
+    uint32_t length = payload_length(lane, sequence);
+    uint32_t i;
+    
+    memcpy(msg->data, &sequence, sizeof(sequence));
+    for (i = sizeof(sequence); i < length; i++) {
+        msg->data[i] = payload_byte(lane, sequence, i);
+    }
+}
+
+/*****************************************************************************/
+static int lane_of_type(uint32_t type)
+{
+    int lane;
+    
+    for (lane = 0; lane < LANE_COUNT; lane++) {
+        if (lane_types[lane] == type) {
+            return lane;
+        }
+    }
+    
+    return -1;
+}
+
+/*****************************************************************************/
+static void verify_close(StressState *state, Message *msg)
+{
+    uint32_t ends[LANE_COUNT];
+    int lane;
+    
+    if (msg->length != sizeof(ends)) {
+        VSOCK_LOG_FATAL("Close of channel %u: bad length %u", msg->channel,
+                        msg->length);
+    }
+    
+    /* Every frame the channel had queued must be in before its close */
+    memcpy(ends, msg->data, sizeof(ends));
+    for (lane = 0; lane < LANE_COUNT; lane++) {
+        if (state->received[lane] < ends[lane]) {
+            VSOCK_LOG_FATAL("Lane %d: channel %u closed ahead of frame %u",
+                            lane, msg->channel, ends[lane] - 1);
+        }
+    }
+    
+    state->closes_received++;
+}
+
+/*****************************************************************************/
+static int verify_frame(void *context, int fd, Message *msg)
+{
+    StressState *state = (StressState *)context;
+    uint32_t sequence;
+    uint32_t i;
+    int lane;
+    UNUSED(fd);
+    
+    if (msg->type == MSG_TYPE_CHANNEL_CLOSE) {
+        verify_close(state, msg);
+        return 0;
+    }
+    
+    lane = lane_of_type(msg->type);
+    if (lane < 0 || msg->length < MIN_PAYLOAD) {
+        VSOCK_LOG_FATAL("Frame %ld: bad type %u or length %u",
+                        state->frames_received, msg->type, msg->length);
+    }
+    
+    memcpy(&sequence, msg->data, sizeof(sequence));
+    if (sequence != state->received[lane]) {
+        VSOCK_LOG_FATAL("Lane %d: frame %u arrived, expected %u", lane,
+                        sequence, state->received[lane]);
+    }
+    
+    if (msg->length != payload_length(lane, sequence) ||
+        msg->channel != (sequence & 0xFF)) {
+        VSOCK_LOG_FATAL("Lane %d frame %u: length %u channel %u", lane,
+                        sequence, msg->length, msg->channel);
+    }
+    
+    for (i = sizeof(sequence); i < msg->length; i++) {
+        if (msg->data[i] != payload_byte(lane, sequence, i)) {
+            VSOCK_LOG_FATAL("Lane %d frame %u: corrupt at byte %u", lane,
+                            sequence, i);
+        }
+    }
+    
+    state->received[lane]++;
+    state->frames_received++;
+    state->bytes_received += MESSAGE_HEADER_SIZE + msg->length;
+    return 0;
+}
+
+/*****************************************************************************/
+static void read_error(void *context, const char *error)
+{
+    UNUSED(context);
+    VSOCK_LOG_FATAL("Reader failed: %s", error);
+}
+
+/*****************************************************************************/
+static void pump(int fds[2], StressState *state)
+{
+    /* Move what the socket takes, then let the reader catch up */
+    state->pending = message_queue_flush_writes(fds[0]);
+    if (state->pending < 0) {
+        VSOCK_LOG_FATAL("Flush failed: %s", strerror(errno));
+    }
+    
+    while (message_queue_read(state, fds[1], verify_frame, read_error) > 0) {
+    }
+}
+
+/*****************************************************************************/
+static uint32_t reserved_length(int lane, WriteMethod method,
+                                uint32_t sequence)
+{
+    uint32_t length = payload_length(lane, sequence);
+    
+    if (method == WRITE_SHORT_COMMIT) {
+        length += mix(sequence) % (MAX_PAYLOAD - length + 1);
+    }
+    
+    return length;
+}
+
+/*****************************************************************************/
+static void write_frame(int fd, StressState *state, int lane,
+                        WriteMethod method)
+{
+    uint32_t sequence = state->sent[lane];
+    uint32_t length = payload_length(lane, sequence);
+    uint32_t reserved = reserved_length(lane, method, sequence);
+    Message frame;
+    Message *msg;
+    
+    if (method == WRITE_COPY) {
+        frame.type = lane_types[lane];
+        frame.length = length;
+        fill_frame(&frame, lane, sequence);
+        if (message_queue_write_channel(fd, sequence & 0xFF, &frame) < 0) {
+            VSOCK_LOG_FATAL("Lane %d frame %u of %u bytes rejected with %d "
+                            "bytes queued", lane, sequence, length,
+                            state->pending);
+        }
+    } else {
+        msg = message_queue_reserve(fd, lane_types[lane], reserved);
+        if (!msg) {
+            VSOCK_LOG_FATAL("Lane %d frame %u reserving %u bytes rejected "
+                            "with %d bytes queued", lane, sequence, reserved,
+                            state->pending);
+        }
+    
+        if (method == WRITE_DISCARD) {
+            /* Nothing may come of it, the same frame follows for real */
+            message_queue_discard(fd, msg);
+            write_frame(fd, state, lane, WRITE_COMMIT);
+            return;
+        }
+    
+        msg->channel = sequence & 0xFF;
+        fill_frame(msg, lane, sequence);
+        if (message_queue_commit(fd, msg, length) < 0) {
+            VSOCK_LOG_FATAL("Lane %d frame %u: commit failed", lane,
+                            sequence);
+        }
+    }
+    
+    state->sent[lane]++;
+    state->channel_end[lane][sequence & 0xFF] = sequence + 1;
+    state->pending += MESSAGE_HEADER_SIZE + length;
+}
+
+/*****************************************************************************/
+static void close_channel(int fd, StressState *state, uint16_t channel)
+{
+    uint32_t ends[LANE_COUNT];
+    Message msg;
+    int lane;
+    
+    /* Tells the reader which frames of the channel precede the close */
+    for (lane = 0; lane < LANE_COUNT; lane++) {
+        ends[lane] = state->channel_end[lane][channel];
+    }
+    
+    msg.type = MSG_TYPE_CHANNEL_CLOSE;
+    msg.length = sizeof(ends);
+    memcpy(msg.data, ends, sizeof(ends));
+    
+    if (message_queue_write_channel(fd, channel, &msg) < 0) {
+        VSOCK_LOG_FATAL("Close of channel %u rejected with %d bytes queued",
+                        channel, state->pending);
+    }
+    
+    state->closes_sent++;
+    state->pending += MESSAGE_HEADER_SIZE + msg.length;
+}
+
+/*****************************************************************************/
+static void open_socket_pair(int fds[2])
+{
+    int size = SOCKET_BUFFER_SIZE;
+    int i;
+    
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        VSOCK_LOG_FATAL("Failed to create socket pair: %s", strerror(errno));
+    }
+    
+    /* Small buffers make the queue, not the kernel, hold the backlog */
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    
+    for (i = 0; i < 2; i++) {
+        if (fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK) < 0 ||
+            message_queue_init(fds[i]) < 0) {
+            VSOCK_LOG_FATAL("Failed to set up socket %d", fds[i]);
+        }
+    }
+}
+
+/*****************************************************************************/
+static void print_usage(const char *program_name)
+{
+    printf("Usage: %s [--frames N] [--seed N]\n\n", program_name);
+    printf("Pushes random %d B to %d B frames through a message queue over a\n",
+           MIN_PAYLOAD, MAX_PAYLOAD);
+    printf("socketpair() with a small send buffer, mixing reserve/commit and\n");
+    printf("copied writes, and closes channels right after writing to them.\n");
+    printf("Fails if a frame is rejected while the queue has room for it, if\n");
+    printf("any frame arrives out of order or altered, or after the close of\n");
+    printf("its channel.\n");
+}
+
+/*****************************************************************************/
+int main(int argc, char *argv[])
+{
+    StressState state;
+    long frames = DEFAULT_FRAME_COUNT;
+    unsigned int seed = 1;
+    long written;
+    WriteMethod method;
+    uint32_t reserved;
+    int fds[2];
+    int lane;
+    int c;
+    
+    static struct option long_options[] = {
+        {"frames", required_argument, 0, 'f'},
+        {"seed",   required_argument, 0, 's'},
+        {"help",   no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+    
+    while ((c = getopt_long(argc, argv, "f:s:h", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'f':
+                frames = atol(optarg);
+                break;
+            case 's':
+                seed = (unsigned int)atol(optarg);
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    
+    openlog("stress-message-queue", LOG_PID, LOG_USER);
+    memset(&state, 0, sizeof(state));
+    open_socket_pair(fds);
+    srand(seed);
+    
+    for (written = 0; written < frames; written++) {
+        lane = rand() % LANE_COUNT;
+        method = rand() % WRITE_METHOD_COUNT;
+        reserved = reserved_length(lane, method, state.sent[lane]);
+    
+        /* Drain only once the next frame does not fit, so the queue runs
+         * right up to its limit and must take every frame that fits */
+        while (state.pending + MESSAGE_HEADER_SIZE + reserved >
+               MAX_TX_BUFFER) {
+            pump(fds, &state);
+        }
+    
+        write_frame(fds[0], &state, lane, method);
+    
+        /* Now and then the channel just written to closes right after */
+        if (rand() % CLOSE_INTERVAL == 0) {
+            while (state.pending + MESSAGE_HEADER_SIZE + 
+                   LANE_COUNT * sizeof(uint32_t) > MAX_TX_BUFFER) {
+                pump(fds, &state);
+            }
+            close_channel(fds[0], &state, (state.sent[lane] - 1) & 0xFF);
+        }
+    }
+    
+    while (state.frames_received < frames || 
+           state.closes_received < state.closes_sent) {
+        pump(fds, &state);
+    }
+    
+    printf("{\"bench\":\"stress\",\"frames\":%ld,\"bytes\":%ld,"
+           "\"seed\":%u,\"result\":\"ok\"}\n",
+           state.frames_received, state.bytes_received, seed);
+    
+    message_queue_destroy(fds[0]);
+    message_queue_destroy(fds[1]);
+    close(fds[0]);
+    close(fds[1]);
+    closelog();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,366 @@
+/*****************************************************************************/
+/*    vsock-shell - Batch client implementation                             */
+/*****************************************************************************/
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include "batch_client.h"
+#include "../lib/message_queue.h"
+#include "../include/message.h"
+#include "../include/common.h"
+#include "../include/protocol.h"
+
+/* Output held in memory per stream of a running command, the rest of
+ * it waits in a temporary file */
+#define OUTPUT_MEMORY_LIMIT (64 * 1024)
+
+/* Output of a command, held back until it finishes */
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+    FILE *spill;                       /* All of it once past the limit */
+    int ends_line;                     /* Last byte was a newline */
+} OutputBuffer;
+
+typedef struct {
+    const char *command;
+    OutputBuffer output[2];            /* stdout and stderr */
+    int exit_status;
+} BatchCommand;
+
+/* Shared with the message callbacks of the batch loop */
+typedef struct {
+    BatchCommand *commands;
+    int count;
+    int finished;
+    int failed;
+    int active;
+} BatchState;
+
+/*****************************************************************************/
+static int is_batch_line(const char *line)
+{
+    line += strspn(line, " \t");
+    return line[0] != '\0' && line[0] != '#';
+}
+
+/*****************************************************************************/
+int batch_load_commands(const char *path, char ***commands)
+{
+    FILE *file = stdin;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    size_t payload = 2 * sizeof(uint32_t);
+    int count = 0;
+    
+    if (strcmp(path, "-") != 0) {
+        file = fopen(path, "r");
+        if (!file) {
+            fprintf(stderr, "Error: cannot open '%s': %s\n", path,
+                    strerror(errno));
+            return -1;
+        }
+    }
+    
+    *commands = (char **)calloc(MAX_BATCH_COMMANDS, sizeof(char *));
+    if (!*commands) {
+        VSOCK_LOG_FATAL("Failed to allocate batch");
+    }
+    
+    while ((length = getline(&line, &line_size, file)) >= 0) {
+        if (length > 0 && line[length - 1] == '\n') {
+            line[--length] = '\0';
+        }
+        if (!is_batch_line(line)) {
+            continue;
+        }
+    
+        /* All of it goes out in a single request */
+        payload += length + 1;
+        if (count == MAX_BATCH_COMMANDS || payload > MAX_MESSAGE_DATA) {
+            fprintf(stderr, "Error: batch '%s' is larger than %d commands "
+                    "or %d bytes\n", path, MAX_BATCH_COMMANDS,
+                    MAX_MESSAGE_DATA);
+            count = -1;
+            break;
+        }
+    
+        (*commands)[count] = strdup(line);
+        if (!(*commands)[count]) {
+            VSOCK_LOG_FATAL("Failed to allocate batch");
+        }
+        count++;
+    }
+    
+    free(line);
+    if (file != stdin) {
+        fclose(file);
+    }
+    
+    if (count == 0) {
+        fprintf(stderr, "Error: batch '%s' has no commands\n", path);
+        return -1;
+    }
+    
+    return count;
+}
+
+/*****************************************************************************/
+static void send_batch_request(int socket_fd, char **commands, int count,
+                               int parallelism)
+{
+    Message msg;
+    uint32_t header[2];
+    size_t length;
+    int i;
+    
+    header[0] = parallelism;
+    header[1] = count;
+    
+    msg.type = MSG_TYPE_OPEN_BATCH;
+    msg.length = sizeof(header);
+    memcpy(msg.data, header, sizeof(header));
+    
+    /* Sizes were checked as the batch was loaded */
+    for (i = 0; i < count; i++) {
+        length = strlen(commands[i]) + 1;
+        memcpy(&msg.data[msg.length], commands[i], length);
+        msg.length += length;
+    }
+    
+    if (message_queue_write(socket_fd, &msg) < 0) {
+        VSOCK_LOG_FATAL("Failed to send batch request");
+    }
+}
+
+/*****************************************************************************/
+static void spill_output(OutputBuffer *buffer)
+{
+    buffer->spill = tmpfile();
+    if (!buffer->spill) {
+        VSOCK_LOG_ERROR("Failed to spill command output: %s", strerror(errno));
+        return;
+    }
+    
+    fwrite(buffer->data, 1, buffer->length, buffer->spill);
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+}
+
+/*****************************************************************************/
+static int has_output(OutputBuffer *buffer)
+{
+    return buffer->length > 0 || buffer->spill;
+}
+
+/*****************************************************************************/
+static void append_output(OutputBuffer *buffer, const uint8_t *data,
+                          uint32_t length)
+{
+    size_t capacity = buffer->capacity ? buffer->capacity : MAX_MESSAGE_DATA;
+    
+    if (length == 0) {
+        return;
+    }
+    buffer->ends_line = data[length - 1] == '\n';
+    
+    /* Crossing the limit moves it to a file, kept in memory if that fails */
+    if (!buffer->spill && buffer->length <= OUTPUT_MEMORY_LIMIT &&
+        buffer->length + length > OUTPUT_MEMORY_LIMIT) {
+        spill_output(buffer);
+    }
+    
+    if (buffer->spill) {
+        if (fwrite(data, 1, length, buffer->spill) != length) {
+            VSOCK_LOG_ERROR("Failed to spill command output");
+        }
+        return;
+    }
+    
+    while (buffer->length + length > capacity) {
+        capacity *= 2;
+    }
+    
+    if (capacity != buffer->capacity) {
+        buffer->data = (uint8_t *)realloc(buffer->data, capacity);
+        if (!buffer->data) {
+            VSOCK_LOG_FATAL("Failed to buffer command output");
+        }
+        buffer->capacity = capacity;
+    }
+    
+    memcpy(&buffer->data[buffer->length], data, length);
+    buffer->length += length;
+}
+
+/*****************************************************************************/
+static void print_output(FILE *stream, OutputBuffer *buffer)
+{
+    uint8_t chunk[MAX_MESSAGE_DATA];
+    size_t length;
+    
+    if (buffer->spill) {
+        rewind(buffer->spill);
+        while ((length = fread(chunk, 1, sizeof(chunk), buffer->spill)) > 0) {
+            fwrite(chunk, 1, length, stream);
+        }
+        fclose(buffer->spill);
+    } else {
+        fwrite(buffer->data, 1, buffer->length, stream);
+    }
+    
+    /* Keep the next header on a line of its own */
+    if (has_output(buffer) && !buffer->ends_line) {
+        fputc('\n', stream);
+    }
+    fflush(stream);
+    
+    free(buffer->data);
+    memset(buffer, 0, sizeof(OutputBuffer));
+}
+
+/*****************************************************************************/
+static void report_command(BatchState *state, int index)
+{
+    BatchCommand *command = &state->commands[index];
+    
+    state->finished++;
+    if (command->exit_status != 0) {
+        state->failed++;
+    }
+    
+    printf("[%d] exit %d: %s\n", index + 1, command->exit_status,
+           command->command);
+    print_output(stdout, &command->output[0]);
+    print_output(stderr, &command->output[1]);
+}
+
+/*****************************************************************************/
+static int handle_batch_message(void *context, int fd, Message *msg)
+{
+    BatchState *state = (BatchState *)context;
+    BatchCommand *command;
+    int32_t status;
+    UNUSED(fd);
+    
+    /* Channel 0 only says when the batch is over */
+    if (msg->channel == 0) {
+        if (msg->type == MSG_TYPE_CLIENT_END) {
+            state->active = 0;
+        } else {
+            VSOCK_LOG_ERROR("Unexpected message type: 0x%02X", msg->type);
+        }
+        return 0;
+    }
+    
+    if (msg->channel > state->count) {
+        VSOCK_LOG_ERROR("Message for unknown command %u", msg->channel);
+        return 0;
+    }
+    
+    command = &state->commands[msg->channel - 1];
+    
+    switch (msg->type) {
+        case MSG_TYPE_PTY_DATA:
+            append_output(&command->output[0], msg->data, msg->length);
+            break;
+            
+        case MSG_TYPE_STDERR_DATA:
+            append_output(&command->output[1], msg->data, msg->length);
+            break;
+            
+        case MSG_TYPE_EXIT_STATUS:
+            if (msg->length != sizeof(int32_t)) {
+                VSOCK_LOG_ERROR("Invalid exit status length: %u", msg->length);
+                break;
+            }
+            memcpy(&status, msg->data, sizeof(int32_t));
+            command->exit_status = status;
+            break;
+            
+        case MSG_TYPE_CHANNEL_CLOSE:
+            report_command(state, msg->channel - 1);
+            break;
+            
+        default:
+            VSOCK_LOG_ERROR("Unexpected message type: 0x%02X", msg->type);
+            break;
+    }
+    
+    return 0;
+}
+
+/*****************************************************************************/
+static void handle_batch_error(void *context, const char *error)
+{
+    BatchState *state = (BatchState *)context;
+    VSOCK_LOG_ERROR("Batch error: %s", error);
+    state->active = 0;
+}
+
+/*****************************************************************************/
+int batch_run(int socket_fd, char **commands, int count, int parallelism)
+{
+    BatchState state;
+    fd_set read_fds;
+    int i;
+    
+    memset(&state, 0, sizeof(state));
+    state.commands = (BatchCommand *)calloc(count, sizeof(BatchCommand));
+    if (!state.commands) {
+        VSOCK_LOG_FATAL("Failed to allocate batch");
+    }
+    
+    /* A command the server never reported on counts as failed */
+    for (i = 0; i < count; i++) {
+        state.commands[i].command = commands[i];
+        state.commands[i].exit_status = 255;
+    }
+    state.count = count;
+    state.active = 1;
+    
+    if (message_queue_init(socket_fd) < 0) {
+        VSOCK_LOG_FATAL("Failed to initialize message queue");
+    }
+    
+    send_batch_request(socket_fd, commands, count, parallelism);
+    
+    /* Everything else arrives as the commands finish */
+    while (state.active) {
+        message_queue_flush_writes(socket_fd);
+    
+        FD_ZERO(&read_fds);
+        FD_SET(socket_fd, &read_fds);
+    
+        if (select(socket_fd + 1, &read_fds, NULL, NULL, NULL) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            VSOCK_LOG_ERROR("Select error: %s", strerror(errno));
+            break;
+        }
+    
+        if (FD_ISSET(socket_fd, &read_fds)) {
+            message_queue_read(&state, socket_fd,
+                             handle_batch_message, handle_batch_error);
+        }
+    }
+    
+    /* Commands cut off by a lost connection print what they had */
+    for (i = 0; state.finished < count && i < count; i++) {
+        if (has_output(&state.commands[i].output[0]) ||
+            has_output(&state.commands[i].output[1])) {
+            report_command(&state, i);
+        }
+    }
+    
+    message_queue_destroy(socket_fd);
+    free(state.commands);
+    return state.failed > 0 || state.finished < count ? 1 : 0;
+}
@@ -0,0 +1,18 @@
+/*****************************************************************************/
+/*    vsock-shell - Batch client interface                                  */
+/*****************************************************************************/
+#ifndef VSOCK_SHELL_BATCH_CLIENT_H
+#define VSOCK_SHELL_BATCH_CLIENT_H
+
+/* Reads one command per line from path, "-" for stdin, skipping blank
+ * lines and lines starting with '#'. Returns how many it found or -1
+ * after printing why, including a batch too large for one request. */
+int batch_load_commands(const char *path, char ***commands);
+
+/* Runs the commands in one request, at most parallelism of them at once.
+ * Each one's output is printed as soon as it finishes, after a line
+ * "[N] exit STATUS: COMMAND" with N counting from 1, stderr going to
+ * stderr. Returns 0 if all of them exited with 0, 1 otherwise. */
+int batch_run(int socket_fd, char **commands, int count, int parallelism);
+
+#endif /* VSOCK_SHELL_BATCH_CLIENT_H */
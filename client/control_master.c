@@ -0,0 +1,860 @@
+/*****************************************************************************/
+/*    vsock-shell - Connection master implementation                        */
+/*****************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "control_master.h"
+#include "../lib/message_queue.h"
+#include "../lib/transport.h"
+#include "../include/message.h"
+#include "../include/common.h"
+#include "../include/protocol.h"
+
+#define CONTROL_BACKLOG 16
+#define CONTROL_STDIO_FDS 3            /* stdin, stdout and stderr */
+#define MAX_WATCHES (2 + 4 * MAX_CONNECTION_CHANNELS)
+
+/* Output streams of a channel, stderr only carries exec sessions' */
+#define OUTPUT_STDOUT 0
+#define OUTPUT_STDERR 1
+#define OUTPUT_STREAMS 2
+
+/* Life of a channel, channel 0 of the connection stays unused */
+typedef enum {
+    CHANNEL_FREE = 0,
+    CHANNEL_ATTACHING,                 /* Waiting for the client's stdio */
+    CHANNEL_OPEN,
+    CHANNEL_ENDING,                    /* Closed by the server, output left */
+    CHANNEL_CLOSING                    /* Client gone, server not done yet */
+} ControlChannelState;
+
+/* Output the client's stdout or stderr has not taken yet */
+typedef struct {
+    int fd;                            /* -1 until received */
+    uint8_t *data;                     /* Allocated on first use */
+    uint32_t start;
+    uint32_t end;
+} ControlOutput;
+
+/* One client invocation running on the master's connection */
+typedef struct {
+    ControlChannelState state;
+    int control_fd;                    /* Connection from the client */
+    int input_fd;                      /* Its stdin, -1 once at EOF */
+    int started;                       /* Open message passed to the server */
+    int exec;                          /* Command runs without a PTY */
+    uint32_t input_credit;             /* Its stdin the server will take */
+    ControlOutput outputs[OUTPUT_STREAMS];
+    uint32_t consumed_credit;          /* Shared by both output streams */
+} ControlChannel;
+
+/* What a poll entry is watching */
+typedef enum {
+    WATCH_LISTENER = 0,
+    WATCH_SERVER,
+    WATCH_CONTROL,
+    WATCH_INPUT,
+    WATCH_OUTPUT,
+    WATCH_ERROR_OUTPUT
+} WatchKind;
+
+static ControlChannel channels[MAX_CONNECTION_CHANNELS];
+static int server_fd = -1;
+static int server_lost = 0;
+static volatile sig_atomic_t stop_requested = 0;
+
+/*****************************************************************************/
+static int connect_control_socket(const char *control_path)
+{
+    struct sockaddr_un addr;
+    int sock_fd;
+    
+    if (strlen(control_path) >= sizeof(addr.sun_path)) {
+        VSOCK_LOG_ERROR("Control path too long: %s", control_path);
+        return -1;
+    }
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, control_path);
+    
+    sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock_fd < 0) {
+        VSOCK_LOG_ERROR("Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+    
+    /* No master listening is not an error, the caller connects directly */
+    if (connect(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock_fd);
+        return -1;
+    }
+    
+    return sock_fd;
+}
+
+/*****************************************************************************/
+int control_master_connect(const char *control_path)
+{
+    int fds[CONTROL_STDIO_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr *cmsg;
+    struct msghdr header;
+    struct iovec iov;
+    char marker = 'S';
+    ssize_t result;
+    int control_fd;
+    
+    control_fd = connect_control_socket(control_path);
+    if (control_fd < 0) {
+        return -1;
+    }
+    
+    memset(&header, 0, sizeof(header));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = &marker;
+    iov.iov_len = 1;
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+    
+    cmsg = CMSG_FIRSTHDR(&header);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    
+    /* The descriptors travel with the first byte, frames follow it */
+    do {
+        result = sendmsg(control_fd, &header, 0);
+    } while (result < 0 && errno == EINTR);
+    
+    if (result < 0) {
+        VSOCK_LOG_ERROR("Failed to pass stdio to the master: %s",
+                        strerror(errno));
+        close(control_fd);
+        return -1;
+    }
+    
+    return control_fd;
+}
+
+/*****************************************************************************/
+static void handle_stop_signal(int signum)
+{
+    UNUSED(signum);
+    stop_requested = 1;
+}
+
+/*****************************************************************************/
+static int send_channel_message(int index, uint32_t type, const void *data,
+                                uint32_t length)
+{
+    Message msg;
+    
+    msg.type = type;
+    msg.length = length;
+    if (length > 0) {
+        memcpy(msg.data, data, length);
+    }
+    
+    return message_queue_write_channel(server_fd, index, &msg);
+}
+
+/*****************************************************************************/
+static void reset_outputs(ControlChannel *channel)
+{
+    ControlOutput *output;
+    int stream;
+    
+    for (stream = 0; stream < OUTPUT_STREAMS; stream++) {
+        output = &channel->outputs[stream];
+        if (output->fd >= 0) {
+            close(output->fd);
+        }
+        free(output->data);
+    
+        output->fd = -1;
+        output->data = NULL;
+        output->start = 0;
+        output->end = 0;
+    }
+}
+
+/*****************************************************************************/
+static int outputs_drained(const ControlChannel *channel)
+{
+    int stream;
+    
+    for (stream = 0; stream < OUTPUT_STREAMS; stream++) {
+        if (channel->outputs[stream].end > channel->outputs[stream].start) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+/*****************************************************************************/
+static void detach_client(ControlChannel *channel)
+{
+    Message msg;
+    
+    /* The client exits once it is told the session is over */
+    if (channel->control_fd >= 0 && 
+        channel->outputs[OUTPUT_STDOUT].fd >= 0) {
+        msg.type = MSG_TYPE_CLIENT_END;
+        msg.length = 0;
+        message_queue_write(channel->control_fd, &msg);
+        message_queue_flush_writes(channel->control_fd);
+        message_queue_destroy(channel->control_fd);
+    }
+    if (channel->control_fd >= 0) {
+        close(channel->control_fd);
+    }
+    
+    if (channel->input_fd >= 0) {
+        close(channel->input_fd);
+    }
+    reset_outputs(channel);
+    
+    channel->control_fd = -1;
+    channel->input_fd = -1;
+}
+
+/*****************************************************************************/
+static void close_channel(int index)
+{
+    ControlChannel *channel = &channels[index];
+    
+    /* The number stays taken until the server has closed its side */
+    if (channel->state == CHANNEL_OPEN) {
+        send_channel_message(index, MSG_TYPE_CHANNEL_CLOSE, NULL, 0);
+        channel->state = CHANNEL_CLOSING;
+    } else {
+        channel->state = CHANNEL_FREE;
+    }
+    
+    detach_client(channel);
+}
+
+/*****************************************************************************/
+static void attach_client(int listen_fd)
+{
+    ControlChannel *channel;
+    int control_fd;
+    int index;
+    
+    control_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (control_fd < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            VSOCK_LOG_ERROR("Failed to accept client: %s", strerror(errno));
+        }
+        return;
+    }
+    
+    for (index = 1; index < MAX_CONNECTION_CHANNELS; index++) {
+        if (channels[index].state == CHANNEL_FREE) {
+            break;
+        }
+    }
+    
+    if (index == MAX_CONNECTION_CHANNELS) {
+        VSOCK_LOG_ERROR("No free channel for another client");
+        close(control_fd);
+        return;
+    }
+    
+    channel = &channels[index];
+    memset(channel, 0, sizeof(*channel));
+    channel->state = CHANNEL_ATTACHING;
+    channel->control_fd = control_fd;
+    channel->input_fd = -1;
+    channel->outputs[OUTPUT_STDOUT].fd = -1;
+    channel->outputs[OUTPUT_STDERR].fd = -1;
+}
+
+/*****************************************************************************/
+static void close_passed_fds(struct cmsghdr *cmsg)
+{
+    int *fds = (int *)CMSG_DATA(cmsg);
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    size_t i;
+    
+    for (i = 0; i < count; i++) {
+        close(fds[i]);
+    }
+}
+
+/*****************************************************************************/
+static int receive_stdio(ControlChannel *channel)
+{
+    int fds[CONTROL_STDIO_FDS];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr *cmsg;
+    struct msghdr header;
+    struct iovec iov;
+    char marker;
+    ssize_t result;
+    
+    memset(&header, 0, sizeof(header));
+    iov.iov_base = &marker;
+    iov.iov_len = 1;
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+    
+    /* Only the first byte, the frames behind it go to the message queue */
+    do {
+        result = recvmsg(channel->control_fd, &header, MSG_CMSG_CLOEXEC);
+    } while (result < 0 && errno == EINTR);
+    
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (result <= 0) {
+        return -1;
+    }
+    
+    cmsg = CMSG_FIRSTHDR(&header);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS) {
+        VSOCK_LOG_ERROR("Client did not pass its stdio");
+        return -1;
+    }
+    
+    if (cmsg->cmsg_len != CMSG_LEN(sizeof(fds)) ||
+        (header.msg_flags & MSG_CTRUNC)) {
+        VSOCK_LOG_ERROR("Client passed unexpected descriptors");
+        close_passed_fds(cmsg);
+        return -1;
+    }
+    
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    channel->input_fd = fds[0];
+    channel->outputs[OUTPUT_STDOUT].fd = fds[1];
+    channel->outputs[OUTPUT_STDERR].fd = fds[2];
+    return 1;
+}
+
+/*****************************************************************************/
+static int open_channel(int index)
+{
+    ControlChannel *channel = &channels[index];
+    uint32_t credit = PTY_CREDIT_WINDOW;
+    
+    if (message_queue_init(channel->control_fd) < 0) {
+        VSOCK_LOG_ERROR("Failed to initialize message queue");
+        return -1;
+    }
+    
+    if (send_channel_message(index, MSG_TYPE_CHANNEL_OPEN, NULL, 0) < 0 ||
+        send_channel_message(index, MSG_TYPE_PTY_CREDIT, &credit,
+                             sizeof(credit)) < 0) {
+        VSOCK_LOG_ERROR("Failed to open channel %d", index);
+        return -1;
+    }
+    
+    channel->state = CHANNEL_OPEN;
+    VSOCK_LOG_INFO("Client attached on channel %d", index);
+    return 0;
+}
+
+/*****************************************************************************/
+static void queue_output(ControlOutput *output, const uint8_t *data,
+                         uint32_t length)
+{
+    /* The server never sends more output than the credit granted */
+    if (!output->data) {
+        output->data = (uint8_t *)malloc(PTY_CREDIT_WINDOW);
+        if (!output->data) {
+            VSOCK_LOG_ERROR("Failed to allocate output buffer, dropped");
+            return;
+        }
+    }
+    
+    /* Move what is left to the front once the tail runs out of room */
+    if (output->end + length > PTY_CREDIT_WINDOW) {
+        memmove(output->data, &output->data[output->start],
+                output->end - output->start);
+        output->end -= output->start;
+        output->start = 0;
+    }
+    
+    if (output->end + length > PTY_CREDIT_WINDOW) {
+        VSOCK_LOG_ERROR("PTY output beyond the credit granted, dropped");
+        return;
+    }
+    
+    memcpy(&output->data[output->end], data, length);
+    output->end += length;
+}
+
+/*****************************************************************************/
+static int write_output(int index, int stream)
+{
+    ControlChannel *channel = &channels[index];
+    ControlOutput *output = &channel->outputs[stream];
+    uint32_t length = output->end - output->start;
+    ssize_t bytes_written;
+    
+    /* A writable pipe takes this much without blocking the master */
+    if (length > PIPE_BUF) {
+        length = PIPE_BUF;
+    }
+    
+    bytes_written = write(output->fd, &output->data[output->start], length);
+    if (bytes_written < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+            return 0;
+        }
+        VSOCK_LOG_ERROR("Failed to write to client output: %s",
+                        strerror(errno));
+        return -1;
+    }
+    
+    output->start += bytes_written;
+    if (output->start == output->end) {
+        output->start = 0;
+        output->end = 0;
+    }
+    
+    /* Return the window in batches once the output has left us */
+    channel->consumed_credit += bytes_written;
+    if (channel->state == CHANNEL_OPEN &&
+        channel->consumed_credit >= PTY_CREDIT_WINDOW / 4) {
+        send_channel_message(index, MSG_TYPE_PTY_CREDIT,
+                             &channel->consumed_credit, sizeof(uint32_t));
+        channel->consumed_credit = 0;
+    }
+    
+    return 0;
+}
+
+/*****************************************************************************/
+static int read_input(int index)
+{
+    ControlChannel *channel = &channels[index];
+    uint32_t limit = MAX_MESSAGE_DATA;
+    ssize_t bytes_read;
+    Message *msg;
+    
+    if (channel->exec && channel->input_credit < limit) {
+        limit = channel->input_credit;
+    }
+    
+    /* Read stdin straight into the outgoing frame */
+    msg = message_queue_reserve(server_fd, MSG_TYPE_CLIENT_DATA, limit);
+    if (!msg) {
+        VSOCK_LOG_ERROR("Failed to send client data");
+        return -1;
+    }
+    msg->channel = index;
+    
+    bytes_read = read(channel->input_fd, msg->data, limit);
+    if (bytes_read > 0) {
+        if (channel->exec) {
+            channel->input_credit -= bytes_read;
+        }
+        return message_queue_commit(server_fd, msg, bytes_read);
+    }
+    message_queue_discard(server_fd, msg);
+    
+    if (bytes_read < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return 0;
+    }
+    
+    /* A command without a PTY sees the EOF and runs on to its exit */
+    if (bytes_read == 0 && channel->exec) {
+        close(channel->input_fd);
+        channel->input_fd = -1;
+        return send_channel_message(index, MSG_TYPE_CLIENT_EOF, NULL, 0);
+    }
+    
+    /* EOF on stdin ends the session, just as without a master */
+    VSOCK_LOG_INFO("EOF on stdin of channel %d", index);
+    return -1;
+}
+
+/*****************************************************************************/
+static int handle_control_message(void *context, int fd, Message *msg)
+{
+    ControlChannel *channel = (ControlChannel *)context;
+    
+    UNUSED(fd);
+    
+    switch (msg->type) {
+        case MSG_TYPE_OPEN_EXEC:
+        case MSG_TYPE_OPEN_ARGV:
+            channel->exec = 1;
+            channel->input_credit = EXEC_INPUT_WINDOW;
+            /* Fall through */
+        case MSG_TYPE_OPEN_BASH:
+        case MSG_TYPE_OPEN_CMD:
+            /* Input read from here on finds the session to take it */
+            channel->started = 1;
+            return message_queue_write_channel(server_fd, channel - channels,
+                                               msg);
+    
+        case MSG_TYPE_WINDOW_SIZE:
+            /* Passed on unchanged, on the client's channel */
+            return message_queue_write_channel(server_fd, channel - channels,
+                                               msg);
+    
+        default:
+            VSOCK_LOG_ERROR("Unexpected control message type: 0x%02X",
+                            msg->type);
+            return -1;
+    }
+}
+
+/*****************************************************************************/
+static int handle_server_message(void *context, int fd, Message *msg)
+{
+    ControlChannel *channel;
+    uint32_t credit;
+    
+    UNUSED(context);
+    UNUSED(fd);
+    
+    /* Channel 0 stays idle, nothing of interest arrives there */
+    if (msg->channel == 0 || msg->channel >= MAX_CONNECTION_CHANNELS) {
+        return 0;
+    }
+    channel = &channels[msg->channel];
+    
+    switch (msg->type) {
+        case MSG_TYPE_PTY_DATA:
+            if (channel->state == CHANNEL_OPEN) {
+                queue_output(&channel->outputs[OUTPUT_STDOUT], msg->data,
+                             msg->length);
+            }
+            break;
+    
+        case MSG_TYPE_STDERR_DATA:
+            if (channel->state == CHANNEL_OPEN) {
+                queue_output(&channel->outputs[OUTPUT_STDERR], msg->data,
+                             msg->length);
+            }
+            break;
+    
+        case MSG_TYPE_INPUT_CREDIT:
+            if (msg->length == sizeof(uint32_t)) {
+                memcpy(&credit, msg->data, sizeof(uint32_t));
+                channel->input_credit += credit;
+            }
+            break;
+    
+        case MSG_TYPE_EXIT_STATUS:
+            /* The client keeps it until its session ends */
+            if (channel->state == CHANNEL_OPEN) {
+                message_queue_write(channel->control_fd, msg);
+                message_queue_flush_writes(channel->control_fd);
+            }
+            break;
+    
+        case MSG_TYPE_CHANNEL_CLOSE:
+            /* Output already received still goes out before the client
+             * is let go */
+            if (channel->state == CHANNEL_OPEN) {
+                channel->state = CHANNEL_ENDING;
+            } else if (channel->state == CHANNEL_CLOSING) {
+                channel->state = CHANNEL_FREE;
+            }
+            break;
+    
+        default:
+            VSOCK_LOG_ERROR("Unexpected message type: 0x%02X", msg->type);
+            break;
+    }
+    
+    return 0;
+}
+
+/*****************************************************************************/
+static void handle_server_error(void *context, const char *error)
+{
+    UNUSED(context);
+    VSOCK_LOG_ERROR("Server connection: %s", error);
+    server_lost = 1;
+}
+
+/*****************************************************************************/
+static void finish_drained_channels(void)
+{
+    int index;
+    
+    for (index = 1; index < MAX_CONNECTION_CHANNELS; index++) {
+        if (channels[index].state == CHANNEL_ENDING &&
+            outputs_drained(&channels[index])) {
+            close_channel(index);
+        }
+    }
+}
+
+/*****************************************************************************/
+static int watched_fd(WatchKind kind, int index)
+{
+    switch (kind) {
+        case WATCH_CONTROL:
+            return channels[index].control_fd;
+        case WATCH_INPUT:
+            return channels[index].input_fd;
+        case WATCH_OUTPUT:
+            return channels[index].outputs[OUTPUT_STDOUT].fd;
+        case WATCH_ERROR_OUTPUT:
+            return channels[index].outputs[OUTPUT_STDERR].fd;
+        default:
+            return -1;
+    }
+}
+
+/*****************************************************************************/
+static void handle_channel_event(WatchKind kind, int index)
+{
+    ControlChannel *channel = &channels[index];
+    int result;
+    
+    switch (kind) {
+        case WATCH_CONTROL:
+            if (channel->state == CHANNEL_ATTACHING) {
+                result = receive_stdio(channel);
+                if (result > 0) {
+                    result = open_channel(index);
+                }
+            } else {
+                result = message_queue_read(channel, channel->control_fd,
+                                            handle_control_message, NULL);
+            }
+            break;
+        case WATCH_INPUT:
+            result = read_input(index);
+            break;
+        case WATCH_OUTPUT:
+            result = write_output(index, OUTPUT_STDOUT);
+            break;
+        case WATCH_ERROR_OUTPUT:
+            result = write_output(index, OUTPUT_STDERR);
+            break;
+        default:
+            result = 0;
+            break;
+    }
+    
+    if (result < 0) {
+        close_channel(index);
+    }
+}
+
+/*****************************************************************************/
+static void run_master_loop(int listen_fd)
+{
+    struct pollfd watches[MAX_WATCHES];
+    WatchKind kinds[MAX_WATCHES];
+    int owners[MAX_WATCHES];
+    ControlChannel *channel;
+    ControlOutput *output;
+    int watch_count;
+    int index;
+    int stream;
+    int i;
+    
+    while (!stop_requested && !server_lost) {
+        finish_drained_channels();
+    
+        if (message_queue_flush_writes(server_fd) < 0) {
+            break;
+        }
+    
+        watch_count = 0;
+        watches[watch_count].fd = listen_fd;
+        watches[watch_count].events = POLLIN;
+        kinds[watch_count++] = WATCH_LISTENER;
+    
+        watches[watch_count].fd = server_fd;
+        watches[watch_count].events = POLLIN;
+        if (message_queue_has_pending_writes(server_fd)) {
+            watches[watch_count].events |= POLLOUT;
+        }
+        kinds[watch_count++] = WATCH_SERVER;
+    
+        for (index = 1; index < MAX_CONNECTION_CHANNELS; index++) {
+            channel = &channels[index];
+            if (channel->control_fd < 0 || channel->state == CHANNEL_FREE) {
+                continue;
+            }
+    
+            watches[watch_count].fd = channel->control_fd;
+            watches[watch_count].events = POLLIN;
+            kinds[watch_count] = WATCH_CONTROL;
+            owners[watch_count++] = index;
+    
+            /* Client input waits for its session, its input credit and
+             * while the connection is backed up */
+            if (channel->state == CHANNEL_OPEN && channel->started &&
+                channel->input_fd >= 0 &&
+                (!channel->exec || channel->input_credit > 0) &&
+                !message_queue_is_saturated(server_fd)) {
+                watches[watch_count].fd = channel->input_fd;
+                watches[watch_count].events = POLLIN;
+                kinds[watch_count] = WATCH_INPUT;
+                owners[watch_count++] = index;
+            }
+    
+            for (stream = 0; stream < OUTPUT_STREAMS; stream++) {
+                output = &channel->outputs[stream];
+                if (output->end > output->start) {
+                    watches[watch_count].fd = output->fd;
+                    watches[watch_count].events = POLLOUT;
+                    kinds[watch_count] = stream == OUTPUT_STDOUT ? 
+                                         WATCH_OUTPUT : WATCH_ERROR_OUTPUT;
+                    owners[watch_count++] = index;
+                }
+            }
+        }
+    
+        if (poll(watches, watch_count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            VSOCK_LOG_ERROR("Poll error: %s", strerror(errno));
+            break;
+        }
+    
+        for (i = 0; i < watch_count && !server_lost; i++) {
+            if (!watches[i].revents) {
+                continue;
+            }
+    
+            if (kinds[i] == WATCH_LISTENER) {
+                attach_client(listen_fd);
+            } else if (kinds[i] == WATCH_SERVER) {
+                if (watches[i].revents & ~POLLOUT) {
+                    message_queue_read(NULL, server_fd, handle_server_message,
+                                       handle_server_error);
+                }
+            } else if (watched_fd(kinds[i], owners[i]) == watches[i].fd) {
+                /* Skipped if the channel went away earlier in this pass */
+                handle_channel_event(kinds[i], owners[i]);
+            }
+        }
+    }
+}
+
+/*****************************************************************************/
+static void detach_from_caller(void)
+{
+    int null_fd;
+    
+    /* Scripts waiting for our output must not wait for the master */
+    setsid();
+    
+    null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        if (null_fd > STDERR_FILENO) {
+            close(null_fd);
+        }
+    }
+}
+
+/*****************************************************************************/
+int control_master_start(int socket_fd, const char *control_path)
+{
+    TransportAddress address;
+    struct sigaction sa;
+    mode_t saved_umask;
+    int listen_fd;
+    int probe_fd;
+    int index;
+    pid_t pid;
+    
+    /* Never take over the socket of a master that is still running */
+    probe_fd = connect_control_socket(control_path);
+    if (probe_fd >= 0) {
+        close(probe_fd);
+        VSOCK_LOG_ERROR("A control master is already running at %s",
+                        control_path);
+        return -1;
+    }
+    
+    memset(&address, 0, sizeof(address));
+    address.type = TRANSPORT_UNIX;
+    snprintf(address.path, sizeof(address.path), "%s", control_path);
+    
+    /* Whoever can connect runs commands on the guest, keep it private */
+    saved_umask = umask(0077);
+    listen_fd = transport_listen(&address, CONTROL_BACKLOG);
+    umask(saved_umask);
+    if (listen_fd < 0) {
+        return -1;
+    }
+    
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) {
+        VSOCK_LOG_ERROR("Failed to fork control master: %s", strerror(errno));
+        transport_close_listener(listen_fd, &address);
+        return -1;
+    }
+    
+    if (pid > 0) {
+        printf("Control master running at %s (pid %d)\n", control_path,
+               (int)pid);
+        close(listen_fd);
+        return 0;
+    }
+    
+    detach_from_caller();
+    
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    
+    /* Never block on the server, a slow channel would stall the rest */
+    server_fd = socket_fd;
+    if (fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK) < 0 ||
+        message_queue_init(server_fd) < 0) {
+        VSOCK_LOG_ERROR("Failed to set up the server connection");
+        transport_close_listener(listen_fd, &address);
+        exit(EXIT_FAILURE);
+    }
+    
+    for (index = 0; index < MAX_CONNECTION_CHANNELS; index++) {
+        channels[index].control_fd = -1;
+        channels[index].input_fd = -1;
+        channels[index].outputs[OUTPUT_STDOUT].fd = -1;
+        channels[index].outputs[OUTPUT_STDERR].fd = -1;
+    }
+    
+    VSOCK_LOG_INFO("Control master listening on %s", control_path);
+    run_master_loop(listen_fd);
+    VSOCK_LOG_INFO("Control master exiting");
+    
+    /* Clients still attached see their session end */
+    for (index = 1; index < MAX_CONNECTION_CHANNELS; index++) {
+        detach_client(&channels[index]);
+    }
+    
+    transport_close_listener(listen_fd, &address);
+    message_queue_destroy(server_fd);
+    close(server_fd);
+    closelog();
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,17 @@
+/*****************************************************************************/
+/*    vsock-shell - Connection master interface                             */
+/*****************************************************************************/
+#ifndef VSOCK_SHELL_CONTROL_MASTER_H
+#define VSOCK_SHELL_CONTROL_MASTER_H
+
+/* Keeps the server connection open in a background process listening on
+ * control_path. Returns in the calling process once the master runs, or
+ * -1 if it could not be started. */
+int control_master_start(int socket_fd, const char *control_path);
+
+/* Hands stdin and stdout over to the master at control_path, which then
+ * runs the session as a channel of its connection. Returns the control
+ * connection, or -1 when no master is listening there. */
+int control_master_connect(const char *control_path);
+
+#endif /* VSOCK_SHELL_CONTROL_MASTER_H */
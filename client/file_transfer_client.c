@@ -18,6 +18,8 @@
 
 static int file_descriptor = -1;
 static int transfer_complete = 0;
+static int data_begin_sent = 0;
+static uint32_t frame_data_size = MAX_MESSAGE_DATA;
 
 /*****************************************************************************/
 static int validate_upload_path(const char *local_path, const char *remote_dir,
@@ -70,6 +72,43 @@ static int validate_download_path(const char *remote_path, const char *local_dir
     return 0;
 }
 
+/*****************************************************************************/
+static void handle_frame_size_offer(int socket_fd, Message *msg)
+{
+    Message response_msg;
+    uint32_t offered;
+    
+    if (msg->length != sizeof(uint32_t)) {
+        VSOCK_LOG_ERROR("Invalid frame size offer length: %u", msg->length);
+        return;
+    }
+    
+    memcpy(&offered, msg->data, sizeof(uint32_t));
+    if (offered > MAX_LARGE_MESSAGE_DATA) {
+        offered = MAX_LARGE_MESSAGE_DATA;
+    }
+    
+    /* Only a server that offers large frames gets asked for them, an
+     * older one would end the connection on the request */
+    if (offered <= MAX_MESSAGE_DATA || 
+        message_queue_set_max_frame(socket_fd, offered) < 0) {
+        return;
+    }
+    
+    /* Accept with the size we use, the server sends up to it from now */
+    response_msg.type = MSG_TYPE_MAX_FRAME_SIZE;
+    response_msg.length = sizeof(uint32_t);
+    memcpy(response_msg.data, &offered, sizeof(uint32_t));
+    
+    if (message_queue_write(socket_fd, &response_msg) < 0) {
+        VSOCK_LOG_ERROR("Failed to accept large frames");
+        return;
+    }
+    
+    frame_data_size = offered;
+    VSOCK_LOG_INFO("Using frames of up to %u bytes", offered);
+}
+
 /*****************************************************************************/
 static void send_upload_request(int socket_fd, const char *local_path,
                                 const char *remote_full_path)
@@ -104,6 +143,7 @@ static void send_download_request(int socket_fd, const char *remote_path,
 static void send_file_data(int socket_fd)
 {
     Message msg;
+    Message *data_msg;
     ssize_t bytes_read;
     
     if (file_descriptor < 0) {
@@ -111,17 +151,31 @@ static void send_file_data(int socket_fd)
         return;
     }
     
-    /* Send begin marker */
-    msg.type = MSG_TYPE_FILE_DATA_BEGIN;
-    msg.length = 0;
-    if (message_queue_write(socket_fd, &msg) < 0) {
-        VSOCK_LOG_ERROR("Failed to send data begin marker");
-        return;
+    /* Send begin marker on first call */
+    if (!data_begin_sent) {
+        msg.type = MSG_TYPE_FILE_DATA_BEGIN;
+        msg.length = 0;
+        if (message_queue_write(socket_fd, &msg) < 0) {
+            VSOCK_LOG_ERROR("Failed to send data begin marker");
+            return;
+        }
+        
+        data_begin_sent = 1;
     }
     
-    /* Send file data in chunks */
+    /* Send file data in chunks, read straight into outgoing frames */
     while (1) {
-        bytes_read = read(file_descriptor, msg.data, MAX_MESSAGE_DATA);
+        data_msg = message_queue_reserve(socket_fd, MSG_TYPE_FILE_DATA,
+                                         frame_data_size);
+        if (!data_msg) {
+            /* Retry once the queue has drained */
+            return;
+        }
+        
+        bytes_read = read(file_descriptor, data_msg->data, frame_data_size);
+        if (bytes_read <= 0) {
+            message_queue_discard(socket_fd, data_msg);
+        }
         
         if (bytes_read < 0) {
             VSOCK_LOG_ERROR("Failed to read file: %s", strerror(errno));
@@ -135,10 +189,7 @@ static void send_file_data(int socket_fd)
             break;
         }
         
-        msg.type = MSG_TYPE_FILE_DATA;
-        msg.length = bytes_read;
-        
-        if (message_queue_write(socket_fd, &msg) < 0) {
+        if (message_queue_commit(socket_fd, data_msg, bytes_read) < 0) {
             VSOCK_LOG_ERROR("Failed to send file data");
             close(file_descriptor);
             file_descriptor = -1;
@@ -169,21 +220,25 @@ static void send_file_data(int socket_fd)
 static int handle_upload_message(void *context, int fd, Message *msg)
 {
     int socket_fd = *(int *)context;
-    char response[MAX_PATH_LENGTH];
+    char *response;
     
     UNUSED(fd);
     
     switch (msg->type) {
+        case MSG_TYPE_MAX_FRAME_SIZE:
+            handle_frame_size_offer(socket_fd, msg);
+            break;
+            
         case MSG_TYPE_FILE_READY_SEND:
             /* Server ready to receive */
-            memcpy(response, msg->data, msg->length);
-            response[msg->length] = '\0';
+            response = message_payload_string(msg);
             
-            if (strncmp(response, "OK", 2) == 0) {
+            if (response && strncmp(response, "OK", 2) == 0) {
                 VSOCK_LOG_INFO("Server ready, starting upload");
                 send_file_data(socket_fd);
             } else {
-                VSOCK_LOG_ERROR("Server rejected upload: %s", response);
+                VSOCK_LOG_ERROR("Server rejected upload: %s", 
+                                response ? response : "invalid response");
                 transfer_complete = 1;
             }
             break;
@@ -208,24 +263,32 @@ static int handle_download_message(void *context, int fd, Message *msg)
     ssize_t bytes_written;
     Message response_msg;
     int socket_fd = *(int *)context;
-    char response[MAX_PATH_LENGTH];
+    char *response;
     
     UNUSED(fd);
     
     switch (msg->type) {
+        case MSG_TYPE_MAX_FRAME_SIZE:
+            handle_frame_size_offer(socket_fd, msg);
+            break;
+            
         case MSG_TYPE_FILE_READY_RECV:
             /* Server ready to send */
-            memcpy(response, msg->data, msg->length);
-            response[msg->length] = '\0';
+            response = message_payload_string(msg);
             
-            if (strncmp(response, "OK", 2) == 0) {
+            if (response && strncmp(response, "OK", 2) == 0) {
                 VSOCK_LOG_INFO("Server ready, starting download");
             } else {
-                VSOCK_LOG_ERROR("Server rejected download: %s", response);
+                VSOCK_LOG_ERROR("Server rejected download: %s", 
+                                response ? response : "invalid response");
                 transfer_complete = 1;
             }
             break;
             
+        case MSG_TYPE_FILE_DATA_BEGIN:
+            /* File data follows */
+            break;
+            
         case MSG_TYPE_FILE_DATA:
             /* Receive file data */
             if (file_descriptor < 0) {
@@ -278,6 +341,7 @@ void file_transfer_run_upload_loop(int socket_fd, const char *local_path,
 {
     char remote_full_path[MAX_PATH_LENGTH];
     fd_set read_fds;
+    fd_set write_fds;
     
     /* Validate paths */
     if (validate_upload_path(local_path, remote_dir, 
@@ -298,16 +362,27 @@ void file_transfer_run_upload_loop(int socket_fd, const char *local_path,
         VSOCK_LOG_FATAL("Failed to initialize message queue");
     }
     
-    /* Send upload request */
+    /* Large frames are used once the server offers them */
+    frame_data_size = MAX_MESSAGE_DATA;
     send_upload_request(socket_fd, local_path, remote_full_path);
     transfer_complete = 0;
+    data_begin_sent = 0;
     
     /* Event loop */
     while (!transfer_complete) {
+        /* Send queued requests before waiting for the reply */
+        message_queue_flush_writes(socket_fd);
+        
         FD_ZERO(&read_fds);
         FD_SET(socket_fd, &read_fds);
         
-        if (select(socket_fd + 1, &read_fds, NULL, NULL, NULL) < 0) {
+        /* Wake up on writability while file data remains to be sent */
+        FD_ZERO(&write_fds);
+        if (data_begin_sent && file_descriptor >= 0) {
+            FD_SET(socket_fd, &write_fds);
+        }
+        
+        if (select(socket_fd + 1, &read_fds, &write_fds, NULL, NULL) < 0) {
             if (errno == EINTR) {
                 continue;
             }
@@ -321,13 +396,15 @@ void file_transfer_run_upload_loop(int socket_fd, const char *local_path,
         }
         
         /* Continue sending if not saturated */
-        if (file_descriptor >= 0 && !message_queue_is_saturated(socket_fd)) {
+        if (data_begin_sent && file_descriptor >= 0 &&
+            !message_queue_is_saturated(socket_fd)) {
             send_file_data(socket_fd);
         }
-        
-        message_queue_flush_writes(socket_fd);
     }
     
+    /* Send anything queued by the last message */
+    message_queue_flush_writes(socket_fd);
+    
     /* Cleanup */
     if (file_descriptor >= 0) {
         close(file_descriptor);
@@ -362,12 +439,16 @@ void file_transfer_run_download_loop(int socket_fd, const char *remote_path,
         VSOCK_LOG_FATAL("Failed to initialize message queue");
     }
     
-    /* Send download request */
+    /* Large frames are taken once the server offers them */
+    frame_data_size = MAX_MESSAGE_DATA;
     send_download_request(socket_fd, remote_path, local_full_path);
     transfer_complete = 0;
     
     /* Event loop */
     while (!transfer_complete) {
+        /* Send queued requests before waiting for the reply */
+        message_queue_flush_writes(socket_fd);
+        
         FD_ZERO(&read_fds);
         FD_SET(socket_fd, &read_fds);
         
@@ -383,10 +464,11 @@ void file_transfer_run_download_loop(int socket_fd, const char *remote_path,
             message_queue_read(&socket_fd, socket_fd,
                              handle_download_message, handle_transfer_error);
         }
-        
-        message_queue_flush_writes(socket_fd);
     }
     
+    /* Send anything queued by the last message */
+    message_queue_flush_writes(socket_fd);
+    
     /* Cleanup */
     if (file_descriptor >= 0) {
         close(file_descriptor);
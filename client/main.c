@@ -3,59 +3,85 @@
 /*****************************************************************************/
 #include <errno.h>
 #include <getopt.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/socket.h>
-#include <linux/vm_sockets.h>
 #include "terminal_client.h"
 #include "file_transfer_client.h"
+#include "control_master.h"
+#include "batch_client.h"
+#include "../lib/transport.h"
 #include "common.h"
+#include "../include/protocol.h"
+
+#define DEFAULT_BATCH_PARALLELISM 8
 
 static void print_usage(const char *program_name)
 {
-    printf("Usage: %s [OPTIONS]\n\n", program_name);
+    printf("Usage: %s [OPTIONS] [--argv PROGRAM [ARGS...]]\n\n", program_name);
     printf("Options:\n");
-    printf("  --cid CID          Guest VM context ID (required)\n");
+    printf("  --cid CID          Guest VM context ID (required for vsock)\n");
     printf("  --port PORT        Server port number (default: 9999)\n");
+    printf("  --transport TYPE   vsock, local or unix (default: vsock)\n");
+    printf("  --socket PATH      Socket path for the unix transport\n");
     printf("  --cmd COMMAND      Execute command instead of shell\n");
+    printf("  --exec COMMAND     Execute command without a PTY: output untouched,\n");
+    printf("                     stderr kept apart, exits with its exit status\n");
+    printf("  --argv             Run the remaining arguments like --exec, but\n");
+    printf("                     directly instead of through a shell\n");
+    printf("  --env NAME=VALUE   Set in the environment of --argv, repeatable\n");
+    printf("  --cwd DIR          Working directory of --argv\n");
+    printf("  --batch FILE       Run the commands in FILE, one per line (- for\n");
+    printf("                     stdin), in one request; each one's output and\n");
+    printf("                     exit status is printed as soon as it finishes\n");
+    printf("  --parallel N       Commands of --batch run at once (default: %d)\n",
+           DEFAULT_BATCH_PARALLELISM);
     printf("  --upload FILE      Upload file to guest\n");
     printf("  --download FILE    Download file from guest\n");
     printf("  --remote-dir DIR   Remote directory for upload (default: /tmp)\n");
     printf("  --local-dir DIR    Local directory for download (default: ./)\n");
+    printf("  --control-path P   Run shells and commands through the master at P\n");
+    printf("  --control-master   Keep the connection open in the background for\n");
+    printf("                     later invocations using the same --control-path\n");
     printf("  --help             Show this help message\n\n");
     printf("Examples:\n");
     printf("  %s --cid 3 --port 9999\n", program_name);
     printf("  %s --cid 3 --cmd \"ls -la /tmp\"\n", program_name);
+    printf("  %s --cid 3 --exec \"tar cz /etc\" > etc.tar.gz\n", program_name);
+    printf("  %s --cid 3 --cwd /var/log --argv grep -r \"disk full\" .\n",
+           program_name);
+    printf("  %s --cid 3 --batch probes.txt --parallel 4\n", program_name);
     printf("  %s --cid 3 --upload file.txt --remote-dir /tmp\n", program_name);
     printf("  %s --cid 3 --download /etc/hostname --local-dir ./\n", program_name);
+    printf("  %s --transport unix --socket /tmp/vsock-shell.sock --cmd uptime\n",
+           program_name);
+    printf("  %s --cid 3 --control-path /tmp/vs-3.ctl --control-master\n",
+           program_name);
+    printf("  %s --cid 3 --control-path /tmp/vs-3.ctl --cmd uptime\n",
+           program_name);
 }
 
-static int connect_to_server(unsigned int cid, unsigned int port)
+static int connect_to_server(const TransportAddress *address, int verbose)
 {
+    char description[MAX_PATH_LENGTH + 32];
     int sock_fd;
-    struct sockaddr_vm addr;
-    
-    /* Create vsock socket */
-    sock_fd = socket(AF_VSOCK, SOCK_STREAM, 0);
-    if (sock_fd < 0) {
-        VSOCK_LOG_FATAL("Failed to create socket: %s", strerror(errno));
-    }
     
-    /* Configure server address */
-    memset(&addr, 0, sizeof(addr));
-    addr.svm_family = AF_VSOCK;
-    addr.svm_cid = cid;
-    addr.svm_port = port;
+    transport_describe(address, description, sizeof(description));
     
     /* Connect to server */
-    printf("Connecting to CID %u on port %u...\n", cid, port);
-    if (connect(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        VSOCK_LOG_FATAL("Failed to connect: %s", strerror(errno));
+    if (verbose) {
+        printf("Connecting to %s...\n", description);
+    }
+    sock_fd = transport_connect(address);
+    if (sock_fd < 0) {
+        VSOCK_LOG_FATAL("Failed to connect to %s", description);
     }
     
-    printf("Connected successfully\n");
+    if (verbose) {
+        printf("Connected successfully\n");
+    }
     return sock_fd;
 }
 
@@ -63,30 +89,57 @@ int main(int argc, char *argv[])
 {
     int option_index = 0;
     int c;
-    unsigned int cid = 0;
-    unsigned int port = 9999;
+    TransportAddress address;
     char *command = NULL;
     char *upload_file = NULL;
     char *download_file = NULL;
     char *remote_dir = "/tmp";
     char *local_dir = ".";
+    char *control_path = NULL;
+    int control_master = 0;
+    int use_pty = 1;
+    int direct = 0;
+    char *env[MAX_EXEC_ARGS + 1];
+    int env_count = 0;
+    char *cwd = NULL;
+    char *batch_file = NULL;
+    char **batch_commands = NULL;
+    int batch_count = 0;
+    int parallelism = DEFAULT_BATCH_PARALLELISM;
+    SessionRequest request;
+    int exit_status = EXIT_SUCCESS;
+    int control_fd;
     int sock_fd;
     
     static struct option long_options[] = {
         {"cid",        required_argument, 0, 'c'},
         {"port",       required_argument, 0, 'p'},
+        {"transport",  required_argument, 0, 't'},
+        {"socket",     required_argument, 0, 's'},
         {"cmd",        required_argument, 0, 'x'},
+        {"exec",       required_argument, 0, 'e'},
+        {"argv",       no_argument,       0, 'A'},
+        {"env",        required_argument, 0, 'E'},
+        {"cwd",        required_argument, 0, 'C'},
+        {"batch",      required_argument, 0, 'b'},
+        {"parallel",   required_argument, 0, 'P'},
         {"upload",     required_argument, 0, 'u'},
         {"download",   required_argument, 0, 'd'},
         {"remote-dir", required_argument, 0, 'r'},
         {"local-dir",  required_argument, 0, 'l'},
+        {"control-path", required_argument, 0, 'S'},
+        {"control-master", no_argument,   0, 'M'},
         {"help",       no_argument,       0, 'h'},
         {0, 0, 0, 0}
     };
     
-    /* Parse command line arguments */
+    memset(&address, 0, sizeof(address));
+    address.type = TRANSPORT_VSOCK;
+    address.port = 9999;
+    
+    /* Parse command line arguments, up to the program run by --argv */
     while (1) {
-        c = getopt_long(argc, argv, "c:p:x:u:d:r:l:h", 
+        c = getopt_long(argc, argv, "+c:p:t:s:x:e:AE:C:b:P:u:d:r:l:S:Mh", 
                        long_options, &option_index);
         
         if (c == -1) {
@@ -95,13 +148,54 @@ int main(int argc, char *argv[])
         
         switch (c) {
             case 'c':
-                cid = parse_integer(optarg);
+                address.cid = parse_integer(optarg);
                 break;
             case 'p':
-                port = parse_integer(optarg);
+                address.port = parse_integer(optarg);
+                break;
+            case 't':
+                if (transport_parse_type(optarg, &address.type) < 0) {
+                    fprintf(stderr, "Error: unknown transport '%s'\n\n", optarg);
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 's':
+                snprintf(address.path, sizeof(address.path), "%s", optarg);
                 break;
             case 'x':
                 command = optarg;
+                use_pty = 1;
+                break;
+            case 'e':
+                command = optarg;
+                use_pty = 0;
+                break;
+            case 'A':
+                direct = 1;
+                break;
+            case 'E':
+                if (env_count == MAX_EXEC_ARGS || !strchr(optarg, '=')) {
+                    fprintf(stderr, "Error: invalid --env '%s'\n\n", optarg);
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                env[env_count++] = optarg;
+                break;
+            case 'C':
+                cwd = optarg;
+                break;
+            case 'b':
+                batch_file = optarg;
+                break;
+            case 'P':
+                parallelism = parse_integer(optarg);
+                if (parallelism < 1 || parallelism > MAX_CONNECTION_CHANNELS) {
+                    fprintf(stderr, "Error: --parallel takes 1 to %d\n\n",
+                            MAX_CONNECTION_CHANNELS);
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
                 break;
             case 'u':
                 upload_file = optarg;
@@ -115,6 +209,12 @@ int main(int argc, char *argv[])
             case 'l':
                 local_dir = optarg;
                 break;
+            case 'S':
+                control_path = optarg;
+                break;
+            case 'M':
+                control_master = 1;
+                break;
             case 'h':
                 print_usage(argv[0]);
                 return EXIT_SUCCESS;
@@ -125,38 +225,119 @@ int main(int argc, char *argv[])
     }
     
     /* Validate required arguments */
-    if (cid == 0) {
+    if (address.type == TRANSPORT_VSOCK && address.cid == 0) {
         fprintf(stderr, "Error: --cid is required\n\n");
         print_usage(argv[0]);
         return EXIT_FAILURE;
     }
     
+    if (address.type == TRANSPORT_UNIX && address.path[0] == '\0') {
+        fprintf(stderr, "Error: --socket is required for the unix transport\n\n");
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    if (direct && (optind == argc || command || upload_file || download_file)) {
+        fprintf(stderr, "Error: --argv takes a program and no other "
+                "operation\n\n");
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    if (!direct && (optind < argc || env_count > 0 || cwd)) {
+        fprintf(stderr, "Error: arguments, --env and --cwd need --argv\n\n");
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    if (batch_file && (command || direct || upload_file || download_file)) {
+        fprintf(stderr, "Error: --batch takes no other operation\n\n");
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    if (control_master && 
+        (!control_path || command || direct || batch_file || upload_file || 
+         download_file)) {
+        fprintf(stderr, "Error: --control-master takes a --control-path "
+                "and no operation\n\n");
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    if (batch_file) {
+        batch_count = batch_load_commands(batch_file, &batch_commands);
+        if (batch_count < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+    
+    env[env_count] = NULL;
+    memset(&request, 0, sizeof(request));
+    request.command = command;
+    request.use_pty = use_pty && !direct;
+    if (direct) {
+        request.argv = &argv[optind];
+        request.env = env;
+        request.cwd = cwd;
+    }
+    
     /* Open syslog */
     openlog("vsock-shell-client", LOG_PID, LOG_USER);
     
+    /* Report a closed connection as EPIPE instead of dying */
+    signal(SIGPIPE, SIG_IGN);
+    
+    /* Terminal sessions run on the master's connection when one is up,
+     * without one they connect directly. A batch needs a connection of
+     * its own for the channels it opens. */
+    if (control_path && !control_master && !batch_file && !upload_file && 
+        !download_file) {
+        control_fd = control_master_connect(control_path);
+        if (control_fd >= 0) {
+            exit_status = terminal_session_attach(control_fd, &request);
+            close(control_fd);
+            closelog();
+            return exit_status;
+        }
+    }
+    
     /* Connect to server */
-    sock_fd = connect_to_server(cid, port);
+    sock_fd = connect_to_server(&address, request.use_pty && !batch_file);
+    
+    if (control_master) {
+        if (control_master_start(sock_fd, control_path) < 0) {
+            VSOCK_LOG_FATAL("Failed to start control master at %s", 
+                            control_path);
+        }
+        close(sock_fd);
+        closelog();
+        return EXIT_SUCCESS;
+    }
     
     /* Execute requested operation */
-    if (upload_file) {
+    if (batch_file) {
+        exit_status = batch_run(sock_fd, batch_commands, batch_count, 
+                                parallelism);
+    } else if (upload_file) {
         printf("Uploading '%s' to '%s' on guest...\n", upload_file, remote_dir);
         file_transfer_run_upload_loop(sock_fd, upload_file, remote_dir);
     } else if (download_file) {
         printf("Downloading '%s' to '%s' on host...\n", download_file, local_dir);
         file_transfer_run_download_loop(sock_fd, download_file, local_dir);
     } else {
-        /* Terminal session */
-        if (command) {
+        /* Terminal session, the output of --exec is left untouched */
+        if (command && request.use_pty) {
             printf("Executing: %s\n", command);
-        } else {
+        } else if (!command && !direct) {
             printf("Starting interactive shell...\n");
         }
-        terminal_session_run(sock_fd, command);
+        exit_status = terminal_session_run(sock_fd, &request);
     }
     
     /* Cleanup */
     close(sock_fd);
     closelog();
     
-    return EXIT_SUCCESS;
+    return exit_status;
 }
@@ -20,6 +20,15 @@
 static struct termios original_termios;
 static struct termios current_termios;
 static int window_change_pipe_fd = -1;
+static uint32_t consumed_credit = 0;
+static int credit_granted = 0;         /* The server offered to window */
+
+/* Shared with the message callbacks of a session loop */
+typedef struct {
+    int active;
+    int exit_status;                   /* As reported by an exec session */
+    uint32_t input_credit;             /* Exec stdin the server will take */
+} SessionState;
 
 /*****************************************************************************/
 void terminal_restore_mode(void)
@@ -117,14 +126,72 @@ void terminal_setup_sigwinch_handler(int signal_pipe_fd)
 }
 
 /*****************************************************************************/
-static void send_open_session_message(int socket_fd, const char *command)
+static int append_payload_string(Message *msg, const char *string)
+{
+    size_t length = strlen(string) + 1;
+    
+    if (length > MAX_MESSAGE_DATA - msg->length) {
+        return -1;
+    }
+    
+    memcpy(&msg->data[msg->length], string, length);
+    msg->length += length;
+    return 0;
+}
+
+/*****************************************************************************/
+static int encode_argv_message(const SessionRequest *request, Message *msg)
+{
+    uint32_t counts[2] = {0, 0};
+    int i;
+    
+    while (request->argv[counts[0]]) {
+        counts[0]++;
+    }
+    while (request->env && request->env[counts[1]]) {
+        counts[1]++;
+    }
+    
+    if (counts[0] > MAX_EXEC_ARGS || counts[1] > MAX_EXEC_ARGS) {
+        return -1;
+    }
+    
+    msg->type = MSG_TYPE_OPEN_ARGV;
+    msg->length = sizeof(counts);
+    memcpy(msg->data, counts, sizeof(counts));
+    
+    for (i = 0; i < (int)counts[0]; i++) {
+        if (append_payload_string(msg, request->argv[i]) < 0) {
+            return -1;
+        }
+    }
+    for (i = 0; i < (int)counts[1]; i++) {
+        if (append_payload_string(msg, request->env[i]) < 0) {
+            return -1;
+        }
+    }
+    
+    if (request->cwd && append_payload_string(msg, request->cwd) < 0) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+/*****************************************************************************/
+static void send_open_session_message(int socket_fd, 
+                                      const SessionRequest *request)
 {
     Message msg;
     
-    if (command) {
-        msg.type = MSG_TYPE_OPEN_CMD;
+    if (request->argv) {
+        if (encode_argv_message(request, &msg) < 0) {
+            VSOCK_LOG_FATAL("Command line too long");
+        }
+    } else if (request->command) {
+        msg.type = request->use_pty ? MSG_TYPE_OPEN_CMD : MSG_TYPE_OPEN_EXEC;
         msg.length = snprintf((char *)msg.data, MAX_MESSAGE_DATA, 
-                             "%s", command) + 1;
+                             "%s", request->command) + 1;
     } else {
         msg.type = MSG_TYPE_OPEN_BASH;
         msg.length = 0;
@@ -136,22 +203,108 @@ static void send_open_session_message(int socket_fd, const char *command)
 }
 
 /*****************************************************************************/
-static int handle_server_message(void *context, int fd, Message *msg)
+static void send_pty_credit(int socket_fd, uint32_t credit)
+{
+    Message msg;
+    
+    msg.type = MSG_TYPE_PTY_CREDIT;
+    msg.length = sizeof(uint32_t);
+    memcpy(msg.data, &credit, sizeof(uint32_t));
+    
+    if (message_queue_write(socket_fd, &msg) < 0) {
+        VSOCK_LOG_ERROR("Failed to send PTY credit");
+    }
+}
+
+/*****************************************************************************/
+static void send_client_eof(int socket_fd)
 {
-    int *session_active = (int *)context;
-    UNUSED(fd);
+    Message msg;
+    
+    msg.type = MSG_TYPE_CLIENT_EOF;
+    msg.length = 0;
+    
+    if (message_queue_write(socket_fd, &msg) < 0) {
+        VSOCK_LOG_ERROR("Failed to send end of input");
+    }
+}
+
+/*****************************************************************************/
+static void write_pty_output(int socket_fd, int output_fd, const uint8_t *data,
+                             uint32_t length)
+{
+    uint32_t offset = 0;
+    ssize_t bytes_written;
+    
+    /* Write PTY data to stdout (or stderr), all of it */
+    while (offset < length) {
+        bytes_written = write(output_fd, &data[offset], length - offset);
+        
+        if (bytes_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            VSOCK_LOG_ERROR("Failed to write output: %s", strerror(errno));
+            break;
+        }
+        
+        offset += bytes_written;
+    }
+    
+    /* Return the window in batches once the output has left us */
+    consumed_credit += length;
+    if (credit_granted && consumed_credit >= PTY_CREDIT_WINDOW / 4) {
+        send_pty_credit(socket_fd, consumed_credit);
+        consumed_credit = 0;
+    }
+}
 
+/*****************************************************************************/
+static int handle_server_message(void *context, int fd, Message *msg)
+{
+    SessionState *state = (SessionState *)context;
+    int32_t status;
+    uint32_t credit;
+    
     switch (msg->type) {
         case MSG_TYPE_PTY_DATA:
-            /* Write PTY data to stdout */
-            if (write(STDOUT_FILENO, msg->data, msg->length) < 0) {
-                VSOCK_LOG_ERROR("Failed to write to stdout: %s", strerror(errno));
+            write_pty_output(fd, STDOUT_FILENO, msg->data, msg->length);
+            break;
+            
+        case MSG_TYPE_STDERR_DATA:
+            write_pty_output(fd, STDERR_FILENO, msg->data, msg->length);
+            break;
+            
+        case MSG_TYPE_EXIT_STATUS:
+            if (msg->length != sizeof(int32_t)) {
+                VSOCK_LOG_ERROR("Invalid exit status length: %u", msg->length);
+                break;
+            }
+            memcpy(&status, msg->data, sizeof(int32_t));
+            state->exit_status = status;
+            break;
+            
+        case MSG_TYPE_INPUT_CREDIT:
+            if (msg->length != sizeof(uint32_t)) {
+                VSOCK_LOG_ERROR("Invalid input credit length: %u", msg->length);
+                break;
+            }
+            memcpy(&credit, msg->data, sizeof(uint32_t));
+            state->input_credit += credit;
+            break;
+            
+        case MSG_TYPE_PTY_CREDIT:
+            /* The server windows output once offered, older ones never
+             * offer and would not understand the grant */
+            if (!credit_granted) {
+                send_pty_credit(fd, PTY_CREDIT_WINDOW);
+                credit_granted = 1;
             }
             break;
             
         case MSG_TYPE_CLIENT_END:
             /* Server closed session */
-            *session_active = 0;
+            state->active = 0;
             VSOCK_LOG_INFO("Server closed session");
             break;
             
@@ -166,21 +319,25 @@ static int handle_server_message(void *context, int fd, Message *msg)
 /*****************************************************************************/
 static void handle_read_error(void *context, const char *error)
 {
-    int *session_active = (int *)context;
+    SessionState *state = (SessionState *)context;
     VSOCK_LOG_ERROR("Read error: %s", error);
-    *session_active = 0;
+    state->active = 0;
 }
 
 /*****************************************************************************/
-void terminal_session_run(int socket_fd, const char *command)
+int terminal_session_run(int socket_fd, const SessionRequest *request)
 {
+    int use_pty = request->use_pty;
     fd_set read_fds;
+    fd_set write_fds;
     int max_fd;
     int pipe_fds[2];
-    int session_active = 1;
-    char stdin_buffer[4096];
+    int input_open = 1;
+    int pending;
+    SessionState state = { 1, use_pty ? 0 : 255, EXEC_INPUT_WINDOW };
+    uint32_t limit;
     ssize_t bytes_read;
-    Message msg;
+    Message *msg;
     
     /* Create pipe for signal notifications */
     if (pipe(pipe_fds) < 0) {
@@ -190,32 +347,55 @@ void terminal_session_run(int socket_fd, const char *command)
     /* Setup signal handler */
     terminal_setup_sigwinch_handler(pipe_fds[1]);
     
-    /* Initialize message queue */
-    if (message_queue_init(socket_fd) < 0) {
+    /* Initialize message queue. The server stops reading while the input
+     * it has is not taken, so never block on the socket with output of
+     * ours to return credit for. */
+    if (message_queue_init(socket_fd) < 0 ||
+        fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK) < 0) {
         VSOCK_LOG_FATAL("Failed to initialize message queue");
     }
     
-    /* Send initial window size */
-    terminal_send_window_size(socket_fd);
+    /* Send initial window size, a command without a PTY has none */
+    if (use_pty) {
+        terminal_send_window_size(socket_fd);
+    }
+    
+    /* Output credit is granted once the server offers to take it */
+    consumed_credit = 0;
+    credit_granted = 0;
     
     /* Open session */
-    send_open_session_message(socket_fd, command);
+    send_open_session_message(socket_fd, request);
     
     /* Enter raw mode if interactive */
-    if (!command) {
+    if (!request->command && !request->argv) {
         terminal_enter_raw_mode();
     }
     
     /* Main event loop */
-    while (session_active) {
+    while (state.active) {
+        /* Send queued messages before waiting. Write errors are left to
+         * the read side, output the server sent before closing still
+         * arrives. */
+        pending = message_queue_flush_writes(socket_fd);
+        
         FD_ZERO(&read_fds);
+        FD_ZERO(&write_fds);
         FD_SET(socket_fd, &read_fds);
-        FD_SET(STDIN_FILENO, &read_fds);
+        if (pending > 0) {
+            FD_SET(socket_fd, &write_fds);
+        }
+        
+        /* Stdin waits while the server is not taking our input */
+        if (input_open && !message_queue_is_saturated(socket_fd) &&
+            (use_pty || state.input_credit > 0)) {
+            FD_SET(STDIN_FILENO, &read_fds);
+        }
         FD_SET(pipe_fds[0], &read_fds);
         
         max_fd = (socket_fd > pipe_fds[0]) ? socket_fd : pipe_fds[0];
         
-        if (select(max_fd + 1, &read_fds, NULL, NULL, NULL) < 0) {
+        if (select(max_fd + 1, &read_fds, &write_fds, NULL, NULL) < 0) {
             if (errno == EINTR) {
                 continue;
             }
@@ -224,27 +404,49 @@ void terminal_session_run(int socket_fd, const char *command)
         
         /* Handle socket data */
         if (FD_ISSET(socket_fd, &read_fds)) {
-            message_queue_read(&session_active, socket_fd,
+            message_queue_read(&state, socket_fd,
                              handle_server_message, handle_read_error);
         }
         
         /* Handle stdin data */
         if (FD_ISSET(STDIN_FILENO, &read_fds)) {
-            bytes_read = read(STDIN_FILENO, stdin_buffer, sizeof(stdin_buffer));
+            limit = MAX_MESSAGE_DATA;
+            if (!use_pty && state.input_credit < limit) {
+                limit = state.input_credit;
+            }
+            
+            /* Read stdin straight into the outgoing frame */
+            msg = message_queue_reserve(socket_fd, MSG_TYPE_CLIENT_DATA, limit);
+            if (!msg) {
+                VSOCK_LOG_ERROR("Failed to send client data");
+                state.active = 0;
+                continue;
+            }
+            
+            bytes_read = read(STDIN_FILENO, msg->data, limit);
+            if (bytes_read <= 0) {
+                message_queue_discard(socket_fd, msg);
+            }
             
             if (bytes_read > 0) {
-                msg.type = MSG_TYPE_CLIENT_DATA;
-                msg.length = bytes_read;
-                memcpy(msg.data, stdin_buffer, bytes_read);
-                
-                if (message_queue_write(socket_fd, &msg) < 0) {
+                if (!use_pty) {
+                    state.input_credit -= bytes_read;
+                }
+                if (message_queue_commit(socket_fd, msg, bytes_read) < 0) {
                     VSOCK_LOG_ERROR("Failed to send client data");
-                    session_active = 0;
+                    state.active = 0;
                 }
+            } else if (bytes_read == 0 && !use_pty) {
+                /* The command sees EOF too and runs on to its exit */
+                send_client_eof(socket_fd);
+                input_open = 0;
             } else if (bytes_read == 0) {
-                /* EOF on stdin */
+                /* EOF on stdin, deliver the last input before leaving */
                 VSOCK_LOG_INFO("EOF on stdin");
-                session_active = 0;
+                fcntl(socket_fd, F_SETFL, 
+                      fcntl(socket_fd, F_GETFL) & ~O_NONBLOCK);
+                message_queue_flush_writes(socket_fd);
+                state.active = 0;
             }
         }
         
@@ -255,13 +457,77 @@ void terminal_session_run(int socket_fd, const char *command)
                 terminal_send_window_size(socket_fd);
             }
         }
-        
-        /* Flush pending writes */
-        message_queue_flush_writes(socket_fd);
     }
     
     /* Cleanup */
     message_queue_destroy(socket_fd);
     close(pipe_fds[0]);
     close(pipe_fds[1]);
+    return state.exit_status;
+}
+
+/*****************************************************************************/
+int terminal_session_attach(int control_fd, const SessionRequest *request)
+{
+    int use_pty = request->use_pty;
+    fd_set read_fds;
+    int max_fd;
+    int pipe_fds[2];
+    SessionState state = { 1, use_pty ? 0 : 255, 0 };
+    
+    /* The master does the terminal I/O, only the session ends arrive here */
+    if (pipe(pipe_fds) < 0) {
+        VSOCK_LOG_FATAL("Failed to create pipe: %s", strerror(errno));
+    }
+    
+    terminal_setup_sigwinch_handler(pipe_fds[1]);
+    
+    if (message_queue_init(control_fd) < 0) {
+        VSOCK_LOG_FATAL("Failed to initialize message queue");
+    }
+    
+    if (use_pty) {
+        terminal_send_window_size(control_fd);
+    }
+    send_open_session_message(control_fd, request);
+    
+    /* The terminal mode belongs to the tty, the master reads it as set */
+    if (!request->command && !request->argv) {
+        terminal_enter_raw_mode();
+    }
+    
+    while (state.active) {
+        message_queue_flush_writes(control_fd);
+        
+        FD_ZERO(&read_fds);
+        FD_SET(control_fd, &read_fds);
+        FD_SET(pipe_fds[0], &read_fds);
+        
+        max_fd = (control_fd > pipe_fds[0]) ? control_fd : pipe_fds[0];
+        
+        if (select(max_fd + 1, &read_fds, NULL, NULL, NULL) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            VSOCK_LOG_FATAL("Select error: %s", strerror(errno));
+        }
+        
+        if (FD_ISSET(control_fd, &read_fds)) {
+            message_queue_read(&state, control_fd,
+                             handle_server_message, handle_read_error);
+        }
+        
+        /* Window size changes are forwarded on the session's channel */
+        if (FD_ISSET(pipe_fds[0], &read_fds)) {
+            char notification;
+            if (read(pipe_fds[0], &notification, 1) > 0) {
+                terminal_send_window_size(control_fd);
+            }
+        }
+    }
+    
+    message_queue_destroy(control_fd);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return state.exit_status;
 }
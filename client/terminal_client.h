@@ -10,8 +10,22 @@ void terminal_restore_mode(void);
 void terminal_show_cursor(void);
 void terminal_hide_cursor(void);
 
-/* Terminal session */
-void terminal_session_run(int socket_fd, const char *command);
+/* What a terminal session runs: an interactive shell without command and
+ * argv. argv is run directly, without a shell, and never has a PTY. */
+typedef struct {
+    const char *command;
+    int use_pty;                       /* Otherwise plain pipes */
+    char **argv;                       /* NULL-terminated, like env */
+    char **env;                        /* NAME=VALUE, for argv only */
+    const char *cwd;                   /* For argv only */
+} SessionRequest;
+
+/* Terminal session. Without a PTY the command runs on plain pipes with
+ * stderr kept apart, and its exit status is returned. */
+int terminal_session_run(int socket_fd, const SessionRequest *request);
+
+/* Same session run by a connection master, see control_master.h */
+int terminal_session_attach(int control_fd, const SessionRequest *request);
 
 /* Window size handling */
 void terminal_send_window_size(int socket_fd);
@@ -10,14 +10,31 @@
 
 #define MAX_MESSAGE_DATA 4096
 
-/* Message structure */
-typedef struct {
+/* Upper bound for frames negotiated with MSG_TYPE_MAX_FRAME_SIZE, such
+ * frames live only in queue buffers and are accessed through Message * */
+#define MAX_LARGE_MESSAGE_DATA (256 * 1024)
+
+/* Message structure, packed so frames can be parsed at any buffer offset.
+ * Type and channel share what used to be a 32-bit type, so channel 0 is
+ * the same on the wire as before channels existed. */
+typedef struct __attribute__((packed)) {
     uint32_t magic;                    /* Protocol magic number */
-    uint32_t type;                     /* Message type */
+    uint16_t type;                     /* Message type */
+    uint16_t channel;                  /* Channel within the connection */
     uint32_t length;                   /* Data length */
     uint8_t data[MAX_MESSAGE_DATA];    /* Message payload */
 } Message;
 
 #define MESSAGE_HEADER_SIZE (3 * sizeof(uint32_t))
 
+/* Returns the payload as a C string when it carries its terminating NUL */
+static inline char *message_payload_string(Message *msg)
+{
+    if (msg->length == 0 || msg->data[msg->length - 1] != '\0') {
+        return NULL;
+    }
+    
+    return (char *)msg->data;
+}
+
 #endif /* VSOCK_SHELL_MESSAGE_H */
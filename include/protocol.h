@@ -22,15 +22,69 @@ typedef enum {
     MSG_TYPE_FILE_DATA,
     MSG_TYPE_FILE_DATA_END,
     MSG_TYPE_FILE_DATA_BEGIN,
-    MSG_TYPE_FILE_DATA_END_ACK
+    MSG_TYPE_FILE_DATA_END_ACK,
+    MSG_TYPE_MAX_FRAME_SIZE,
+    MSG_TYPE_PTY_CREDIT,
+    MSG_TYPE_CHANNEL_OPEN,
+    MSG_TYPE_CHANNEL_CLOSE,
+    MSG_TYPE_OPEN_EXEC,
+    MSG_TYPE_STDERR_DATA,
+    MSG_TYPE_CLIENT_EOF,
+    MSG_TYPE_EXIT_STATUS,
+    MSG_TYPE_INPUT_CREDIT,
+    MSG_TYPE_OPEN_ARGV,
+    MSG_TYPE_OPEN_BATCH
 } MessageType;
 
+/* A connection starts out with channel 0, which behaves like a connection
+ * of its own. MSG_TYPE_CHANNEL_OPEN on another channel number starts an
+ * independent session there, driven by the usual messages on that
+ * channel. Either side ends it with MSG_TYPE_CHANNEL_CLOSE, the server
+ * sends it in place of MSG_TYPE_CLIENT_END. */
+#define MAX_CONNECTION_CHANNELS 256
+
+/* MSG_TYPE_OPEN_EXEC runs a command on pipes instead of a PTY: stdout
+ * arrives as MSG_TYPE_PTY_DATA and stderr as MSG_TYPE_STDERR_DATA, both
+ * unprocessed and under the same credit. MSG_TYPE_CLIENT_EOF closes its
+ * stdin. Once it has exited and both streams ended, MSG_TYPE_EXIT_STATUS
+ * carries an int32_t, the exit code or 128 plus the terminating signal,
+ * right before the session ends. */
+
+/* MSG_TYPE_OPEN_ARGV is the same without the shell: a uint32_t argc and
+ * envc, then argc arguments and envc NAME=VALUE entries added to the
+ * environment, each NUL-terminated, and optionally the working directory.
+ * The server looks the program up along PATH and runs it directly; one it
+ * cannot find or start ends with status 127 or 126 like in a shell. */
+#define MAX_EXEC_ARGS 256
+
+/* MSG_TYPE_OPEN_BATCH on channel 0 runs a list of commands: a uint32_t
+ * parallelism and count, then count NUL-terminated commands. Command i,
+ * counting from 0, runs like MSG_TYPE_OPEN_EXEC with stdin closed on
+ * channel i + 1, which the server opens itself once fewer than
+ * parallelism of them run, and closes after its MSG_TYPE_EXIT_STATUS.
+ * Its output is not windowed. MSG_TYPE_CLIENT_END follows the last one. */
+#define MAX_BATCH_COMMANDS 1024
+
+/* Stdin of such a command is windowed the other way round: the client
+ * sends at most this much MSG_TYPE_CLIENT_DATA beyond what the server
+ * returned with MSG_TYPE_INPUT_CREDIT once written to the command, so
+ * the connection is never held up by a command not reading its input */
+#define EXEC_INPUT_WINDOW (256 * 1024)
+
+/* PTY output the client lets the server send ahead of its stdout. Once
+ * a session is open the server offers windowing with an empty
+ * MSG_TYPE_PTY_CREDIT, the client then grants this much and tops it up
+ * as output is written; output sent before the grant counts against it.
+ * A client may also grant it before opening the session. */
+#define PTY_CREDIT_WINDOW (256 * 1024)
+
 /* Connection types */
 typedef enum {
     CONNECTION_TYPE_BASH = 0,
     CONNECTION_TYPE_CMD,
     CONNECTION_TYPE_FILE_UPLOAD,
-    CONNECTION_TYPE_FILE_DOWNLOAD
+    CONNECTION_TYPE_FILE_DOWNLOAD,
+    CONNECTION_TYPE_EXEC
 } ConnectionType;
 
 #endif /* VSOCK_SHELL_PROTOCOL_H */
@@ -0,0 +1,122 @@
+/*****************************************************************************/
+/*    vsock-shell - Chunk pool implementation                               */
+/*****************************************************************************/
+#include <stdlib.h>
+#include "chunk_pool.h"
+#include "common.h"
+
+/* Idle chunks kept for reuse, anything beyond goes back to the system */
+#define MAX_IDLE_CHUNKS 64
+#define MAX_IDLE_LARGE_CHUNKS 8
+
+/* One free list per size class */
+typedef struct {
+    Chunk *free_list;
+    int capacity;
+    int max_idle;
+    int idle_count;
+} ChunkClass;
+
+/* Per thread, a chunk joins the pool of the thread that puts it back */
+static __thread ChunkClass chunk_classes[] = {
+    {NULL, CHUNK_SIZE, MAX_IDLE_CHUNKS, 0},
+    {NULL, LARGE_CHUNK_SIZE, MAX_IDLE_LARGE_CHUNKS, 0}
+};
+
+#define CHUNK_CLASS_COUNT (int)(sizeof(chunk_classes) / sizeof(chunk_classes[0]))
+
+/* Shared, chunks may be put back by a thread other than their owner */
+static int in_use_count = 0;
+
+/*****************************************************************************/
+static ChunkClass *find_chunk_class(int size)
+{
+    int i;
+    
+    for (i = 0; i < CHUNK_CLASS_COUNT; i++) {
+        if (size <= chunk_classes[i].capacity) {
+            return &chunk_classes[i];
+        }
+    }
+    
+    return NULL;
+}
+
+/*****************************************************************************/
+Chunk *chunk_pool_get_sized(int size)
+{
+    ChunkClass *chunk_class;
+    Chunk *chunk;
+    
+    chunk_class = find_chunk_class(size);
+    if (!chunk_class) {
+        VSOCK_LOG_ERROR("No chunk class for %d bytes", size);
+        return NULL;
+    }
+    
+    chunk = chunk_class->free_list;
+    
+    if (chunk) {
+        chunk_class->free_list = chunk->next;
+        chunk_class->idle_count--;
+    } else {
+        chunk = (Chunk *)malloc(sizeof(Chunk) + chunk_class->capacity);
+        if (!chunk) {
+            VSOCK_LOG_ERROR("Failed to allocate buffer chunk");
+            return NULL;
+        }
+        chunk->capacity = chunk_class->capacity;
+    }
+    
+    chunk->next = NULL;
+    chunk->start_offset = 0;
+    chunk->end_offset = 0;
+    __atomic_fetch_add(&in_use_count, 1, __ATOMIC_RELAXED);
+    
+    return chunk;
+}
+
+/*****************************************************************************/
+Chunk *chunk_pool_get(void)
+{
+    return chunk_pool_get_sized(CHUNK_SIZE);
+}
+
+/*****************************************************************************/
+void chunk_pool_put(Chunk *chunk)
+{
+    ChunkClass *chunk_class;
+    
+    if (!chunk) {
+        return;
+    }
+    
+    __atomic_fetch_sub(&in_use_count, 1, __ATOMIC_RELAXED);
+    
+    chunk_class = find_chunk_class(chunk->capacity);
+    if (chunk_class->idle_count >= chunk_class->max_idle) {
+        free(chunk);
+        return;
+    }
+    
+    chunk->next = chunk_class->free_list;
+    chunk_class->free_list = chunk;
+    chunk_class->idle_count++;
+}
+
+/*****************************************************************************/
+void chunk_pool_stats(int *in_use, int *idle)
+{
+    int i;
+    
+    if (in_use) {
+        *in_use = __atomic_load_n(&in_use_count, __ATOMIC_RELAXED);
+    }
+    
+    if (idle) {
+        *idle = 0;
+        for (i = 0; i < CHUNK_CLASS_COUNT; i++) {
+            *idle += chunk_classes[i].idle_count;
+        }
+    }
+}
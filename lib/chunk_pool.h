@@ -0,0 +1,29 @@
+/*****************************************************************************/
+/*    vsock-shell - Chunk pool interface                                    */
+/*****************************************************************************/
+#ifndef VSOCK_SHELL_CHUNK_POOL_H
+#define VSOCK_SHELL_CHUNK_POOL_H
+
+#define CHUNK_SIZE 65536
+#define LARGE_CHUNK_SIZE (CHUNK_SIZE * 5)
+
+/* Buffer chunk, chained to build elastic queues */
+typedef struct Chunk {
+    struct Chunk *next;
+    int capacity;                      /* CHUNK_SIZE or LARGE_CHUNK_SIZE */
+    int start_offset;                  /* First unconsumed byte */
+    int end_offset;                    /* End of valid data */
+    char data[];
+} Chunk;
+
+/* Chunk allocation, large chunks hold frames beyond CHUNK_SIZE. Each
+ * thread keeps its own idle chunks; one put back by another thread than
+ * the one that got it simply joins that thread's pool. */
+Chunk *chunk_pool_get(void);
+Chunk *chunk_pool_get_sized(int size);
+void chunk_pool_put(Chunk *chunk);
+
+/* Statistics */
+void chunk_pool_stats(int *in_use, int *idle);
+
+#endif /* VSOCK_SHELL_CHUNK_POOL_H */
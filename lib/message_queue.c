@@ -3,27 +3,102 @@
 /*****************************************************************************/
 #include <errno.h>
 #include <unistd.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 #include "message_queue.h"
+#include "chunk_pool.h"
 #include "common.h"
 
-#define MAX_FD_COUNT 100
-#define MAX_RX_BUFFER 100000
-#define MAX_TX_BUFFER 1000000
+#define MIN_QUEUE_TABLE_SIZE 128
+#define MAX_FLUSH_IOV 64
 
+/* Outgoing frames are sent by class, a lower lane only goes out while the
+ * lanes above it are empty */
+typedef enum {
+    LANE_INTERACTIVE = 0,              /* Control and terminal frames */
+    LANE_BULK,                         /* File data */
+    LANE_COUNT
+} LaneIndex;
+
+/* One FIFO of outgoing chunks */
+typedef struct {
+    Chunk *head;                       /* Oldest chunk with unsent data */
+    Chunk *tail;                       /* Chunk being filled */
+    int frame_left;                    /* Unsent rest of a frame cut short */
+} MessageLane;
+
+/* Both directions borrow chunks from the shared pool only while they
+ * hold data, an idle queue owns no buffer memory at all */
 typedef struct {
-    char rx_buffer[MAX_RX_BUFFER];
-    int rx_offset;
-    char tx_buffer[MAX_TX_BUFFER];
-    int tx_start_offset;
-    int tx_end_offset;
+    Chunk *rx_chunk;                   /* Received data, NULL when empty */
+    MessageLane lanes[LANE_COUNT];
+    MessageLane *tx_reserved_lane;     /* Lane of outstanding reservation */
+    int tx_pending;                    /* Queued bytes across all lanes */
+    int tx_reserved;                   /* Payload of outstanding reservation */
+    uint32_t max_frame_data;           /* Largest payload in either direction */
 } MessageQueue;
 
-static MessageQueue *queues[MAX_FD_COUNT];
+/* Queue registry indexed by file descriptor, grown on demand; one per
+ * thread, so every event loop owns the queues of its own sessions */
+static __thread MessageQueue **queues = NULL;
+static __thread int queue_table_size = 0;
+
+/*****************************************************************************/
+static MessageQueue *lookup_queue(int fd)
+{
+    if (fd < 0 || fd >= queue_table_size) {
+        return NULL;
+    }
+    
+    return queues[fd];
+}
+
+/*****************************************************************************/
+static int grow_queue_table(int fd)
+{
+    MessageQueue **new_queues;
+    struct rlimit limit;
+    int new_size;
+    
+    new_size = queue_table_size ? queue_table_size : MIN_QUEUE_TABLE_SIZE;
+    while (new_size <= fd && new_size <= INT_MAX / 2) {
+        new_size *= 2;
+    }
+    
+    /* Never grow beyond what the process can actually open */
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_cur != RLIM_INFINITY &&
+        limit.rlim_cur < (rlim_t)new_size) {
+        new_size = (int)limit.rlim_cur;
+    }
+    
+    if (new_size <= fd) {
+        new_size = fd + 1;
+    }
+    
+    new_queues = (MessageQueue **)realloc(queues, 
+                                          new_size * sizeof(MessageQueue *));
+    if (!new_queues) {
+        return -1;
+    }
+    
+    memset(&new_queues[queue_table_size], 0,
+           (new_size - queue_table_size) * sizeof(MessageQueue *));
+    
+    queues = new_queues;
+    queue_table_size = new_size;
+    return 0;
+}
 
 /*****************************************************************************/
 int message_queue_init(int fd)
 {
-    if (fd >= MAX_FD_COUNT || queues[fd] != NULL) {
+    if (fd < 0 || lookup_queue(fd) != NULL) {
+        return -1;
+    }
+    
+    if (fd >= queue_table_size && grow_queue_table(fd) < 0) {
+        VSOCK_LOG_ERROR("Failed to grow queue table for fd %d", fd);
         return -1;
     }
     
@@ -32,89 +107,334 @@ int message_queue_init(int fd)
         return -1;
     }
     
+    queues[fd]->tx_reserved = -1;
+    queues[fd]->max_frame_data = MAX_MESSAGE_DATA;
+    
     return 0;
 }
 
 /*****************************************************************************/
 int message_queue_destroy(int fd)
 {
-    if (fd >= MAX_FD_COUNT || !queues[fd]) {
+    MessageQueue *queue;
+    MessageLane *lane;
+    Chunk *chunk;
+    
+    queue = lookup_queue(fd);
+    if (!queue) {
         return -1;
     }
     
+    /* Return all buffers to the pool */
+    for (lane = queue->lanes; lane < &queue->lanes[LANE_COUNT]; lane++) {
+        while (lane->head) {
+            chunk = lane->head;
+            lane->head = chunk->next;
+            chunk_pool_put(chunk);
+        }
+    }
+    chunk_pool_put(queue->rx_chunk);
+    
     free(queues[fd]);
     queues[fd] = NULL;
     return 0;
 }
 
 /*****************************************************************************/
-int message_queue_write(int fd, Message *msg)
+int message_queue_set_max_frame(int fd, uint32_t max_data)
 {
     MessageQueue *queue;
-    int total_length;
-    int available_space;
     
-    if (fd >= MAX_FD_COUNT || !queues[fd]) {
-        VSOCK_LOG_ERROR("Invalid file descriptor: %d", fd);
+    queue = lookup_queue(fd);
+    if (!queue) {
         return -1;
     }
     
-    queue = queues[fd];
-    msg->magic = PROTOCOL_MAGIC;
-    total_length = MESSAGE_HEADER_SIZE + msg->length;
+    if (max_data < MAX_MESSAGE_DATA || max_data > MAX_LARGE_MESSAGE_DATA) {
+        VSOCK_LOG_ERROR("Invalid maximum frame size: %u", max_data);
+        return -1;
+    }
     
-    /* Calculate available space */
-    if (queue->tx_end_offset >= queue->tx_start_offset) {
-        available_space = MAX_TX_BUFFER - queue->tx_end_offset;
+    queue->max_frame_data = max_data;
+    return 0;
+}
+
+/*****************************************************************************/
+static MessageLane *lane_for_type(MessageQueue *queue, uint32_t type)
+{
+    /* File payload is what fills the queue, everything else jumps it. A
+     * channel close waits behind the channel's file frames, whose number
+     * may be reused as soon as the close arrives. */
+    switch (type) {
+        case MSG_TYPE_FILE_DATA_BEGIN:
+        case MSG_TYPE_FILE_DATA:
+        case MSG_TYPE_FILE_DATA_END:
+        case MSG_TYPE_CHANNEL_CLOSE:
+            return &queue->lanes[LANE_BULK];
+        default:
+            return &queue->lanes[LANE_INTERACTIVE];
+    }
+}
+
+/*****************************************************************************/
+static void link_tx_chunk(MessageLane *lane, Chunk *chunk)
+{
+    chunk->next = NULL;
+    if (lane->tail) {
+        lane->tail->next = chunk;
     } else {
-        available_space = queue->tx_start_offset - queue->tx_end_offset;
+        lane->head = chunk;
+    }
+    
+    lane->tail = chunk;
+}
+
+/*****************************************************************************/
+static Chunk *append_tx_chunk(MessageLane *lane, int size)
+{
+    Chunk *chunk = chunk_pool_get_sized(size);
+    
+    if (!chunk) {
+        return NULL;
     }
     
+    link_tx_chunk(lane, chunk);
+    return chunk;
+}
+
+/*****************************************************************************/
+static void release_sent_tx_chunks(MessageQueue *queue, MessageLane *lane)
+{
+    Chunk *chunk;
+    
+    /* Keep the tail while a reservation points into it */
+    while (lane->head && lane->head->start_offset == lane->head->end_offset &&
+           (lane->head != lane->tail || queue->tx_reserved_lane != lane)) {
+        chunk = lane->head;
+        lane->head = chunk->next;
+        if (lane->tail == chunk) {
+            lane->tail = NULL;
+        }
+        chunk_pool_put(chunk);
+    }
+}
+
+/*****************************************************************************/
+Message *message_queue_reserve(int fd, uint32_t type, uint32_t max_length)
+{
+    MessageQueue *queue;
+    MessageLane *lane;
+    Message *msg;
+    Chunk *chunk;
+    int total_length;
+    int available_space;
+    
+    queue = lookup_queue(fd);
+    if (!queue) {
+        VSOCK_LOG_ERROR("Invalid file descriptor: %d", fd);
+        return NULL;
+    }
+    
+    if (max_length > queue->max_frame_data) {
+        VSOCK_LOG_ERROR("Message too long: %u", max_length);
+        return NULL;
+    }
+    
+    total_length = MESSAGE_HEADER_SIZE + max_length;
+    available_space = MAX_TX_BUFFER - queue->tx_pending;
+    
     if (total_length > available_space) {
         VSOCK_LOG_ERROR("TX buffer full (need %d, have %d)", 
                   total_length, available_space);
-        return -1;
+        return NULL;
+    }
+    
+    /* Frames never straddle chunks, start a new one if the tail is short */
+    lane = lane_for_type(queue, type);
+    chunk = lane->tail;
+    if (!chunk || chunk->capacity - chunk->end_offset < total_length) {
+        chunk = append_tx_chunk(lane, total_length);
+        if (!chunk) {
+            return NULL;
+        }
     }
     
-    /* Copy message to TX buffer */
-    memcpy(&queue->tx_buffer[queue->tx_end_offset], msg, total_length);
-    queue->tx_end_offset += total_length;
+    /* A new reservation silently replaces an uncommitted one */
+    queue->tx_reserved = max_length;
+    queue->tx_reserved_lane = lane;
     
-    if (queue->tx_end_offset >= MAX_TX_BUFFER) {
-        queue->tx_end_offset = 0;
+    msg = (Message *)&chunk->data[chunk->end_offset];
+    msg->type = type;
+    msg->channel = 0;
+    return msg;
+}
+
+/*****************************************************************************/
+int message_queue_commit(int fd, Message *msg, uint32_t length)
+{
+    MessageQueue *queue;
+    Chunk *chunk;
+    int total_length;
+    
+    queue = lookup_queue(fd);
+    if (!queue) {
+        VSOCK_LOG_ERROR("Invalid file descriptor: %d", fd);
+        return -1;
+    }
+    
+    chunk = queue->tx_reserved_lane ? queue->tx_reserved_lane->tail : NULL;
+    if (!chunk || msg != (Message *)&chunk->data[chunk->end_offset] ||
+        (int)length > queue->tx_reserved ||
+        lane_for_type(queue, msg->type) != queue->tx_reserved_lane) {
+        VSOCK_LOG_ERROR("Commit does not match reservation (length %u)", 
+                  length);
+        return -1;
     }
     
+    msg->magic = PROTOCOL_MAGIC;
+    msg->length = length;
+    total_length = MESSAGE_HEADER_SIZE + length;
+    
+    chunk->end_offset += total_length;
+    queue->tx_pending += total_length;
+    queue->tx_reserved = -1;
+    queue->tx_reserved_lane = NULL;
     return 0;
 }
 
 /*****************************************************************************/
-int message_queue_write_raw(int fd, const char *data, int length)
+void message_queue_discard(int fd, Message *msg)
 {
     MessageQueue *queue;
-    int available_space;
+    Chunk *chunk;
+    
+    queue = lookup_queue(fd);
+    if (!queue || !queue->tx_reserved_lane) {
+        return;
+    }
+    
+    /* Nothing was counted yet, the space is simply reserved again later */
+    chunk = queue->tx_reserved_lane->tail;
+    if (msg == (Message *)&chunk->data[chunk->end_offset]) {
+        queue->tx_reserved = -1;
+        queue->tx_reserved_lane = NULL;
+    }
+}
+
+/*****************************************************************************/
+int message_queue_append_chunk(int fd, Chunk *chunk)
+{
+    MessageQueue *queue;
+    Message *msg;
+    int offset;
+    int length;
     
-    if (fd >= MAX_FD_COUNT || !queues[fd]) {
+    queue = lookup_queue(fd);
+    if (!queue) {
+        VSOCK_LOG_ERROR("Invalid file descriptor: %d", fd);
         return -1;
     }
     
-    queue = queues[fd];
+    length = chunk->end_offset - chunk->start_offset;
+    if (length <= 0 ||
+        length > MAX_TX_BUFFER - queue->tx_pending) {
+        return -1;
+    }
     
-    /* Calculate available space */
-    if (queue->tx_end_offset >= queue->tx_start_offset) {
-        available_space = MAX_TX_BUFFER - queue->tx_end_offset;
-    } else {
-        available_space = queue->tx_start_offset - queue->tx_end_offset;
+    /* Whole frames only, each of which the peer must be able to take */
+    for (offset = chunk->start_offset; offset < chunk->end_offset; 
+         offset += MESSAGE_HEADER_SIZE + msg->length) {
+        if (offset + (int)MESSAGE_HEADER_SIZE > chunk->end_offset) {
+            VSOCK_LOG_ERROR("Chunk ends inside a frame header");
+            return -1;
+        }
+    
+        msg = (Message *)&chunk->data[offset];
+        if (msg->length > queue->max_frame_data) {
+            VSOCK_LOG_ERROR("Message too long: %u", msg->length);
+            return -1;
+        }
+    
+        if (msg->length > (uint32_t)(chunk->end_offset - offset - 
+                                     MESSAGE_HEADER_SIZE)) {
+            VSOCK_LOG_ERROR("Chunk ends inside a frame");
+            return -1;
+        }
     }
     
-    if (length > available_space) {
+    if (queue->tx_reserved_lane) {
+        VSOCK_LOG_ERROR("Chunk appended while a reservation is open");
         return -1;
     }
     
-    memcpy(&queue->tx_buffer[queue->tx_end_offset], data, length);
-    queue->tx_end_offset += length;
+    /* Sorted by its first frame, a chunk holds frames of one class */
+    msg = (Message *)&chunk->data[chunk->start_offset];
+    link_tx_chunk(lane_for_type(queue, msg->type), chunk);
+    queue->tx_pending += length;
+    return 0;
+}
+
+/*****************************************************************************/
+int message_queue_write_channel(int fd, uint16_t channel, Message *msg)
+{
+    Message *slot;
     
-    if (queue->tx_end_offset >= MAX_TX_BUFFER) {
-        queue->tx_end_offset = 0;
+    slot = message_queue_reserve(fd, msg->type, msg->length);
+    if (!slot) {
+        return -1;
+    }
+    
+    slot->channel = channel;
+    memcpy(slot->data, msg->data, msg->length);
+    return message_queue_commit(fd, slot, msg->length);
+}
+
+/*****************************************************************************/
+int message_queue_write(int fd, Message *msg)
+{
+    return message_queue_write_channel(fd, 0, msg);
+}
+
+/*****************************************************************************/
+int message_queue_write_raw(int fd, const char *data, int length)
+{
+    MessageQueue *queue;
+    MessageLane *lane;
+    Chunk *chunk;
+    int copy_length;
+    
+    queue = lookup_queue(fd);
+    if (!queue) {
+        return -1;
+    }
+    
+    if (length > MAX_TX_BUFFER - queue->tx_pending) {
+        return -1;
+    }
+    
+    /* Raw data is a plain byte stream and may span chunks. It has no frame
+     * boundaries to be interrupted at, so only the top lane can take it. */
+    lane = &queue->lanes[LANE_INTERACTIVE];
+    while (length > 0) {
+        chunk = lane->tail;
+        if (!chunk || chunk->end_offset == chunk->capacity ||
+            queue->tx_reserved_lane == lane) {
+            chunk = append_tx_chunk(lane, CHUNK_SIZE);
+            if (!chunk) {
+                return -1;
+            }
+        }
+        
+        copy_length = chunk->capacity - chunk->end_offset;
+        if (copy_length > length) {
+            copy_length = length;
+        }
+        
+        memcpy(&chunk->data[chunk->end_offset], data, copy_length);
+        chunk->end_offset += copy_length;
+        queue->tx_pending += copy_length;
+        data += copy_length;
+        length -= copy_length;
     }
     
     return 0;
@@ -125,122 +445,282 @@ int message_queue_has_pending_writes(int fd)
 {
     MessageQueue *queue;
     
-    if (fd >= MAX_FD_COUNT || !queues[fd]) {
+    queue = lookup_queue(fd);
+    if (!queue) {
         return 0;
     }
     
-    queue = queues[fd];
-    return (queue->tx_start_offset != queue->tx_end_offset);
+    return (queue->tx_pending > 0);
 }
 
 /*****************************************************************************/
 int message_queue_is_saturated(int fd)
 {
     MessageQueue *queue;
-    int pending_bytes;
     
-    if (fd >= MAX_FD_COUNT || !queues[fd]) {
+    queue = lookup_queue(fd);
+    if (!queue) {
         return 0;
     }
     
-    queue = queues[fd];
-    
-    if (queue->tx_end_offset >= queue->tx_start_offset) {
-        pending_bytes = queue->tx_end_offset - queue->tx_start_offset;
-    } else {
-        pending_bytes = MAX_TX_BUFFER - queue->tx_start_offset + queue->tx_end_offset;
+    return (queue->tx_pending > (MAX_TX_BUFFER / 2));
+}
+
+/*****************************************************************************/
+static int gather_lane(MessageLane *lane, int limit, struct iovec *iov,
+                       int iov_count)
+{
+    Chunk *chunk;
+    int length;
+    
+    for (chunk = lane->head; chunk && limit > 0 && iov_count < MAX_FLUSH_IOV;
+         chunk = chunk->next) {
+        length = chunk->end_offset - chunk->start_offset;
+        if (length > limit) {
+            length = limit;
+        }
+        
+        if (length > 0) {
+            iov[iov_count].iov_base = &chunk->data[chunk->start_offset];
+            iov[iov_count].iov_len = length;
+            iov_count++;
+            limit -= length;
+        }
     }
     
-    return (pending_bytes > (MAX_TX_BUFFER / 2));
+    return iov_count;
 }
 
 /*****************************************************************************/
-void message_queue_flush_writes(int fd)
+static int advance_lane(MessageLane *lane, int framed, int bytes_written)
 {
-    MessageQueue *queue;
-    int bytes_to_write;
-    int bytes_written;
+    Chunk *chunk;
+    Message *msg;
+    int consumed;
+    
+    /* Framed lanes track where the write stopped inside the current frame,
+     * frames never straddle chunks there */
+    for (chunk = lane->head; chunk && bytes_written > 0; chunk = chunk->next) {
+        while (bytes_written > 0 && chunk->start_offset < chunk->end_offset) {
+            consumed = chunk->end_offset - chunk->start_offset;
+    
+            if (framed) {
+                if (lane->frame_left == 0) {
+                    msg = (Message *)&chunk->data[chunk->start_offset];
+                    lane->frame_left = MESSAGE_HEADER_SIZE + msg->length;
+                }
+                if (consumed > lane->frame_left) {
+                    consumed = lane->frame_left;
+                }
+            }
     
-    if (fd >= MAX_FD_COUNT || !queues[fd]) {
-        return;
-    }
+            if (consumed > bytes_written) {
+                consumed = bytes_written;
+            }
     
-    queue = queues[fd];
+            chunk->start_offset += consumed;
+            bytes_written -= consumed;
+            if (framed) {
+                lane->frame_left -= consumed;
+            }
+        }
+    }
     
-    if (queue->tx_start_offset == queue->tx_end_offset) {
-        return; /* Nothing to write */
+    return bytes_written;
+}
+
+/*****************************************************************************/
+int message_queue_flush_writes(int fd)
+{
+    MessageQueue *queue;
+    struct iovec iov[MAX_FLUSH_IOV];
+    MessageLane *cut_lane;
+    int iov_count;
+    ssize_t bytes_written;
+    int remaining;
+    int i;
+    
+    queue = lookup_queue(fd);
+    if (!queue) {
+        return -1;
     }
     
-    /* Calculate bytes to write */
-    if (queue->tx_end_offset > queue->tx_start_offset) {
-        bytes_to_write = queue->tx_end_offset - queue->tx_start_offset;
-    } else {
-        bytes_to_write = MAX_TX_BUFFER - queue->tx_start_offset;
+    /* Drain until the queue is empty or the socket would block */
+    while (queue->tx_pending > 0) {
+        /* Only the bulk lane can stop mid-frame with others waiting, the
+         * rest of that frame has to go out before anything else */
+        cut_lane = &queue->lanes[LANE_BULK];
+        if (cut_lane->frame_left > 0) {
+            iov_count = gather_lane(cut_lane, cut_lane->frame_left, iov, 0);
+        } else {
+            /* One vectored write across the lanes in priority order */
+            cut_lane = NULL;
+            iov_count = 0;
+            for (i = 0; i < LANE_COUNT; i++) {
+                iov_count = gather_lane(&queue->lanes[i], INT_MAX, iov, 
+                                        iov_count);
+            }
+        }
+        
+        bytes_written = writev(fd, iov, iov_count);
+        
+        if (bytes_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            VSOCK_LOG_ERROR("Write error: %s", strerror(errno));
+            return -1;
+        }
+        
+        queue->tx_pending -= bytes_written;
+        
+        /* Advance through the lanes in the order they were gathered,
+         * handing sent chunks back */
+        remaining = bytes_written;
+        if (cut_lane) {
+            advance_lane(cut_lane, 1, remaining);
+        } else {
+            for (i = 0; i < LANE_COUNT; i++) {
+                remaining = advance_lane(&queue->lanes[i], i != LANE_INTERACTIVE,
+                                         remaining);
+            }
+        }
+        
+        for (i = 0; i < LANE_COUNT; i++) {
+            release_sent_tx_chunks(queue, &queue->lanes[i]);
+        }
     }
     
-    bytes_written = write(fd, &queue->tx_buffer[queue->tx_start_offset], 
-                          bytes_to_write);
+    for (i = 0; i < LANE_COUNT; i++) {
+        release_sent_tx_chunks(queue, &queue->lanes[i]);
+    }
+    return queue->tx_pending;
+}
+
+/*****************************************************************************/
+static int prepare_rx_chunk(MessageQueue *queue, int frame_length)
+{
+    Chunk *chunk = queue->rx_chunk;
+    Chunk *large_chunk;
+    int pending = chunk->end_offset - chunk->start_offset;
+    
+    /* Fully consumed, give the buffer back until more data arrives */
+    if (pending == 0) {
+        chunk_pool_put(chunk);
+        queue->rx_chunk = NULL;
+        return 0;
+    }
     
-    if (bytes_written > 0) {
-        queue->tx_start_offset += bytes_written;
-        if (queue->tx_start_offset >= MAX_TX_BUFFER) {
-            queue->tx_start_offset = 0;
+    /* A negotiated large frame needs a bigger contiguous buffer */
+    if (frame_length > chunk->capacity) {
+        large_chunk = chunk_pool_get_sized(frame_length);
+        if (!large_chunk) {
+            return -1;
         }
-    } else if (bytes_written < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-        VSOCK_LOG_ERROR("Write error: %s", strerror(errno));
+        
+        memcpy(large_chunk->data, &chunk->data[chunk->start_offset], pending);
+        large_chunk->end_offset = pending;
+        chunk_pool_put(chunk);
+        queue->rx_chunk = large_chunk;
+        return 0;
+    }
+    
+    /* Only move the partial frame when the tail cannot hold all of it */
+    if (chunk->capacity - chunk->start_offset >= frame_length) {
+        return 0;
     }
+    
+    memmove(chunk->data, &chunk->data[chunk->start_offset], pending);
+    chunk->start_offset = 0;
+    chunk->end_offset = pending;
+    return 0;
 }
 
 /*****************************************************************************/
-void message_queue_read(void *context, int fd,
-                        MessageReceivedCallback on_message,
-                        ErrorCallback on_error)
+int message_queue_read(void *context, int fd,
+                       MessageReceivedCallback on_message,
+                       ErrorCallback on_error)
 {
     MessageQueue *queue;
+    Chunk *chunk;
     int bytes_read;
-    int available_space;
+    int read_errno;
+    int pending;
     Message *msg;
     int message_total_length;
     
-    if (fd >= MAX_FD_COUNT || !queues[fd]) {
+    queue = lookup_queue(fd);
+    if (!queue) {
         if (on_error) {
             on_error(context, "Invalid file descriptor");
         }
-        return;
+        return -1;
     }
     
-    queue = queues[fd];
-    available_space = MAX_RX_BUFFER - queue->rx_offset;
+    if (!queue->rx_chunk) {
+        queue->rx_chunk = chunk_pool_get();
+        if (!queue->rx_chunk) {
+            if (on_error) {
+                on_error(context, "Out of buffer memory");
+            }
+            return -1;
+        }
+    }
     
-    bytes_read = read(fd, &queue->rx_buffer[queue->rx_offset], available_space);
+    chunk = queue->rx_chunk;
+    bytes_read = read(fd, &chunk->data[chunk->end_offset], 
+                      chunk->capacity - chunk->end_offset);
     
     if (bytes_read <= 0) {
-        if (bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            if (on_error) {
-                on_error(context, "Read error");
-            }
+        read_errno = errno;
+        prepare_rx_chunk(queue, MESSAGE_HEADER_SIZE);
+        if (bytes_read < 0 && 
+            (read_errno == EAGAIN || read_errno == EWOULDBLOCK)) {
+            return 0;
         }
-        return;
+        
+        if (on_error) {
+            on_error(context, bytes_read == 0 ? "Connection closed" : 
+                                                "Read error");
+        }
+        return -1;
     }
     
-    queue->rx_offset += bytes_read;
+    chunk->end_offset += bytes_read;
     
-    /* Process complete messages */
-    while (queue->rx_offset >= MESSAGE_HEADER_SIZE) {
-        msg = (Message *)queue->rx_buffer;
+    /* Process complete messages in place, advancing the consume offset */
+    while (1) {
+        message_total_length = MESSAGE_HEADER_SIZE;
+        pending = chunk->end_offset - chunk->start_offset;
+        if (pending < message_total_length) {
+            break;
+        }
+        
+        msg = (Message *)&chunk->data[chunk->start_offset];
         
         /* Validate magic number */
         if (msg->magic != PROTOCOL_MAGIC) {
             if (on_error) {
                 on_error(context, "Invalid protocol magic");
             }
-            return;
+            return -1;
+        }
+        
+        /* Validate length, an oversized frame would never complete */
+        if (msg->length > queue->max_frame_data) {
+            if (on_error) {
+                on_error(context, "Invalid message length");
+            }
+            return -1;
         }
         
         message_total_length = MESSAGE_HEADER_SIZE + msg->length;
         
         /* Check if complete message is available */
-        if (queue->rx_offset < message_total_length) {
+        if (pending < message_total_length) {
             break;
         }
         
@@ -249,15 +729,19 @@ void message_queue_read(void *context, int fd,
             if (on_error) {
                 on_error(context, "Message handler error");
             }
-            return;
+            return -1;
         }
         
-        /* Remove processed message from buffer */
-        queue->rx_offset -= message_total_length;
-        if (queue->rx_offset > 0) {
-            memmove(queue->rx_buffer, 
-                    &queue->rx_buffer[message_total_length],
-                    queue->rx_offset);
+        chunk->start_offset += message_total_length;
+    }
+    
+    /* At most one compaction per read, sized for the pending frame */
+    if (prepare_rx_chunk(queue, message_total_length) < 0) {
+        if (on_error) {
+            on_error(context, "Out of buffer memory");
         }
+        return -1;
     }
+    
+    return bytes_read;
 }
@@ -6,24 +6,58 @@
 
 #include "message.h"
 
+struct Chunk;
+
+/* Bytes of whole frames a queue holds before it rejects new ones */
+#define MAX_TX_BUFFER 1000000
+
 /* Callback types */
 typedef int (*MessageReceivedCallback)(void *context, int fd, Message *msg);
 typedef void (*ErrorCallback)(void *context, const char *error);
 
-/* Queue management */
+/* Queue management: queues live in a per-thread registry and may only be
+ * used by the thread that created them */
 int message_queue_init(int fd);
 int message_queue_destroy(int fd);
 
-/* Writing functions */
+/* Raises the payload limit for both directions, up to
+ * MAX_LARGE_MESSAGE_DATA, once the peer has agreed to large frames */
+int message_queue_set_max_frame(int fd, uint32_t max_data);
+
+/* Writing functions. Outgoing frames travel in two lanes by type: file
+ * data and channel closes are bulk, everything else is interactive and
+ * goes out ahead of any queued bulk frames, switching lanes only between
+ * whole frames. A close thus follows every frame queued before it. Frames
+ * go out on channel 0 unless written with message_queue_write_channel(),
+ * the channel field of msg itself is ignored. */
 int message_queue_write(int fd, Message *msg);
+int message_queue_write_channel(int fd, uint16_t channel, Message *msg);
 int message_queue_write_raw(int fd, const char *data, int length);
 int message_queue_has_pending_writes(int fd);
 int message_queue_is_saturated(int fd);
-void message_queue_flush_writes(int fd);
 
-/* Reading functions */
-void message_queue_read(void *context, int fd, 
-                        MessageReceivedCallback on_message,
-                        ErrorCallback on_error);
+/* Writes as much as the socket accepts, returns the bytes still pending
+ * (non-zero means the caller should wait for writability) or -1 */
+int message_queue_flush_writes(int fd);
+
+/* Links a chunk holding whole frames of one lane, e.g. built on another
+ * thread, onto the TX chain; the queue owns it on success. Fails while a
+ * reservation is open, it would end up behind the chunk. */
+int message_queue_append_chunk(int fd, struct Chunk *chunk);
+
+/* Zero-copy writing: reserve a frame of the given type with up to
+ * max_length payload bytes inside the TX buffer, fill its data (and its
+ * channel, 0 by default), then commit the actual length, or discard it
+ * when there turned out to be nothing to send. */
+Message *message_queue_reserve(int fd, uint32_t type, uint32_t max_length);
+int message_queue_commit(int fd, Message *msg, uint32_t length);
+void message_queue_discard(int fd, Message *msg);
+
+/* Reading functions: performs one read and delivers every complete frame,
+ * returns the bytes read, 0 if nothing was available on a non-blocking
+ * socket, or -1 after on_error (the context may be gone by then) */
+int message_queue_read(void *context, int fd, 
+                       MessageReceivedCallback on_message,
+                       ErrorCallback on_error);
 
 #endif /* VSOCK_SHELL_MESSAGE_QUEUE_H */
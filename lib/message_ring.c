@@ -0,0 +1,256 @@
+/*****************************************************************************/
+/*    vsock-shell - Cross-thread message ring implementation                */
+/*****************************************************************************/
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "message_ring.h"
+#include "message_queue.h"
+#include "chunk_pool.h"
+#include "common.h"
+
+/* A slot is free for position p when its sequence equals p and holds the
+ * frame of position p once it reads p + 1. Producers claim positions by
+ * advancing the tail, the consumer releases slots one lap ahead. */
+typedef struct {
+    unsigned int sequence;
+    Chunk *chunk;
+} MessageRingSlot;
+
+struct MessageRing {
+    MessageRingMode mode;
+    unsigned int mask;
+    int event_fd;
+    int signalled;                     /* Wakeup written, not yet consumed */
+    unsigned int tail;                 /* Next position to claim */
+    unsigned int head;                 /* Next position to take, consumer */
+    MessageRingSlot *slots;
+};
+
+/*****************************************************************************/
+MessageRing *message_ring_create(int capacity, MessageRingMode mode)
+{
+    MessageRing *ring;
+    unsigned int size = 2;
+    unsigned int i;
+    
+    while (size < (unsigned int)capacity && size < (1U << 30)) {
+        size *= 2;
+    }
+    
+    ring = (MessageRing *)calloc(1, sizeof(MessageRing));
+    if (!ring) {
+        return NULL;
+    }
+    
+    ring->slots = (MessageRingSlot *)calloc(size, sizeof(MessageRingSlot));
+    ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!ring->slots || ring->event_fd < 0) {
+        VSOCK_LOG_ERROR("Failed to create message ring: %s", strerror(errno));
+        if (ring->event_fd >= 0) {
+            close(ring->event_fd);
+        }
+        free(ring->slots);
+        free(ring);
+        return NULL;
+    }
+    
+    for (i = 0; i < size; i++) {
+        ring->slots[i].sequence = i;
+    }
+    
+    ring->mode = mode;
+    ring->mask = size - 1;
+    return ring;
+}
+
+/*****************************************************************************/
+static Chunk *pop_chunk(MessageRing *ring)
+{
+    MessageRingSlot *slot = &ring->slots[ring->head & ring->mask];
+    Chunk *chunk;
+    
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != ring->head + 1) {
+        return NULL;
+    }
+    
+    chunk = slot->chunk;
+    __atomic_store_n(&slot->sequence, ring->head + ring->mask + 1,
+                     __ATOMIC_RELEASE);
+    ring->head++;
+    return chunk;
+}
+
+/*****************************************************************************/
+void message_ring_destroy(MessageRing *ring)
+{
+    if (!ring) {
+        return;
+    }
+    
+    /* Producers must be done by now, drop whatever they left behind */
+    while (ring->head != ring->tail) {
+        chunk_pool_put(pop_chunk(ring));
+    }
+    
+    close(ring->event_fd);
+    free(ring->slots);
+    free(ring);
+}
+
+/*****************************************************************************/
+int message_ring_event_fd(MessageRing *ring)
+{
+    return ring->event_fd;
+}
+
+/*****************************************************************************/
+static Chunk *frame_chunk(Message *msg)
+{
+    /* Frames built here always start their own chunk */
+    return (Chunk *)((char *)msg - offsetof(Chunk, data));
+}
+
+/*****************************************************************************/
+Message *message_ring_reserve(uint32_t max_length)
+{
+    Message *msg;
+    Chunk *chunk;
+    
+    if (max_length > MAX_LARGE_MESSAGE_DATA) {
+        VSOCK_LOG_ERROR("Message too long: %u", max_length);
+        return NULL;
+    }
+    
+    chunk = chunk_pool_get_sized(MESSAGE_HEADER_SIZE + max_length);
+    if (!chunk) {
+        return NULL;
+    }
+    
+    msg = (Message *)chunk->data;
+    msg->channel = 0;
+    return msg;
+}
+
+/*****************************************************************************/
+static int claim_position(MessageRing *ring, unsigned int *position)
+{
+    unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    unsigned int sequence;
+    
+    while (1) {
+        sequence = __atomic_load_n(&ring->slots[tail & ring->mask].sequence,
+                                   __ATOMIC_ACQUIRE);
+    
+        if ((int)(sequence - tail) < 0) {
+            return -1;                 /* Consumer is a full lap behind */
+        }
+    
+        if (sequence != tail) {
+            /* Another producer claimed this position first */
+            tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+            continue;
+        }
+    
+        if (ring->mode == MESSAGE_RING_SPSC) {
+            __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELAXED);
+            break;
+        }
+    
+        if (__atomic_compare_exchange_n(&ring->tail, &tail, tail + 1, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    
+    *position = tail;
+    return 0;
+}
+
+/*****************************************************************************/
+int message_ring_commit(MessageRing *ring, Message *msg, uint32_t length)
+{
+    Chunk *chunk = frame_chunk(msg);
+    MessageRingSlot *slot;
+    unsigned int position;
+    uint64_t count = 1;
+    
+    if ((int)(MESSAGE_HEADER_SIZE + length) > chunk->capacity) {
+        VSOCK_LOG_ERROR("Commit does not match reservation (length %u)",
+                        length);
+        return -1;
+    }
+    
+    if (claim_position(ring, &position) < 0) {
+        return -1;
+    }
+    
+    msg->magic = PROTOCOL_MAGIC;
+    msg->length = length;
+    chunk->start_offset = 0;
+    chunk->end_offset = MESSAGE_HEADER_SIZE + length;
+    
+    /* Publishing the sequence hands the frame over to the consumer */
+    slot = &ring->slots[position & ring->mask];
+    slot->chunk = chunk;
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+    
+    /* Only the first frame after the consumer caught up wakes it */
+    if (!__atomic_exchange_n(&ring->signalled, 1, __ATOMIC_ACQ_REL)) {
+        if (write(ring->event_fd, &count, sizeof(count)) < 0 &&
+            errno != EAGAIN) {
+            VSOCK_LOG_ERROR("Failed to signal message ring: %s",
+                            strerror(errno));
+        }
+    }
+    
+    return 0;
+}
+
+/*****************************************************************************/
+void message_ring_discard(Message *msg)
+{
+    if (msg) {
+        chunk_pool_put(frame_chunk(msg));
+    }
+}
+
+/*****************************************************************************/
+int message_ring_drain(MessageRing *ring, int fd)
+{
+    uint64_t count;
+    Chunk *chunk;
+    int moved = 0;
+    
+    /* Re-arm the wakeup before looking, so a frame published from here on
+     * either is seen below or signals again */
+    if (read(ring->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        VSOCK_LOG_ERROR("Failed to read message ring: %s", strerror(errno));
+    }
+    __atomic_exchange_n(&ring->signalled, 0, __ATOMIC_ACQ_REL);
+    
+    while (!message_queue_is_saturated(fd)) {
+        chunk = pop_chunk(ring);
+        if (!chunk) {
+            break;
+        }
+    
+        if (message_queue_append_chunk(fd, chunk) < 0) {
+            chunk_pool_put(chunk);
+            return -1;
+        }
+        moved++;
+    }
+    
+    return moved;
+}
+
+/*****************************************************************************/
+int message_ring_is_empty(MessageRing *ring)
+{
+    MessageRingSlot *slot = &ring->slots[ring->head & ring->mask];
+    
+    return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != ring->head + 1;
+}
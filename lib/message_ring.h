@@ -0,0 +1,44 @@
+/*****************************************************************************/
+/*    vsock-shell - Cross-thread message ring interface                     */
+/*****************************************************************************/
+#ifndef VSOCK_SHELL_MESSAGE_RING_H
+#define VSOCK_SHELL_MESSAGE_RING_H
+
+#include "message.h"
+
+/* Frames built on other threads on their way to the event loop that owns
+ * a message queue. Pushing and popping are lock-free: one producer thread
+ * in SPSC mode, any number of them in MPSC mode. */
+typedef enum {
+    MESSAGE_RING_SPSC = 0,
+    MESSAGE_RING_MPSC
+} MessageRingMode;
+
+typedef struct MessageRing MessageRing;
+
+/* Capacity is rounded up to a power of two */
+MessageRing *message_ring_create(int capacity, MessageRingMode mode);
+void message_ring_destroy(MessageRing *ring);
+
+/* eventfd the owning loop watches, it becomes readable when the ring goes
+ * from empty to non-empty */
+int message_ring_event_fd(MessageRing *ring);
+
+/* Producer side: build a frame of up to max_length payload bytes in a
+ * buffer of its own (type and data, the channel defaults to 0), then
+ * publish the actual length. A commit that finds
+ * the ring full returns -1 and leaves the frame reserved, to be committed
+ * again later or discarded. */
+Message *message_ring_reserve(uint32_t max_length);
+int message_ring_commit(MessageRing *ring, Message *msg, uint32_t length);
+void message_ring_discard(Message *msg);
+
+/* Consumer side, owning thread only: moves published frames in order onto
+ * the TX chain of the queue for fd without copying them, until the ring
+ * is empty or the queue is saturated. Returns the frames moved or -1. */
+int message_ring_drain(MessageRing *ring, int fd);
+
+/* Consumer side: whether no published frame is waiting to be drained */
+int message_ring_is_empty(MessageRing *ring);
+
+#endif /* VSOCK_SHELL_MESSAGE_RING_H */
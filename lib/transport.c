@@ -0,0 +1,212 @@
+/*****************************************************************************/
+/*    vsock-shell - Transport implementation                                */
+/*****************************************************************************/
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <linux/vm_sockets.h>
+#include "transport.h"
+#include "common.h"
+
+#ifndef VMADDR_CID_LOCAL
+#define VMADDR_CID_LOCAL 1
+#endif
+
+typedef union {
+    struct sockaddr generic;
+    struct sockaddr_vm vm;
+    struct sockaddr_un un;
+    struct sockaddr_storage storage;
+} TransportSockaddr;
+
+static const char *transport_names[] = {"vsock", "local", "unix"};
+
+#define TRANSPORT_COUNT (int)(sizeof(transport_names) / sizeof(transport_names[0]))
+
+/*****************************************************************************/
+int transport_parse_type(const char *name, TransportType *type)
+{
+    int i;
+    
+    for (i = 0; i < TRANSPORT_COUNT; i++) {
+        if (strcmp(name, transport_names[i]) == 0) {
+            *type = (TransportType)i;
+            return 0;
+        }
+    }
+    
+    return -1;
+}
+
+/*****************************************************************************/
+void transport_describe(const TransportAddress *address,
+                        char *buffer, size_t buffer_size)
+{
+    switch (address->type) {
+        case TRANSPORT_VSOCK:
+            snprintf(buffer, buffer_size, "CID %u on port %u", 
+                     address->cid, address->port);
+            break;
+        case TRANSPORT_VSOCK_LOCAL:
+            snprintf(buffer, buffer_size, "vsock loopback on port %u", 
+                     address->port);
+            break;
+        case TRANSPORT_UNIX:
+            snprintf(buffer, buffer_size, "unix socket %s", address->path);
+            break;
+    }
+}
+
+/*****************************************************************************/
+static int build_sockaddr(const TransportAddress *address, int listening,
+                          TransportSockaddr *addr, socklen_t *addr_len)
+{
+    memset(addr, 0, sizeof(*addr));
+    
+    if (address->type == TRANSPORT_UNIX) {
+        if (strlen(address->path) >= sizeof(addr->un.sun_path)) {
+            VSOCK_LOG_ERROR("Socket path too long: %s", address->path);
+            return -1;
+        }
+        
+        addr->un.sun_family = AF_UNIX;
+        strcpy(addr->un.sun_path, address->path);
+        *addr_len = sizeof(addr->un);
+        return 0;
+    }
+    
+    addr->vm.svm_family = AF_VSOCK;
+    addr->vm.svm_port = address->port;
+    
+    /* Listeners accept both guest and loopback peers */
+    if (listening) {
+        addr->vm.svm_cid = VMADDR_CID_ANY;
+    } else if (address->type == TRANSPORT_VSOCK_LOCAL) {
+        addr->vm.svm_cid = VMADDR_CID_LOCAL;
+    } else {
+        addr->vm.svm_cid = address->cid;
+    }
+    
+    *addr_len = sizeof(addr->vm);
+    return 0;
+}
+
+/*****************************************************************************/
+static int remove_stale_socket(const char *path)
+{
+    struct stat st;
+    
+    if (lstat(path, &st) < 0) {
+        return 0;
+    }
+    
+    /* Never remove anything that is not a socket */
+    if (!S_ISSOCK(st.st_mode)) {
+        VSOCK_LOG_ERROR("'%s' exists and is not a socket", path);
+        return -1;
+    }
+    
+    return unlink(path);
+}
+
+/*****************************************************************************/
+int transport_listen(const TransportAddress *address, int backlog)
+{
+    TransportSockaddr addr;
+    socklen_t addr_len;
+    int sock_fd;
+    int reuse = 1;
+    
+    if (build_sockaddr(address, 1, &addr, &addr_len) < 0) {
+        return -1;
+    }
+    
+    sock_fd = socket(addr.generic.sa_family, SOCK_STREAM, 0);
+    if (sock_fd < 0) {
+        VSOCK_LOG_ERROR("Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+    
+    if (address->type == TRANSPORT_UNIX) {
+        if (remove_stale_socket(address->path) < 0) {
+            close(sock_fd);
+            return -1;
+        }
+    } else if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, 
+                          &reuse, sizeof(reuse)) < 0) {
+        VSOCK_LOG_ERROR("Failed to set SO_REUSEADDR: %s", strerror(errno));
+    }
+    
+    if (bind(sock_fd, &addr.generic, addr_len) < 0) {
+        VSOCK_LOG_ERROR("Failed to bind: %s", strerror(errno));
+        close(sock_fd);
+        return -1;
+    }
+    
+    if (listen(sock_fd, backlog) < 0) {
+        VSOCK_LOG_ERROR("Failed to listen: %s", strerror(errno));
+        close(sock_fd);
+        return -1;
+    }
+    
+    return sock_fd;
+}
+
+/*****************************************************************************/
+int transport_accept(int listen_fd, char *peer, size_t peer_size)
+{
+    TransportSockaddr addr;
+    socklen_t addr_len = sizeof(addr);
+    int client_fd;
+    
+    client_fd = accept(listen_fd, &addr.generic, &addr_len);
+    if (client_fd < 0) {
+        return -1;
+    }
+    
+    if (addr.generic.sa_family == AF_VSOCK) {
+        snprintf(peer, peer_size, "CID %u", addr.vm.svm_cid);
+    } else {
+        snprintf(peer, peer_size, "local peer");
+    }
+    
+    return client_fd;
+}
+
+/*****************************************************************************/
+int transport_connect(const TransportAddress *address)
+{
+    TransportSockaddr addr;
+    socklen_t addr_len;
+    int sock_fd;
+    
+    if (build_sockaddr(address, 0, &addr, &addr_len) < 0) {
+        return -1;
+    }
+    
+    sock_fd = socket(addr.generic.sa_family, SOCK_STREAM, 0);
+    if (sock_fd < 0) {
+        VSOCK_LOG_ERROR("Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+    
+    if (connect(sock_fd, &addr.generic, addr_len) < 0) {
+        VSOCK_LOG_ERROR("Failed to connect: %s", strerror(errno));
+        close(sock_fd);
+        return -1;
+    }
+    
+    return sock_fd;
+}
+
+/*****************************************************************************/
+void transport_close_listener(int listen_fd, const TransportAddress *address)
+{
+    close(listen_fd);
+    
+    if (address->type == TRANSPORT_UNIX) {
+        unlink(address->path);
+    }
+}
@@ -0,0 +1,38 @@
+/*****************************************************************************/
+/*    vsock-shell - Transport interface                                     */
+/*****************************************************************************/
+#ifndef VSOCK_SHELL_TRANSPORT_H
+#define VSOCK_SHELL_TRANSPORT_H
+
+#include <stddef.h>
+#include "common.h"
+
+/* Transport types */
+typedef enum {
+    TRANSPORT_VSOCK = 0,               /* AF_VSOCK to a guest or host CID */
+    TRANSPORT_VSOCK_LOCAL,             /* AF_VSOCK loopback (VMADDR_CID_LOCAL) */
+    TRANSPORT_UNIX                     /* AF_UNIX stream socket path */
+} TransportType;
+
+/* Transport address */
+typedef struct {
+    TransportType type;
+    unsigned int cid;                  /* Peer CID, TRANSPORT_VSOCK only */
+    unsigned int port;                 /* vsock port */
+    char path[MAX_PATH_LENGTH];        /* Socket path, TRANSPORT_UNIX only */
+} TransportAddress;
+
+/* Address handling */
+int transport_parse_type(const char *name, TransportType *type);
+void transport_describe(const TransportAddress *address,
+                        char *buffer, size_t buffer_size);
+
+/* Socket creation, all return a stream socket or -1 */
+int transport_listen(const TransportAddress *address, int backlog);
+int transport_accept(int listen_fd, char *peer, size_t peer_size);
+int transport_connect(const TransportAddress *address);
+
+/* Cleanup */
+void transport_close_listener(int listen_fd, const TransportAddress *address);
+
+#endif /* VSOCK_SHELL_TRANSPORT_H */
@@ -10,10 +10,41 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include "file_transfer_server.h"
+#include "io_pool.h"
+#include "../lib/chunk_pool.h"
 #include "../lib/message_queue.h"
+#include "../lib/message_ring.h"
 #include "../include/message.h"
 #include "../include/common.h"
 
+/* Frames in flight per transfer on the I/O threads */
+#define FILE_IO_MAX_WRITES 8
+#define FILE_IO_READ_AHEAD 4
+
+/* Transfer state shared with the I/O jobs. It outlives its session while
+ * they are still running, so a slow disk never holds up the teardown. */
+typedef struct FileIoTransfer {
+    ClientSession *session;            /* NULL once the session is gone */
+    int fd;
+    MessageRing *frames;               /* Downloads: frames read ahead */
+    off_t read_offset;                 /* Downloads: next read position */
+    uint32_t frame_size;
+    uint16_t channel;                  /* Downloads: channel of the frames */
+    int jobs_pending;
+    int error;                         /* errno of the first failure */
+    int eof;                           /* Downloads: end marker queued */
+    int end_requested;                 /* Uploads: end waits for writes */
+} FileIoTransfer;
+
+/* One read or write on an I/O thread */
+typedef struct {
+    IoJob job;                         /* First, jobs are cast back */
+    FileIoTransfer *transfer;
+    Chunk *chunk;                      /* Uploads: the data to write */
+    off_t offset;
+    int result;                        /* 0, 1 at end of file or -errno */
+} FileIoJob;
+
 /*****************************************************************************/
 static int validate_upload_request(const char *source, const char *destination,
                                    char *response, size_t response_size)
@@ -67,18 +98,97 @@ static int validate_download_request(const char *source, const char *destination
     return 0;
 }
 
+/*****************************************************************************/
+static int start_file_io(ClientSession *session, int with_frames)
+{
+    FileIoTransfer *transfer;
+    
+    transfer = (FileIoTransfer *)calloc(1, sizeof(FileIoTransfer));
+    if (!transfer) {
+        return -1;
+    }
+    
+    if (with_frames) {
+        transfer->frames = message_ring_create(FILE_IO_READ_AHEAD * 2, 
+                                               MESSAGE_RING_SPSC);
+        if (!transfer->frames || 
+            terminal_server_watch_fd(session, 
+                message_ring_event_fd(transfer->frames)) < 0) {
+            message_ring_destroy(transfer->frames);
+            free(transfer);
+            return -1;
+        }
+    }
+    
+    transfer->session = session;
+    transfer->fd = session->file_fd;
+    transfer->frame_size = session->max_frame_data;
+    transfer->channel = session->channel;
+    session->file_io = transfer;
+    return 0;
+}
+
+/*****************************************************************************/
+static void release_file_io(FileIoTransfer *transfer)
+{
+    /* Jobs still running keep it, the last completion releases it */
+    if (transfer->session || transfer->jobs_pending > 0) {
+        return;
+    }
+    
+    if (transfer->frames) {
+        message_ring_destroy(transfer->frames);
+    }
+    
+    close(transfer->fd);
+    free(transfer);
+}
+
+/*****************************************************************************/
+static void stop_file_io(ClientSession *session)
+{
+    FileIoTransfer *transfer = session->file_io;
+    
+    if (transfer->frames) {
+        terminal_server_unwatch_fd(message_ring_event_fd(transfer->frames));
+    }
+    
+    transfer->session = NULL;
+    session->file_io = NULL;
+    session->file_fd = -1;
+    release_file_io(transfer);
+}
+
+/*****************************************************************************/
+static FileIoJob *new_file_job(FileIoTransfer *transfer, IoJobFunction run,
+                               IoJobFunction complete)
+{
+    FileIoJob *file_job = (FileIoJob *)calloc(1, sizeof(FileIoJob));
+    
+    if (file_job) {
+        file_job->job.run = run;
+        file_job->job.complete = complete;
+        file_job->transfer = transfer;
+    }
+    
+    return file_job;
+}
+
 /*****************************************************************************/
 int file_transfer_handle_upload_start(ClientSession *session, Message *msg)
 {
-    char buffer[MAX_MESSAGE_DATA + 1];
+    char *buffer;
     char *source_path;
     char *dest_path;
     char response[MAX_PATH_LENGTH];
     Message response_msg;
     
-    /* Parse request */
-    memcpy(buffer, msg->data, msg->length);
-    buffer[msg->length] = '\0';
+    /* Parse request in place */
+    buffer = message_payload_string(msg);
+    if (!buffer) {
+        VSOCK_LOG_ERROR("Invalid upload request format");
+        return -1;
+    }
     
     source_path = strtok(buffer, " ");
     dest_path = strtok(NULL, " ");
@@ -103,6 +213,12 @@ int file_transfer_handle_upload_start(ClientSession *session, Message *msg)
         } else {
             strncpy(session->file_path, dest_path, sizeof(session->file_path) - 1);
             session->connection_type = CONNECTION_TYPE_FILE_UPLOAD;
+            session->file_offset = 0;
+            
+            /* Written by the I/O pool when it runs */
+            if (io_pool_enabled() && start_file_io(session, 0) < 0) {
+                VSOCK_LOG_ERROR("Writing '%s' inline", dest_path);
+            }
             VSOCK_LOG_INFO("Ready to receive file: %s", dest_path);
         }
     }
@@ -112,7 +228,7 @@ int file_transfer_handle_upload_start(ClientSession *session, Message *msg)
     response_msg.length = strlen(response) + 1;
     memcpy(response_msg.data, response, response_msg.length);
     
-    if (message_queue_write(session->socket_fd, &response_msg) < 0) {
+    if (terminal_server_write(session, &response_msg) < 0) {
         VSOCK_LOG_ERROR("Failed to send upload response");
         return -1;
     }
@@ -123,15 +239,18 @@ int file_transfer_handle_upload_start(ClientSession *session, Message *msg)
 /*****************************************************************************/
 int file_transfer_handle_download_start(ClientSession *session, Message *msg)
 {
-    char buffer[MAX_MESSAGE_DATA + 1];
+    char *buffer;
     char *source_path;
     char *dest_path;
     char response[MAX_PATH_LENGTH];
     Message response_msg;
     
-    /* Parse request */
-    memcpy(buffer, msg->data, msg->length);
-    buffer[msg->length] = '\0';
+    /* Parse request in place */
+    buffer = message_payload_string(msg);
+    if (!buffer) {
+        VSOCK_LOG_ERROR("Invalid download request format");
+        return -1;
+    }
     
     source_path = strtok(buffer, " ");
     dest_path = strtok(NULL, " ");
@@ -156,6 +275,10 @@ int file_transfer_handle_download_start(ClientSession *session, Message *msg)
         } else {
             strncpy(session->file_path, source_path, sizeof(session->file_path) - 1);
             session->connection_type = CONNECTION_TYPE_FILE_DOWNLOAD;
+            
+            if (io_pool_enabled() && start_file_io(session, 1) < 0) {
+                VSOCK_LOG_ERROR("Reading '%s' inline", source_path);
+            }
             VSOCK_LOG_INFO("Ready to send file: %s", source_path);
         }
     }
@@ -165,7 +288,7 @@ int file_transfer_handle_download_start(ClientSession *session, Message *msg)
     response_msg.length = strlen(response) + 1;
     memcpy(response_msg.data, response, response_msg.length);
     
-    if (message_queue_write(session->socket_fd, &response_msg) < 0) {
+    if (terminal_server_write(session, &response_msg) < 0) {
         VSOCK_LOG_ERROR("Failed to send download response");
         return -1;
     }
@@ -173,6 +296,137 @@ int file_transfer_handle_download_start(ClientSession *session, Message *msg)
     return 0;
 }
 
+/*****************************************************************************/
+static void run_file_write(IoJob *job)
+{
+    FileIoJob *file_job = (FileIoJob *)job;
+    Chunk *chunk = file_job->chunk;
+    ssize_t bytes_written;
+    int offset = 0;
+    
+    while (offset < chunk->end_offset) {
+        bytes_written = pwrite(file_job->transfer->fd, &chunk->data[offset],
+                               chunk->end_offset - offset, 
+                               file_job->offset + offset);
+        if (bytes_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            file_job->result = -errno;
+            return;
+        }
+        offset += bytes_written;
+    }
+}
+
+/*****************************************************************************/
+static int finish_offloaded_upload(ClientSession *session)
+{
+    FileIoTransfer *transfer = session->file_io;
+    Message msg;
+    
+    if (transfer->error) {
+        VSOCK_LOG_ERROR("File transfer failed: %s", session->file_path);
+        return -1;
+    }
+    
+    stop_file_io(session);
+    VSOCK_LOG_INFO("File transfer completed: %s", session->file_path);
+    
+    msg.type = MSG_TYPE_FILE_DATA_END_ACK;
+    msg.length = 0;
+    
+    if (terminal_server_write(session, &msg) < 0) {
+        VSOCK_LOG_ERROR("Failed to send end acknowledgment");
+        return -1;
+    }
+    
+    return 0;
+}
+
+/*****************************************************************************/
+static void complete_file_write(IoJob *job)
+{
+    FileIoJob *file_job = (FileIoJob *)job;
+    FileIoTransfer *transfer = file_job->transfer;
+    ClientSession *session = transfer->session;
+    int result = file_job->result;
+    
+    chunk_pool_put(file_job->chunk);
+    free(file_job);
+    
+    transfer->jobs_pending--;
+    if (result < 0 && !transfer->error) {
+        VSOCK_LOG_ERROR("Failed to write file data: %s", strerror(-result));
+        transfer->error = -result;
+    }
+    
+    if (!session) {
+        release_file_io(transfer);
+        return;
+    }
+    
+    if (transfer->error) {
+        terminal_server_destroy_session(session);
+        return;
+    }
+    
+    if (transfer->end_requested && transfer->jobs_pending == 0 &&
+        finish_offloaded_upload(session) < 0) {
+        terminal_server_destroy_session(session);
+        return;
+    }
+    
+    /* Socket reads may have paused on this transfer */
+    terminal_server_wake_session(session);
+}
+
+/*****************************************************************************/
+static int submit_file_write(ClientSession *session, Message *msg)
+{
+    FileIoTransfer *transfer = session->file_io;
+    FileIoJob *file_job;
+    Chunk *chunk;
+    
+    if (transfer->error) {
+        return -1;
+    }
+    
+    /* The frame lives in the RX chunk, which is reused after this call */
+    chunk = chunk_pool_get_sized(msg->length);
+    if (!chunk) {
+        return -1;
+    }
+    memcpy(chunk->data, msg->data, msg->length);
+    chunk->end_offset = msg->length;
+    
+    file_job = new_file_job(transfer, run_file_write, complete_file_write);
+    if (!file_job) {
+        chunk_pool_put(chunk);
+        return -1;
+    }
+    file_job->chunk = chunk;
+    file_job->offset = session->file_offset;
+    
+    if (io_pool_submit(&file_job->job) < 0) {
+        VSOCK_LOG_ERROR("Failed to queue file write");
+        chunk_pool_put(chunk);
+        free(file_job);
+        return -1;
+    }
+    
+    session->file_offset += msg->length;
+    transfer->jobs_pending++;
+    return 0;
+}
+
+/*****************************************************************************/
+int file_transfer_can_receive(ClientSession *session)
+{
+    return !session->file_io || 
+           session->file_io->jobs_pending < FILE_IO_MAX_WRITES;
+}
+
 /*****************************************************************************/
 int file_transfer_handle_data(ClientSession *session, Message *msg)
 {
@@ -188,6 +442,10 @@ int file_transfer_handle_data(ClientSession *session, Message *msg)
         return -1;
     }
     
+    if (session->file_io) {
+        return submit_file_write(session, msg);
+    }
+    
     bytes_written = write(session->file_fd, msg->data, msg->length);
     
     if (bytes_written < 0) {
@@ -208,6 +466,15 @@ int file_transfer_handle_data_end(ClientSession *session)
 {
     Message msg;
     
+    /* Acknowledged by the last write completion */
+    if (session->file_io) {
+        if (session->file_io->jobs_pending > 0) {
+            session->file_io->end_requested = 1;
+            return 0;
+        }
+        return finish_offloaded_upload(session);
+    }
+    
     if (session->file_fd >= 0) {
         close(session->file_fd);
         session->file_fd = -1;
@@ -219,7 +486,7 @@ int file_transfer_handle_data_end(ClientSession *session)
     msg.type = MSG_TYPE_FILE_DATA_END_ACK;
     msg.length = 0;
     
-    if (message_queue_write(session->socket_fd, &msg) < 0) {
+    if (terminal_server_write(session, &msg) < 0) {
         VSOCK_LOG_ERROR("Failed to send end acknowledgment");
         return -1;
     }
@@ -228,17 +495,150 @@ int file_transfer_handle_data_end(ClientSession *session)
 }
 
 /*****************************************************************************/
-void file_transfer_send_data(ClientSession *session)
+static void run_file_read(IoJob *job)
+{
+    FileIoJob *file_job = (FileIoJob *)job;
+    FileIoTransfer *transfer = file_job->transfer;
+    Message *msg;
+    ssize_t bytes_read;
+    int i;
+    
+    /* Frames go out through the ring as soon as they are read */
+    for (i = 0; i < FILE_IO_READ_AHEAD; i++) {
+        msg = message_ring_reserve(transfer->frame_size);
+        if (!msg) {
+            file_job->result = -ENOMEM;
+            return;
+        }
+        
+        do {
+            bytes_read = pread(transfer->fd, msg->data, transfer->frame_size,
+                               file_job->offset);
+        } while (bytes_read < 0 && errno == EINTR);
+        
+        if (bytes_read < 0) {
+            file_job->result = -errno;
+            message_ring_discard(msg);
+            return;
+        }
+        
+        msg->type = bytes_read ? MSG_TYPE_FILE_DATA : MSG_TYPE_FILE_DATA_END;
+        msg->channel = transfer->channel;
+        
+        /* The loop only reads ahead into an empty ring, so this fits */
+        if (message_ring_commit(transfer->frames, msg, bytes_read) < 0) {
+            file_job->result = -ENOBUFS;
+            message_ring_discard(msg);
+            return;
+        }
+        
+        if (bytes_read == 0) {
+            file_job->result = 1;
+            return;
+        }
+        file_job->offset += bytes_read;
+    }
+}
+
+/*****************************************************************************/
+static void complete_file_read(IoJob *job)
+{
+    FileIoJob *file_job = (FileIoJob *)job;
+    FileIoTransfer *transfer = file_job->transfer;
+    
+    transfer->jobs_pending--;
+    transfer->read_offset = file_job->offset;
+    
+    if (file_job->result < 0) {
+        VSOCK_LOG_ERROR("Failed to read file: %s", strerror(-file_job->result));
+        transfer->error = -file_job->result;
+    } else if (file_job->result > 0) {
+        transfer->eof = 1;
+    }
+    
+    free(file_job);
+    
+    if (!transfer->session) {
+        release_file_io(transfer);
+        return;
+    }
+    
+    /* Read ahead again, or finish once the ring has been sent */
+    terminal_server_wake_session(transfer->session);
+}
+
+/*****************************************************************************/
+static int send_offloaded_data(ClientSession *session)
+{
+    FileIoTransfer *transfer = session->file_io;
+    FileIoJob *file_job;
+    int frames;
+    
+    /* Read ahead is at most a ring's worth, so it is not split up */
+    frames = message_ring_drain(transfer->frames, session->socket_fd);
+    if (frames < 0) {
+        VSOCK_LOG_ERROR("Failed to send file data");
+        stop_file_io(session);
+        return 0;
+    }
+    
+    /* The ring is empty unless the socket queue filled up first */
+    if (!message_ring_is_empty(transfer->frames) || transfer->jobs_pending > 0) {
+        return frames * transfer->frame_size;
+    }
+    
+    if (transfer->eof || transfer->error) {
+        if (transfer->eof) {
+            VSOCK_LOG_INFO("File send completed: %s", session->file_path);
+        }
+        stop_file_io(session);
+        return frames * transfer->frame_size;
+    }
+    
+    file_job = new_file_job(transfer, run_file_read, complete_file_read);
+    if (!file_job) {
+        return frames * transfer->frame_size;
+    }
+    file_job->offset = transfer->read_offset;
+    
+    /* Larger frames may have been agreed on since the last read */
+    transfer->frame_size = session->max_frame_data;
+    
+    if (io_pool_submit(&file_job->job) < 0) {
+        VSOCK_LOG_ERROR("Failed to queue file read");
+        free(file_job);
+        stop_file_io(session);
+        return frames * transfer->frame_size;
+    }
+    
+    transfer->jobs_pending++;
+    return frames * transfer->frame_size;
+}
+
+/*****************************************************************************/
+int file_transfer_has_data(ClientSession *session)
+{
+    FileIoTransfer *transfer = session->file_io;
+    
+    /* Offloaded reads have work once frames arrived or a read is due */
+    return !transfer || transfer->jobs_pending == 0 ||
+           !message_ring_is_empty(transfer->frames);
+}
+
+/*****************************************************************************/
+int file_transfer_send_data(ClientSession *session, int budget)
 {
     Message msg;
+    Message *data_msg;
     ssize_t bytes_read;
+    int bytes_sent = 0;
     
     if (session->file_fd < 0) {
-        return;
+        return 0;
     }
     
     if (session->connection_type != CONNECTION_TYPE_FILE_DOWNLOAD) {
-        return;
+        return 0;
     }
     
     /* Send begin marker on first call */
@@ -246,23 +646,38 @@ void file_transfer_send_data(ClientSession *session)
         msg.type = MSG_TYPE_FILE_DATA_BEGIN;
         msg.length = 0;
         
-        if (message_queue_write(session->socket_fd, &msg) < 0) {
+        if (terminal_server_write(session, &msg) < 0) {
             VSOCK_LOG_ERROR("Failed to send data begin marker");
-            return;
+            return 0;
         }
         
         session->file_transfer_started = 1;
     }
     
-    /* Read and send file data */
-    while (1) {
-        bytes_read = read(session->file_fd, msg.data, MAX_MESSAGE_DATA);
+    if (session->file_io) {
+        return send_offloaded_data(session);
+    }
+    
+    /* Read file data straight into outgoing frames */
+    while (bytes_sent < budget) {
+        data_msg = terminal_server_reserve(session, MSG_TYPE_FILE_DATA,
+                                           session->max_frame_data);
+        if (!data_msg) {
+            /* Retry once the queue has drained */
+            break;
+        }
+        
+        bytes_read = read(session->file_fd, data_msg->data, 
+                          session->max_frame_data);
+        if (bytes_read <= 0) {
+            message_queue_discard(session->socket_fd, data_msg);
+        }
         
         if (bytes_read < 0) {
             VSOCK_LOG_ERROR("Failed to read file: %s", strerror(errno));
             close(session->file_fd);
             session->file_fd = -1;
-            return;
+            return bytes_sent;
         }
         
         if (bytes_read == 0) {
@@ -270,7 +685,7 @@ void file_transfer_send_data(ClientSession *session)
             msg.type = MSG_TYPE_FILE_DATA_END;
             msg.length = 0;
             
-            if (message_queue_write(session->socket_fd, &msg) < 0) {
+            if (terminal_server_write(session, &msg) < 0) {
                 VSOCK_LOG_ERROR("Failed to send data end marker");
             }
             
@@ -282,19 +697,56 @@ void file_transfer_send_data(ClientSession *session)
         }
         
         /* Send data chunk */
-        msg.type = MSG_TYPE_FILE_DATA;
-        msg.length = bytes_read;
-        
-        if (message_queue_write(session->socket_fd, &msg) < 0) {
+        if (message_queue_commit(session->socket_fd, data_msg, bytes_read) < 0) {
             VSOCK_LOG_ERROR("Failed to send file data");
             close(session->file_fd);
             session->file_fd = -1;
-            return;
+            return bytes_sent;
         }
+        bytes_sent += bytes_read;
         
         /* Check if write queue is saturated */
         if (message_queue_is_saturated(session->socket_fd)) {
             break;
         }
     }
+    
+    return bytes_sent;
+}
+
+/*****************************************************************************/
+void file_transfer_close(ClientSession *session)
+{
+    /* Jobs on the I/O threads finish on their own */
+    if (session->file_io) {
+        stop_file_io(session);
+        return;
+    }
+    
+    if (session->file_fd >= 0) {
+        close(session->file_fd);
+        session->file_fd = -1;
+    }
+}
+
+/*****************************************************************************/
+int file_transfer_init_worker(void)
+{
+    if (!io_pool_enabled()) {
+        return -1;
+    }
+    
+    return io_pool_init_loop();
+}
+
+/*****************************************************************************/
+void file_transfer_handle_completions(void)
+{
+    io_pool_run_completions();
+}
+
+/*****************************************************************************/
+void file_transfer_cleanup(void)
+{
+    io_pool_cleanup_loop();
 }
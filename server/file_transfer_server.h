@@ -12,7 +12,24 @@ int file_transfer_handle_download_start(ClientSession *session, Message *msg);
 int file_transfer_handle_data(ClientSession *session, Message *msg);
 int file_transfer_handle_data_end(ClientSession *session);
 
-/* File sending */
-void file_transfer_send_data(ClientSession *session);
+/* File sending: queues frames until about budget bytes went out, returns
+ * the bytes queued. has_data tells whether sending can make progress
+ * right now rather than after the disk catches up. */
+int file_transfer_send_data(ClientSession *session, int budget);
+int file_transfer_has_data(ClientSession *session);
+
+/* Whether upload data may be read from the socket, false while the disk
+ * lags behind by too many frames */
+int file_transfer_can_receive(ClientSession *session);
+
+/* Closes the session's file, writes still queued finish on their own */
+void file_transfer_close(ClientSession *session);
+
+/* I/O thread backend: reads and writes run on the I/O pool when it has
+ * been started. Completions are signalled on the returned eventfd, the
+ * loop watches it and calls file_transfer_handle_completions(). */
+int file_transfer_init_worker(void);
+void file_transfer_handle_completions(void);
+void file_transfer_cleanup(void);
 
 #endif /* VSOCK_SHELL_FILE_TRANSFER_SERVER_H */
@@ -0,0 +1,259 @@
+/*****************************************************************************/
+/*    vsock-shell - Blocking I/O thread pool implementation                 */
+/*****************************************************************************/
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "io_pool.h"
+#include "../include/common.h"
+
+/* Finished jobs waiting for the loop that submitted them */
+typedef struct IoCompletionQueue {
+    pthread_mutex_t lock;
+    IoJob *head;
+    IoJob *tail;
+    int event_fd;
+} IoCompletionQueue;
+
+/* Jobs waiting for a pool thread, in submission order */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_ready = PTHREAD_COND_INITIALIZER;
+static IoJob *pending_head = NULL;
+static IoJob *pending_tail = NULL;
+static pthread_t *pool_threads = NULL;
+static int pool_thread_count = 0;
+static int pool_stopping = 0;
+
+static __thread IoCompletionQueue *loop_queue = NULL;
+
+/*****************************************************************************/
+static void complete_job(IoJob *job)
+{
+    IoCompletionQueue *queue = job->origin;
+    uint64_t count = 1;
+    int was_empty;
+    
+    pthread_mutex_lock(&queue->lock);
+    was_empty = (queue->head == NULL);
+    job->next = NULL;
+    if (queue->tail) {
+        queue->tail->next = job;
+    } else {
+        queue->head = job;
+    }
+    queue->tail = job;
+    pthread_mutex_unlock(&queue->lock);
+    
+    /* The loop takes the whole list at once, one wakeup covers it */
+    if (was_empty && write(queue->event_fd, &count, sizeof(count)) < 0 &&
+        errno != EAGAIN) {
+        VSOCK_LOG_ERROR("Failed to signal I/O completion: %s", strerror(errno));
+    }
+}
+
+/*****************************************************************************/
+static void *io_thread_main(void *argument)
+{
+    IoJob *job;
+    
+    UNUSED(argument);
+    
+    while (1) {
+        pthread_mutex_lock(&pool_lock);
+        while (!pending_head && !pool_stopping) {
+            pthread_cond_wait(&pool_ready, &pool_lock);
+        }
+    
+        if (pool_stopping) {
+            pthread_mutex_unlock(&pool_lock);
+            break;
+        }
+    
+        job = pending_head;
+        pending_head = job->next;
+        if (!pending_head) {
+            pending_tail = NULL;
+        }
+        pthread_mutex_unlock(&pool_lock);
+    
+        job->run(job);
+        complete_job(job);
+    }
+    
+    return NULL;
+}
+
+/*****************************************************************************/
+int io_pool_start(int thread_count)
+{
+    sigset_t all_signals, saved_mask;
+    int result;
+    
+    if (thread_count <= 0) {
+        return 0;
+    }
+    
+    if (thread_count > MAX_IO_THREADS) {
+        thread_count = MAX_IO_THREADS;
+    }
+    
+    pool_threads = (pthread_t *)calloc(thread_count, sizeof(pthread_t));
+    if (!pool_threads) {
+        VSOCK_LOG_ERROR("Failed to allocate I/O threads");
+        return -1;
+    }
+    
+    /* Signals are for the main thread only */
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &saved_mask);
+    
+    while (pool_thread_count < thread_count) {
+        result = pthread_create(&pool_threads[pool_thread_count], NULL,
+                                io_thread_main, NULL);
+        if (result != 0) {
+            VSOCK_LOG_ERROR("Failed to start I/O thread: %s", strerror(result));
+            break;
+        }
+        pool_thread_count++;
+    }
+    
+    pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+    
+    if (pool_thread_count == 0) {
+        free(pool_threads);
+        pool_threads = NULL;
+        return -1;
+    }
+    
+    VSOCK_LOG_INFO("Started %d I/O threads", pool_thread_count);
+    return 0;
+}
+
+/*****************************************************************************/
+void io_pool_stop(void)
+{
+    int i;
+    
+    pthread_mutex_lock(&pool_lock);
+    pool_stopping = 1;
+    pthread_cond_broadcast(&pool_ready);
+    pthread_mutex_unlock(&pool_lock);
+    
+    /* Jobs still queued are dropped, the process is going away */
+    for (i = 0; i < pool_thread_count; i++) {
+        pthread_join(pool_threads[i], NULL);
+    }
+    
+    free(pool_threads);
+    pool_threads = NULL;
+    pool_thread_count = 0;
+}
+
+/*****************************************************************************/
+int io_pool_enabled(void)
+{
+    return pool_thread_count > 0;
+}
+
+/*****************************************************************************/
+int io_pool_init_loop(void)
+{
+    IoCompletionQueue *queue;
+    
+    if (loop_queue) {
+        return loop_queue->event_fd;
+    }
+    
+    queue = (IoCompletionQueue *)calloc(1, sizeof(IoCompletionQueue));
+    if (!queue) {
+        return -1;
+    }
+    
+    queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->event_fd < 0) {
+        VSOCK_LOG_ERROR("Failed to create I/O completion eventfd: %s",
+                        strerror(errno));
+        free(queue);
+        return -1;
+    }
+    
+    pthread_mutex_init(&queue->lock, NULL);
+    loop_queue = queue;
+    return queue->event_fd;
+}
+
+/*****************************************************************************/
+void io_pool_cleanup_loop(void)
+{
+    if (!loop_queue) {
+        return;
+    }
+    
+    close(loop_queue->event_fd);
+    pthread_mutex_destroy(&loop_queue->lock);
+    free(loop_queue);
+    loop_queue = NULL;
+}
+
+/*****************************************************************************/
+int io_pool_submit(IoJob *job)
+{
+    if (!loop_queue) {
+        return -1;
+    }
+    
+    job->origin = loop_queue;
+    job->next = NULL;
+    
+    pthread_mutex_lock(&pool_lock);
+    if (pool_stopping || pool_thread_count == 0) {
+        pthread_mutex_unlock(&pool_lock);
+        return -1;
+    }
+    
+    if (pending_tail) {
+        pending_tail->next = job;
+    } else {
+        pending_head = job;
+    }
+    pending_tail = job;
+    
+    pthread_cond_signal(&pool_ready);
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+/*****************************************************************************/
+void io_pool_run_completions(void)
+{
+    IoJob *job;
+    IoJob *next_job;
+    uint64_t count;
+    
+    if (!loop_queue) {
+        return;
+    }
+    
+    if (read(loop_queue->event_fd, &count, sizeof(count)) < 0 &&
+        errno != EAGAIN) {
+        VSOCK_LOG_ERROR("Failed to read I/O completions: %s", strerror(errno));
+    }
+    
+    pthread_mutex_lock(&loop_queue->lock);
+    job = loop_queue->head;
+    loop_queue->head = NULL;
+    loop_queue->tail = NULL;
+    pthread_mutex_unlock(&loop_queue->lock);
+    
+    /* complete() owns the job and may free it */
+    while (job) {
+        next_job = job->next;
+        job->complete(job);
+        job = next_job;
+    }
+}
@@ -0,0 +1,37 @@
+/*****************************************************************************/
+/*    vsock-shell - Blocking I/O thread pool interface                      */
+/*****************************************************************************/
+#ifndef VSOCK_SHELL_IO_POOL_H
+#define VSOCK_SHELL_IO_POOL_H
+
+#define MAX_IO_THREADS 64
+
+typedef struct IoJob IoJob;
+typedef void (*IoJobFunction)(IoJob *job);
+
+/* Embedded first in the caller's own job structure. run() may block and
+ * happens on a pool thread, complete() then runs on the event loop that
+ * submitted the job and owns it from there on. */
+struct IoJob {
+    IoJobFunction run;
+    IoJobFunction complete;
+    struct IoCompletionQueue *origin;
+    IoJob *next;
+};
+
+/* Process-wide pool, zero threads leaves it disabled */
+int io_pool_start(int thread_count);
+void io_pool_stop(void);
+int io_pool_enabled(void);
+
+/* Per event loop: returns an eventfd that becomes readable once jobs the
+ * calling thread submitted have completed */
+int io_pool_init_loop(void);
+void io_pool_cleanup_loop(void);
+
+int io_pool_submit(IoJob *job);
+
+/* Runs complete() for every job of the calling loop that has finished */
+void io_pool_run_completions(void);
+
+#endif /* VSOCK_SHELL_IO_POOL_H */
@@ -8,13 +8,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
-#include <linux/vm_sockets.h>
 #include "terminal_server.h"
+#include "worker.h"
+#include "io_pool.h"
+#include "../lib/transport.h"
 #include "common.h"
 
+#define MAX_EPOLL_EVENTS 64
+
 static int listen_socket_fd = -1;
+static int epoll_fd = -1;
+static TransportAddress listen_address;
 static int signal_pipe_fds[2] = {-1, -1};
 static volatile int server_running = 1;
 
@@ -23,73 +29,55 @@ static void print_usage(const char *program_name)
 {
     printf("Usage: %s [OPTIONS]\n\n", program_name);
     printf("Options:\n");
-    printf("  --port PORT    Listen port number (default: 9999)\n");
-    printf("  --help         Show this help message\n\n");
-    printf("Example:\n");
+    printf("  --port PORT         Listen port number (default: 9999)\n");
+    printf("  --transport TYPE    vsock, local or unix (default: vsock)\n");
+    printf("  --socket PATH       Socket path for the unix transport\n");
+    printf("  --shell-pool N      Keep N shells started ahead (default: 0)\n");
+    printf("  --workers N         Session worker threads (default: 1)\n");
+    printf("  --io-threads N      Threads for file reads and writes, 0 does them\n"
+           "                      on the session thread (default: 4)\n");
+    printf("  --help              Show this help message\n\n");
+    printf("Examples:\n");
     printf("  %s --port 9999\n", program_name);
+    printf("  %s --transport unix --socket /tmp/vsock-shell.sock\n", 
+           program_name);
 }
 
 /*****************************************************************************/
-static int create_listen_socket(unsigned int port)
+static int create_listen_socket(const TransportAddress *address)
 {
+    char description[MAX_PATH_LENGTH + 32];
     int sock_fd;
-    struct sockaddr_vm addr;
-    int reuse = 1;
-    
-    /* Create vsock socket */
-    sock_fd = socket(AF_VSOCK, SOCK_STREAM, 0);
-    if (sock_fd < 0) {
-        VSOCK_LOG_FATAL("Failed to create socket: %s", strerror(errno));
-    }
-    
-    /* Set socket options */
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, 
-                   &reuse, sizeof(reuse)) < 0) {
-        VSOCK_LOG_ERROR("Failed to set SO_REUSEADDR: %s", strerror(errno));
-    }
     
-    /* Bind to address */
-    memset(&addr, 0, sizeof(addr));
-    addr.svm_family = AF_VSOCK;
-    addr.svm_cid = VMADDR_CID_ANY;
-    addr.svm_port = port;
+    transport_describe(address, description, sizeof(description));
     
-    if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        VSOCK_LOG_FATAL("Failed to bind to port %u: %s", port, strerror(errno));
-    }
-    
-    /* Start listening */
-    if (listen(sock_fd, 5) < 0) {
-        VSOCK_LOG_FATAL("Failed to listen: %s", strerror(errno));
+    sock_fd = transport_listen(address, 5);
+    if (sock_fd < 0) {
+        VSOCK_LOG_FATAL("Failed to listen on %s", description);
     }
     
-    VSOCK_LOG_INFO("Listening on port %u", port);
+    VSOCK_LOG_INFO("Listening on %s", description);
     return sock_fd;
 }
 
 /*****************************************************************************/
 static void handle_new_connection(void)
 {
-    struct sockaddr_vm client_addr;
-    socklen_t addr_len = sizeof(client_addr);
+    char peer[64];
     int client_fd;
-    ClientSession *session;
     
-    client_fd = accept(listen_socket_fd, 
-                      (struct sockaddr *)&client_addr, &addr_len);
+    client_fd = transport_accept(listen_socket_fd, peer, sizeof(peer));
     
     if (client_fd < 0) {
         VSOCK_LOG_ERROR("Failed to accept connection: %s", strerror(errno));
         return;
     }
     
-    VSOCK_LOG_INFO("New connection from CID %u", client_addr.svm_cid);
+    VSOCK_LOG_INFO("New connection from %s", peer);
     
-    session = terminal_server_create_session(client_fd);
-    if (!session) {
-        VSOCK_LOG_ERROR("Failed to create session");
+    /* From here on the connection belongs to a worker thread */
+    if (worker_pool_dispatch(client_fd) < 0) {
         close(client_fd);
-        return;
     }
 }
 
@@ -99,48 +87,59 @@ static void handle_signal_notification(void)
     char notification;
     
     if (read(signal_pipe_fds[0], &notification, 1) > 0) {
-        terminal_server_cleanup_dead_sessions();
+        if (notification == 'T') {
+            VSOCK_LOG_INFO("Shutting down");
+            server_running = 0;
+            return;
+        }
+        worker_pool_reap_children();
+    }
+}
+
+/*****************************************************************************/
+static void watch_server_fd(int fd)
+{
+    struct epoll_event event;
+    
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        VSOCK_LOG_FATAL("Failed to watch fd %d: %s", fd, strerror(errno));
     }
 }
 
 /*****************************************************************************/
 static void server_main_loop(void)
 {
-    fd_set read_fds;
-    int max_fd;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int event_count;
+    int i;
+    
+    watch_server_fd(listen_socket_fd);
+    watch_server_fd(signal_pipe_fds[0]);
     
     while (server_running) {
-        FD_ZERO(&read_fds);
-        FD_SET(listen_socket_fd, &read_fds);
-        FD_SET(signal_pipe_fds[0], &read_fds);
-        
-        max_fd = (listen_socket_fd > signal_pipe_fds[0]) ? 
-                 listen_socket_fd : signal_pipe_fds[0];
-        
-        /* Add session file descriptors */
-        terminal_server_setup_select(&read_fds, &max_fd);
-        
-        /* Wait for events */
-        if (select(max_fd + 1, &read_fds, NULL, NULL, NULL) < 0) {
+        /* Wait for events, only ready descriptors are reported */
+        event_count = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (event_count < 0) {
             if (errno == EINTR) {
                 continue;
             }
-            VSOCK_LOG_ERROR("Select error: %s", strerror(errno));
+            VSOCK_LOG_ERROR("Epoll error: %s", strerror(errno));
             break;
         }
         
-        /* Handle new connections */
-        if (FD_ISSET(listen_socket_fd, &read_fds)) {
-            handle_new_connection();
-        }
-        
-        /* Handle signal notifications */
-        if (FD_ISSET(signal_pipe_fds[0], &read_fds)) {
-            handle_signal_notification();
+        for (i = 0; i < event_count; i++) {
+            if (events[i].data.fd == listen_socket_fd) {
+                /* Handle new connections */
+                handle_new_connection();
+            } else if (events[i].data.fd == signal_pipe_fds[0]) {
+                /* Handle signal notifications */
+                handle_signal_notification();
+            }
         }
-        
-        /* Handle session I/O */
-        terminal_server_handle_io(&read_fds);
     }
 }
 
@@ -148,18 +147,30 @@ static void server_main_loop(void)
 int main(int argc, char *argv[])
 {
     int option_index = 0;
+    int shell_pool_size = 0;
+    int worker_count = 1;
+    int io_thread_count = 4;
+    WorkerConfig worker_config;
     int c;
-    unsigned int port = 9999;
+    char description[MAX_PATH_LENGTH + 32];
     
     static struct option long_options[] = {
-        {"port", required_argument, 0, 'p'},
-        {"help", no_argument,       0, 'h'},
+        {"port",      required_argument, 0, 'p'},
+        {"transport", required_argument, 0, 't'},
+        {"socket",    required_argument, 0, 's'},
+        {"shell-pool", required_argument, 0, 'P'},
+        {"workers",   required_argument, 0, 'w'},
+        {"io-threads", required_argument, 0, 'i'},
+        {"help",      no_argument,       0, 'h'},
         {0, 0, 0, 0}
     };
     
+    listen_address.type = TRANSPORT_VSOCK;
+    listen_address.port = 9999;
+    
     /* Parse command line arguments */
     while (1) {
-        c = getopt_long(argc, argv, "p:h", long_options, &option_index);
+        c = getopt_long(argc, argv, "p:t:s:P:w:i:h", long_options, &option_index);
         
         if (c == -1) {
             break;
@@ -167,7 +178,27 @@ int main(int argc, char *argv[])
         
         switch (c) {
             case 'p':
-                port = parse_integer(optarg);
+                listen_address.port = parse_integer(optarg);
+                break;
+            case 't':
+                if (transport_parse_type(optarg, &listen_address.type) < 0) {
+                    fprintf(stderr, "Error: unknown transport '%s'\n\n", optarg);
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 's':
+                snprintf(listen_address.path, sizeof(listen_address.path), 
+                         "%s", optarg);
+                break;
+            case 'P':
+                shell_pool_size = parse_integer(optarg);
+                break;
+            case 'w':
+                worker_count = parse_integer(optarg);
+                break;
+            case 'i':
+                io_thread_count = parse_integer(optarg);
                 break;
             case 'h':
                 print_usage(argv[0]);
@@ -178,31 +209,68 @@ int main(int argc, char *argv[])
         }
     }
     
+    /* Validate required arguments */
+    if (listen_address.type == TRANSPORT_UNIX && listen_address.path[0] == '\0') {
+        fprintf(stderr, "Error: --socket is required for the unix transport\n\n");
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    
     /* Open syslog */
     openlog("vsock-shell-server", LOG_PID, LOG_USER);
     VSOCK_LOG_INFO("Starting vsock-shell server");
     
+    /* Report writes to departed clients as EPIPE instead of dying */
+    signal(SIGPIPE, SIG_IGN);
+    
     /* Create signal pipe */
     if (pipe(signal_pipe_fds) < 0) {
         VSOCK_LOG_FATAL("Failed to create signal pipe: %s", strerror(errno));
     }
     
+    /* Create event loop */
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        VSOCK_LOG_FATAL("Failed to create epoll instance: %s", strerror(errno));
+    }
+    
     /* Initialize server */
     terminal_server_init(signal_pipe_fds[1]);
     
+    /* File I/O falls back to the session thread if this fails */
+    if (io_pool_start(io_thread_count) < 0) {
+        VSOCK_LOG_ERROR("Running without I/O threads");
+    }
+    
+    /* Sessions run on the workers, this thread accepts and takes signals */
+    if (worker_count < 1) {
+        worker_count = 1;
+    }
+    worker_config.shell_pool_size = shell_pool_size;
+    
+    if (worker_pool_start(worker_count, &worker_config) < 0) {
+        VSOCK_LOG_FATAL("Failed to start worker threads");
+    }
+    
     /* Create listen socket */
-    listen_socket_fd = create_listen_socket(port);
+    listen_socket_fd = create_listen_socket(&listen_address);
     
-    printf("vsock-shell server started on port %u\n", port);
+    transport_describe(&listen_address, description, sizeof(description));
+    printf("vsock-shell server started on %s\n", description);
     printf("Waiting for connections...\n");
     
     /* Run main loop */
     server_main_loop();
     
     /* Cleanup */
-    close(listen_socket_fd);
+    transport_close_listener(listen_socket_fd, &listen_address);
+    
+    /* Completions are delivered to the workers, so the pool goes first */
+    io_pool_stop();
+    worker_pool_stop();
     close(signal_pipe_fds[0]);
     close(signal_pipe_fds[1]);
+    close(epoll_fd);
     closelog();
     
     VSOCK_LOG_INFO("Server shutdown");
@@ -0,0 +1,391 @@
+/*****************************************************************************/
+/*    vsock-shell - PTY process spawning implementation                     */
+/*****************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "pty_spawn.h"
+#include "../include/common.h"
+
+/* Environment variables */
+static char env_home[MAX_PATH_LENGTH];
+static char env_path[MAX_PATH_LENGTH];
+static char env_term[MAX_PATH_LENGTH];
+static char env_shell[MAX_PATH_LENGTH];
+static char *spawn_envp[5];
+
+#define SPAWN_ENV_COUNT 4
+
+/* Written by the vfork child, read by the parent once it resumes */
+static __thread volatile int child_errno;
+static __thread const char *volatile child_step;
+
+/*****************************************************************************/
+void pty_spawn_init(void)
+{
+    char *home = getenv("HOME");
+    
+    memset(env_home, 0, sizeof(env_home));
+    memset(env_path, 0, sizeof(env_path));
+    memset(env_term, 0, sizeof(env_term));
+    memset(env_shell, 0, sizeof(env_shell));
+    
+    if (home) {
+        snprintf(env_home, sizeof(env_home) - 1, "HOME=%s", home);
+    } else {
+        snprintf(env_home, sizeof(env_home) - 1, "HOME=/root");
+    }
+    
+    snprintf(env_path, sizeof(env_path) - 1,
+             "PATH=/usr/sbin:/usr/bin:/sbin:/bin");
+    snprintf(env_term, sizeof(env_term) - 1, "TERM=xterm");
+    snprintf(env_shell, sizeof(env_shell) - 1, "SHELL=/bin/bash");
+    
+    spawn_envp[0] = env_home;
+    spawn_envp[1] = env_path;
+    spawn_envp[2] = env_term;
+    spawn_envp[3] = env_shell;
+    spawn_envp[SPAWN_ENV_COUNT] = NULL;
+}
+
+/*****************************************************************************/
+static void close_inherited_fds(int first_fd)
+{
+#ifdef __NR_close_range
+    /* Sockets and PTYs of other sessions must not outlive them here */
+    syscall(__NR_close_range, first_fd, ~0U, 0);
+#else
+    UNUSED(first_fd);
+#endif
+}
+
+/*****************************************************************************/
+static void child_failed(const char *step)
+{
+    child_errno = errno;
+    child_step = step;
+    _exit(127);
+}
+
+/*****************************************************************************/
+static void run_child(const int stdio_fds[3], int controlling_tty,
+                      const char *program, char *const argv[], 
+                      char *const envp[], const char *cwd, int extra_fd)
+{
+    struct sigaction sa;
+    sigset_t no_signals;
+    int i;
+    
+    /* The server handlers must not run in the child, and it shares the
+     * parent memory until execve(), so only plain system calls here */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    sigaction(SIGCHLD, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGPIPE, &sa, NULL);
+    
+    /* Workers run with every signal blocked, the program must not */
+    sigemptyset(&no_signals);
+    pthread_sigmask(SIG_SETMASK, &no_signals, NULL);
+    
+    if (setsid() < 0) {
+        child_failed("setsid");
+    }
+    
+    if (controlling_tty && ioctl(stdio_fds[0], TIOCSCTTY, 0) < 0) {
+        child_failed("set controlling terminal");
+    }
+    
+    if (cwd && chdir(cwd) < 0) {
+        child_failed("change directory");
+    }
+    
+    /* Redirect stdio to the PTY slave or the pipes */
+    for (i = 0; i < 3; i++) {
+        if (dup2(stdio_fds[i], i) < 0) {
+            child_failed("redirect stdio");
+        }
+    }
+    
+    if (extra_fd >= 0) {
+        if (dup2(extra_fd, PTY_SPAWN_EXTRA_FD) < 0) {
+            child_failed("pass descriptor");
+        }
+        close_inherited_fds(PTY_SPAWN_EXTRA_FD + 1);
+    } else {
+        close_inherited_fds(STDERR_FILENO + 1);
+    }
+    
+    execve(program, argv, envp);
+    child_failed("execute");
+}
+
+/*****************************************************************************/
+static long elapsed_usec(const struct timespec *start)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L +
+           (now.tv_nsec - start->tv_nsec) / 1000L;
+}
+
+/*****************************************************************************/
+static int spawn_process(const char *program, char *const argv[], 
+                         char *const envp[], const char *cwd, 
+                         const int stdio_fds[3],
+                         int controlling_tty, int extra_fd, 
+                         const struct timespec *start, pid_t *pid)
+{
+    sigset_t all_signals, saved_mask;
+    pid_t child;
+    int status;
+    
+    /* vfork() borrows the server address space instead of copying its
+     * page tables, so the cost does not grow with the number of sessions.
+     * Signals stay blocked until the child has reset its handlers. */
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &saved_mask);
+    child_errno = 0;
+    child_step = NULL;
+    
+    child = vfork();
+    
+    if (child == 0) {
+        run_child(stdio_fds, controlling_tty, program, argv, envp, cwd, 
+                  extra_fd);
+    }
+    
+    /* Parent process, resumed once the child has exec'd or exited */
+    pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+    
+    if (child < 0) {
+        status = errno;
+        VSOCK_LOG_ERROR("Failed to fork: %s", strerror(status));
+        errno = status;
+        return -1;
+    }
+    
+    if (child_step) {
+        VSOCK_LOG_ERROR("Failed to %s in child: %s", child_step,
+                        strerror(child_errno));
+        waitpid(child, &status, 0);
+        errno = child_errno;
+        return -1;
+    }
+    
+    VSOCK_LOG_INFO("Spawned %s: pid=%d in %ld us", program, child,
+                   elapsed_usec(start));
+    
+    *pid = child;
+    return 0;
+}
+
+/*****************************************************************************/
+int pty_spawn(char *const argv[], int extra_fd, pid_t *pid, int *master_fd)
+{
+    int pty_master_fd, pty_slave_fd;
+    struct timespec start;
+    int stdio_fds[3];
+    int result;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    /* Create PTY pair, the master must not leak into the child */
+    if (openpty(&pty_master_fd, &pty_slave_fd, NULL, NULL, NULL) < 0) {
+        VSOCK_LOG_ERROR("Failed to create PTY: %s", strerror(errno));
+        return -1;
+    }
+    fcntl(pty_master_fd, F_SETFD, FD_CLOEXEC);
+    
+    stdio_fds[0] = pty_slave_fd;
+    stdio_fds[1] = pty_slave_fd;
+    stdio_fds[2] = pty_slave_fd;
+    
+    result = spawn_process(argv[0], argv, spawn_envp, NULL, stdio_fds, 1, 
+                           extra_fd, &start, pid);
+    close(pty_slave_fd);
+    
+    if (result < 0) {
+        close(pty_master_fd);
+        return -1;
+    }
+    
+    *master_fd = pty_master_fd;
+    return 0;
+}
+
+/*****************************************************************************/
+static int env_overrides(char *const env[], const char *entry)
+{
+    size_t length = strcspn(entry, "=");
+    int i;
+    
+    /* Compared up to and including the '=' */
+    for (i = 0; env[i]; i++) {
+        if (strncmp(env[i], entry, length + 1) == 0) {
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+/*****************************************************************************/
+static char **build_environment(char *const env[])
+{
+    char **envp;
+    int count = 0;
+    int used = 0;
+    int i;
+    
+    while (env[count]) {
+        count++;
+    }
+    
+    envp = (char **)malloc((SPAWN_ENV_COUNT + count + 1) * sizeof(char *));
+    if (!envp) {
+        return NULL;
+    }
+    
+    /* Defaults the request does not override, then the request's own */
+    for (i = 0; i < SPAWN_ENV_COUNT; i++) {
+        if (!env_overrides(env, spawn_envp[i])) {
+            envp[used++] = spawn_envp[i];
+        }
+    }
+    
+    for (i = 0; i < count; i++) {
+        envp[used++] = env[i];
+    }
+    
+    envp[used] = NULL;
+    return envp;
+}
+
+/*****************************************************************************/
+int pipe_spawn(const char *program, char *const argv[], char *const env[], 
+               const char *cwd, pid_t *pid, int parent_fds[3])
+{
+    struct timespec start;
+    char **envp = spawn_envp;
+    int stdio_fds[3];
+    int pipe_fds[2];
+    int result;
+    int saved_errno;
+    int i;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    if (env && env[0]) {
+        envp = build_environment(env);
+        if (!envp) {
+            VSOCK_LOG_ERROR("Failed to build environment");
+            return -1;
+        }
+    }
+    
+    /* stdin is written by the server, stdout and stderr are read */
+    for (i = 0; i < 3; i++) {
+        if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+            VSOCK_LOG_ERROR("Failed to create pipe: %s", strerror(errno));
+            while (i-- > 0) {
+                close(stdio_fds[i]);
+                close(parent_fds[i]);
+            }
+            if (envp != spawn_envp) {
+                free(envp);
+            }
+            return -1;
+        }
+    
+        stdio_fds[i] = pipe_fds[i == 0 ? 0 : 1];
+        parent_fds[i] = pipe_fds[i == 0 ? 1 : 0];
+    }
+    
+    result = spawn_process(program, argv, envp, cwd, stdio_fds, 0, -1, 
+                           &start, pid);
+    saved_errno = errno;
+    
+    for (i = 0; i < 3; i++) {
+        close(stdio_fds[i]);
+        if (result < 0) {
+            close(parent_fds[i]);
+        }
+    }
+    
+    /* The child has exec'd or failed by now, it no longer needs them */
+    if (envp != spawn_envp) {
+        free(envp);
+    }
+    
+    errno = saved_errno;
+    return result;
+}
+
+/*****************************************************************************/
+static const char *search_path(char *const env[])
+{
+    int i;
+    
+    for (i = 0; env && env[i]; i++) {
+        if (strncmp(env[i], "PATH=", 5) == 0) {
+            return env[i] + 5;
+        }
+    }
+    
+    return env_path + 5;
+}
+
+/*****************************************************************************/
+int pty_spawn_find_program(const char *name, char *const env[], char *path,
+                           size_t size)
+{
+    const char *directory;
+    size_t length;
+    int saw_denied = 0;
+    
+    /* A name with a slash is used as given, like execvp() does */
+    if (strchr(name, '/')) {
+        if (strlen(name) >= size) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(path, name);
+        return 0;
+    }
+    
+    /* Searched once here instead of one execve() per directory */
+    for (directory = search_path(env); *directory; directory += length) {
+        length = strcspn(directory, ":");
+        
+        if (length > 0 &&
+            snprintf(path, size, "%.*s/%s", (int)length, directory, 
+                     name) < (int)size) {
+            if (access(path, X_OK) == 0) {
+                return 0;
+            }
+            if (errno == EACCES) {
+                saw_denied = 1;
+            }
+        }
+        
+        if (directory[length] == ':') {
+            length++;
+        }
+    }
+    
+    errno = saw_denied ? EACCES : ENOENT;
+    return -1;
+}
@@ -0,0 +1,36 @@
+/*****************************************************************************/
+/*    vsock-shell - PTY process spawning interface                          */
+/*****************************************************************************/
+#ifndef VSOCK_SHELL_PTY_SPAWN_H
+#define VSOCK_SHELL_PTY_SPAWN_H
+
+#include <sys/types.h>
+
+/* Descriptor under which the child receives extra_fd */
+#define PTY_SPAWN_EXTRA_FD 3
+
+/* Prepares the environment handed to every spawned shell */
+void pty_spawn_init(void);
+
+/* Starts argv on a new PTY through vfork(), returning once it has been
+ * exec'd and logging how long that took. The child leads a new session
+ * with the PTY slave as controlling terminal and stdio; extra_fd, unless
+ * -1, becomes PTY_SPAWN_EXTRA_FD and no other server descriptor is
+ * inherited. Failures in the child are reported here, not by the child. */
+int pty_spawn(char *const argv[], int extra_fd, pid_t *pid, int *master_fd);
+
+/* Same without a terminal, running program with argv: the child gets
+ * pipes as stdin, stdout and stderr, parent_fds receives the server ends
+ * in that order. env, unless
+ * NULL, lists NAME=VALUE entries added to or replacing the default
+ * environment, and cwd, unless NULL, is where the child starts. Sets
+ * errno on failure, to what the child ran into if it got that far. */
+int pipe_spawn(const char *program, char *const argv[], char *const env[], 
+               const char *cwd, pid_t *pid, int parent_fds[3]);
+
+/* Finds the program execve() is to run for name along the PATH of env,
+ * or the default one. Returns -1 with errno ENOENT or EACCES if none. */
+int pty_spawn_find_program(const char *name, char *const env[], char *path,
+                           size_t size);
+
+#endif /* VSOCK_SHELL_PTY_SPAWN_H */
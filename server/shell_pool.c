@@ -0,0 +1,190 @@
+/*****************************************************************************/
+/*    vsock-shell - Warm shell pool implementation                          */
+/*****************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "shell_pool.h"
+#include "pty_spawn.h"
+#include "../include/common.h"
+
+#define MAX_SHELL_POOL_SIZE 64
+#define SHELL_POOL_REFILL_DELAY_MS 10
+
+/* Parked shell: bash started on its PTY, waiting on its control pipe */
+typedef struct {
+    pid_t pid;
+    int pty_master_fd;
+    int control_fd;                    /* Write end, takes the command */
+} PooledShell;
+
+/* Reads the command up to EOF with builtins only, then runs it the way
+ * bash -c would, or becomes an interactive shell if none was sent */
+static char launcher_script[] =
+    "IFS= read -r -d '' vsock_command <&3; exec 3<&-; "
+    "[ -z \"$vsock_command\" ] && exec /bin/bash; "
+    "eval \"$vsock_command\"";
+
+/* Each worker keeps its own pool */
+static __thread PooledShell *parked_shells = NULL;
+static __thread int parked_count = 0;
+static __thread int pool_size = 0;
+
+/*****************************************************************************/
+static void discard_shell(PooledShell *shell)
+{
+    close(shell->control_fd);
+    close(shell->pty_master_fd);
+    kill(shell->pid, SIGKILL);
+    waitpid(shell->pid, NULL, 0);
+}
+
+/*****************************************************************************/
+static int spawn_parked_shell(void)
+{
+    char *argv[] = {"/bin/bash", "-c", launcher_script, NULL};
+    PooledShell *shell = &parked_shells[parked_count];
+    int pipe_fds[2];
+    
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        VSOCK_LOG_ERROR("Failed to create control pipe: %s", strerror(errno));
+        return -1;
+    }
+    
+    if (pty_spawn(argv, pipe_fds[0], &shell->pid, &shell->pty_master_fd) < 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    
+    close(pipe_fds[0]);
+    shell->control_fd = pipe_fds[1];
+    parked_count++;
+    
+    return 0;
+}
+
+/*****************************************************************************/
+int shell_pool_init(int size)
+{
+    if (size <= 0) {
+        return 0;
+    }
+    
+    if (size > MAX_SHELL_POOL_SIZE) {
+        size = MAX_SHELL_POOL_SIZE;
+    }
+    
+    parked_shells = (PooledShell *)calloc(size, sizeof(PooledShell));
+    if (!parked_shells) {
+        VSOCK_LOG_ERROR("Failed to allocate shell pool");
+        return -1;
+    }
+    
+    pool_size = size;
+    while (parked_count < pool_size) {
+        shell_pool_refill();
+    }
+    
+    VSOCK_LOG_INFO("Shell pool ready: %d shells", parked_count);
+    return 0;
+}
+
+/*****************************************************************************/
+void shell_pool_cleanup(void)
+{
+    while (parked_count > 0) {
+        discard_shell(&parked_shells[--parked_count]);
+    }
+    
+    free(parked_shells);
+    parked_shells = NULL;
+    pool_size = 0;
+}
+
+/*****************************************************************************/
+int shell_pool_take(const char *command, const struct winsize *window_size,
+                    pid_t *pid, int *master_fd)
+{
+    PooledShell shell;
+    size_t length;
+    size_t offset = 0;
+    ssize_t bytes_written;
+    
+    if (parked_count == 0) {
+        return -1;
+    }
+    
+    shell = parked_shells[--parked_count];
+    
+    /* The size must be in place before the command looks at it */
+    if (window_size && 
+        ioctl(shell.pty_master_fd, TIOCSWINSZ, window_size) < 0) {
+        VSOCK_LOG_ERROR("Failed to set window size: %s", strerror(errno));
+    }
+    
+    /* Commands are bounded by one message, the pipe buffer holds them */
+    length = command ? strlen(command) : 0;
+    while (offset < length) {
+        bytes_written = write(shell.control_fd, &command[offset], 
+                              length - offset);
+        if (bytes_written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_written <= 0) {
+            VSOCK_LOG_ERROR("Parked shell %d is gone: %s", 
+                     shell.pid, strerror(errno));
+            discard_shell(&shell);
+            return -1;
+        }
+        offset += bytes_written;
+    }
+    
+    /* EOF starts the command */
+    close(shell.control_fd);
+    
+    *pid = shell.pid;
+    *master_fd = shell.pty_master_fd;
+    return 0;
+}
+
+/*****************************************************************************/
+int shell_pool_refill_timeout(void)
+{
+    return parked_count < pool_size ? SHELL_POOL_REFILL_DELAY_MS : -1;
+}
+
+/*****************************************************************************/
+void shell_pool_refill(void)
+{
+    if (parked_count >= pool_size) {
+        return;
+    }
+    
+    /* Shrink rather than retry a failing spawn on every pass */
+    if (spawn_parked_shell() < 0) {
+        pool_size = parked_count;
+        VSOCK_LOG_ERROR("Shell pool shrunk to %d shells", pool_size);
+    }
+}
+
+/*****************************************************************************/
+void shell_pool_reap(void)
+{
+    int i = 0;
+    
+    while (i < parked_count) {
+        if (waitpid(parked_shells[i].pid, NULL, WNOHANG) > 0) {
+            VSOCK_LOG_INFO("Parked shell %d exited", parked_shells[i].pid);
+            close(parked_shells[i].control_fd);
+            close(parked_shells[i].pty_master_fd);
+            parked_shells[i] = parked_shells[--parked_count];
+        } else {
+            i++;
+        }
+    }
+}
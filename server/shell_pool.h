@@ -0,0 +1,30 @@
+/*****************************************************************************/
+/*    vsock-shell - Warm shell pool interface                               */
+/*****************************************************************************/
+#ifndef VSOCK_SHELL_SHELL_POOL_H
+#define VSOCK_SHELL_SHELL_POOL_H
+
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+/* Parked shells are started bash processes attached to their own PTY,
+ * blocked reading the command to run from a control pipe. The pool
+ * belongs to the calling thread, each worker runs its own. */
+int shell_pool_init(int size);
+void shell_pool_cleanup(void);
+
+/* Adopts a parked shell, applies window_size if given and starts command
+ * in it, or an interactive bash if command is NULL. Returns -1 when no
+ * parked shell is available. */
+int shell_pool_take(const char *command, const struct winsize *window_size,
+                    pid_t *pid, int *master_fd);
+
+/* Refilling happens one shell at a time once the event loop has been idle
+ * for the returned timeout (-1 while the pool is full) */
+int shell_pool_refill_timeout(void);
+void shell_pool_refill(void);
+
+/* Replaces parked shells that exited, called on SIGCHLD */
+void shell_pool_reap(void);
+
+#endif /* VSOCK_SHELL_SHELL_POOL_H */
@@ -3,58 +3,68 @@
 /*****************************************************************************/
 #include <errno.h>
 #include <fcntl.h>
-#include <pty.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include "terminal_server.h"
 #include "file_transfer_server.h"
+#include "pty_spawn.h"
+#include "shell_pool.h"
+#include "../lib/chunk_pool.h"
 #include "../lib/message_queue.h"
 #include "../include/message.h"
 #include "../include/common.h"
 
-static ClientSession *session_list_head = NULL;
-static int session_count = 0;
+#define MIN_SESSION_TABLE_SIZE 128
+
+/* Edge-triggered, so each ready fd is drained to EAGAIN; EPOLLOUT is
+ * added only while there is something waiting to be written */
+#define SOCKET_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLET)
+#define PTY_EVENTS    (EPOLLIN | EPOLLET)
+#define PIPE_EVENTS   (EPOLLIN | EPOLLET)
+#define STDIN_EVENTS  EPOLLET
+
+/* File bytes a transfer earns per scheduler round */
+#define BULK_QUANTUM (256 * 1024)
+
+/* Commands of an MSG_TYPE_OPEN_BATCH, run by channel 0 */
+typedef struct BatchRun {
+    char *commands;                    /* NUL-separated, in order */
+    char *next_command;
+    uint32_t count;
+    uint32_t started;                  /* Commands given a channel so far */
+    uint32_t running;                  /* Of those, channels still open */
+    uint32_t parallelism;
+} BatchRun;
+
 static int signal_pipe_write_fd = -1;
 
-/* Environment variables */
-static char env_home[MAX_PATH_LENGTH];
-static char env_path[MAX_PATH_LENGTH];
-static char env_term[MAX_PATH_LENGTH];
-static char env_shell[MAX_PATH_LENGTH];
+/* Per worker: the sessions it owns and the epoll instance it runs */
+static __thread ClientSession *session_list_head = NULL;
+static __thread int session_count = 0;
+static __thread int epoll_fd = -1;
 
-/*****************************************************************************/
-static void initialize_environment(void)
-{
-    char *home = getenv("HOME");
-    
-    memset(env_home, 0, sizeof(env_home));
-    memset(env_path, 0, sizeof(env_path));
-    memset(env_term, 0, sizeof(env_term));
-    memset(env_shell, 0, sizeof(env_shell));
-    
-    if (home) {
-        snprintf(env_home, sizeof(env_home) - 1, "HOME=%s", home);
-    } else {
-        snprintf(env_home, sizeof(env_home) - 1, "HOME=/root");
-    }
-    
-    snprintf(env_path, sizeof(env_path) - 1, 
-             "PATH=/usr/sbin:/usr/bin:/sbin:/bin");
-    snprintf(env_term, sizeof(env_term) - 1, "TERM=xterm");
-    snprintf(env_shell, sizeof(env_shell) - 1, "SHELL=/bin/bash");
-}
+/* Sessions indexed by socket and PTY descriptor, grown on demand */
+static __thread ClientSession **session_table = NULL;
+static __thread int session_table_size = 0;
+
+/* File transfers waiting for their turn, in round-robin order */
+static __thread ClientSession *run_queue_head = NULL;
+static __thread ClientSession *run_queue_tail = NULL;
+static __thread int run_queue_length = 0;
 
 /*****************************************************************************/
 static void signal_handler(int signum)
 {
-    char notification = 'S';
+    /* SIGTERM and SIGINT ask the main loop to shut down */
+    char notification = (signum == SIGCHLD) ? 'S' : 'T';
     if (signal_pipe_write_fd >= 0) {
         if (write(signal_pipe_write_fd, &notification, 1) < 0) {
             VSOCK_LOG_ERROR("Failed to write signal notification");
@@ -110,439 +120,1768 @@ static void remove_session_from_list(ClientSession *session)
 }
 
 /*****************************************************************************/
-ClientSession *terminal_server_find_session_by_socket(int socket_fd)
+static uint64_t monotonic_us(void)
 {
-    ClientSession *session = session_list_head;
-    
-    while (session) {
-        if (session->socket_fd == socket_fd) {
-            return session;
-        }
-        session = session->next;
-    }
+    struct timespec now;
     
-    return NULL;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
 
 /*****************************************************************************/
-ClientSession *terminal_server_find_session_by_pty(int pty_fd)
+static void schedule_session(ClientSession *session)
 {
-    ClientSession *session = session_list_head;
-    
-    while (session) {
-        if (session->pty_master_fd == pty_fd) {
-            return session;
-        }
-        session = session->next;
+    if (session->scheduled) {
+        return;
     }
     
-    return NULL;
+    session->scheduled = 1;
+    session->wait_start_us = monotonic_us();
+    session->run_next = NULL;
+    
+    if (run_queue_tail) {
+        run_queue_tail->run_next = session;
+    } else {
+        run_queue_head = session;
+    }
+    run_queue_tail = session;
+    run_queue_length++;
 }
 
 /*****************************************************************************/
-static int spawn_shell_process(int pty_slave_fd, const char *command)
+static ClientSession *next_scheduled_session(void)
 {
-    char *argv[4];
-    char *envp[5];
+    ClientSession *session = run_queue_head;
     
-    /* Redirect stdio to PTY slave */
-    if (dup2(pty_slave_fd, STDIN_FILENO) < 0 ||
-        dup2(pty_slave_fd, STDOUT_FILENO) < 0 ||
-        dup2(pty_slave_fd, STDERR_FILENO) < 0) {
-        VSOCK_LOG_FATAL("Failed to redirect stdio: %s", strerror(errno));
+    if (!session) {
+        return NULL;
     }
     
-    close(pty_slave_fd);
-    
-    /* Setup environment */
-    envp[0] = env_home;
-    envp[1] = env_path;
-    envp[2] = env_term;
-    envp[3] = env_shell;
-    envp[4] = NULL;
-    
-    /* Execute command or shell */
-    if (command) {
-        argv[0] = "/bin/bash";
-        argv[1] = "-c";
-        argv[2] = (char *)command;
-        argv[3] = NULL;
-    } else {
-        argv[0] = "/bin/bash";
-        argv[1] = NULL;
+    run_queue_head = session->run_next;
+    if (!run_queue_head) {
+        run_queue_tail = NULL;
     }
+    run_queue_length--;
     
-    execve("/bin/bash", argv, envp);
-    VSOCK_LOG_FATAL("Failed to execute bash: %s", strerror(errno));
-    
-    return -1; /* Never reached */
+    session->scheduled = 0;
+    session->wait_time_us += monotonic_us() - session->wait_start_us;
+    return session;
 }
 
 /*****************************************************************************/
-static int create_pty_session(ClientSession *session, const char *command)
+static void unschedule_session(ClientSession *session)
 {
-    int pty_master_fd, pty_slave_fd;
-    pid_t pid;
+    ClientSession **link = &run_queue_head;
+    ClientSession *previous = NULL;
     
-    /* Create PTY pair */
-    if (openpty(&pty_master_fd, &pty_slave_fd, NULL, NULL, NULL) < 0) {
-        VSOCK_LOG_ERROR("Failed to create PTY: %s", strerror(errno));
-        return -1;
+    if (!session->scheduled) {
+        return;
     }
     
-    /* Fork child process */
-    pid = fork();
-    
-    if (pid < 0) {
-        VSOCK_LOG_ERROR("Failed to fork: %s", strerror(errno));
-        close(pty_master_fd);
-        close(pty_slave_fd);
-        return -1;
+    while (*link != session) {
+        previous = *link;
+        link = &previous->run_next;
     }
     
-    if (pid == 0) {
-        /* Child process */
-        close(pty_master_fd);
-        setsid();
-        
-        if (ioctl(pty_slave_fd, TIOCSCTTY, 0) < 0) {
-            VSOCK_LOG_ERROR("Failed to set controlling terminal: %s", strerror(errno));
-        }
-        
-        spawn_shell_process(pty_slave_fd, command);
-        exit(EXIT_FAILURE); /* Never reached */
+    *link = session->run_next;
+    if (run_queue_tail == session) {
+        run_queue_tail = previous;
     }
-    
-    /* Parent process */
-    close(pty_slave_fd);
-    
-    session->pid = pid;
-    session->pty_master_fd = pty_master_fd;
-    
-    VSOCK_LOG_INFO("Created PTY session: pid=%d, pty=%d", pid, pty_master_fd);
-    return 0;
+    run_queue_length--;
+    session->scheduled = 0;
 }
 
 /*****************************************************************************/
-ClientSession *terminal_server_create_session(int socket_fd)
+static ClientSession *lookup_session(int fd)
 {
-    ClientSession *session;
-    
-    session = (ClientSession *)calloc(1, sizeof(ClientSession));
-    if (!session) {
-        VSOCK_LOG_ERROR("Failed to allocate session");
-        return NULL;
-    }
-    
-    session->socket_fd = socket_fd;
-    session->pty_master_fd = -1;
-    session->file_fd = -1;
-    session->pid = -1;
-    session->connection_type = CONNECTION_TYPE_BASH;
-    
-    if (message_queue_init(socket_fd) < 0) {
-        VSOCK_LOG_ERROR("Failed to initialize message queue");
-        free(session);
+    if (fd < 0 || fd >= session_table_size) {
         return NULL;
     }
     
-    add_session_to_list(session);
-    VSOCK_LOG_INFO("Created new session: socket=%d", socket_fd);
-    
-    return session;
+    return session_table[fd];
 }
 
 /*****************************************************************************/
-void terminal_server_destroy_session(ClientSession *session)
+static int grow_session_table(int fd)
 {
-    Message msg;
-    
-    if (!session) {
-        return;
-    }
-    
-    VSOCK_LOG_INFO("Destroying session: socket=%d, pid=%d", 
-             session->socket_fd, session->pid);
-    
-    /* Send end message to client */
-    msg.type = MSG_TYPE_CLIENT_END;
-    msg.length = 0;
-    message_queue_write(session->socket_fd, &msg);
-    message_queue_flush_writes(session->socket_fd);
+    ClientSession **new_table;
+    int new_size;
     
-    /* Close PTY */
-    if (session->pty_master_fd >= 0) {
-        close(session->pty_master_fd);
+    new_size = session_table_size ? session_table_size : MIN_SESSION_TABLE_SIZE;
+    while (new_size <= fd && new_size <= INT_MAX / 2) {
+        new_size *= 2;
     }
     
-    /* Close file descriptor */
-    if (session->file_fd >= 0) {
-        close(session->file_fd);
+    if (new_size <= fd) {
+        new_size = fd + 1;
     }
     
-    /* Kill child process */
-    if (session->pid > 0) {
-        kill(session->pid, SIGTERM);
-        waitpid(session->pid, NULL, WNOHANG);
+    new_table = (ClientSession **)realloc(session_table, 
+                                          new_size * sizeof(ClientSession *));
+    if (!new_table) {
+        return -1;
     }
     
-    /* Cleanup message queue */
-    message_queue_destroy(session->socket_fd);
-    
-    /* Close socket */
-    close(session->socket_fd);
+    memset(&new_table[session_table_size], 0,
+           (new_size - session_table_size) * sizeof(ClientSession *));
     
-    /* Remove from list */
-    remove_session_from_list(session);
-    
-    free(session);
-}
-
-/*****************************************************************************/
-static int handle_open_bash_message(ClientSession *session)
-{
-    session->connection_type = CONNECTION_TYPE_BASH;
-    return create_pty_session(session, NULL);
+    session_table = new_table;
+    session_table_size = new_size;
+    return 0;
 }
 
 /*****************************************************************************/
-static int handle_open_cmd_message(ClientSession *session, Message *msg)
+static int set_nonblocking(int fd)
 {
-    char command[MAX_MESSAGE_DATA + 1];
+    int flags;
     
-    memcpy(command, msg->data, msg->length);
-    command[msg->length] = '\0';
+    flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        VSOCK_LOG_ERROR("Failed to set O_NONBLOCK on fd %d: %s", 
+                 fd, strerror(errno));
+        return -1;
+    }
     
-    session->connection_type = CONNECTION_TYPE_CMD;
-    return create_pty_session(session, command);
+    return 0;
 }
 
 /*****************************************************************************/
-static int handle_window_size_message(ClientSession *session, Message *msg)
+static int watch_session_fd(ClientSession *session, int fd, uint32_t events)
 {
-    struct winsize ws;
+    struct epoll_event event;
     
-    if (session->pty_master_fd < 0) {
-        VSOCK_LOG_ERROR("PTY not initialized");
+    if (fd >= session_table_size && grow_session_table(fd) < 0) {
+        VSOCK_LOG_ERROR("Failed to grow session table for fd %d", fd);
         return -1;
     }
     
-    if (msg->length != sizeof(struct winsize)) {
-        VSOCK_LOG_ERROR("Invalid window size message length: %u", msg->length);
+    if (set_nonblocking(fd) < 0) {
         return -1;
     }
     
-    memcpy(&ws, msg->data, sizeof(struct winsize));
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = fd;
     
-    if (ioctl(session->pty_master_fd, TIOCSWINSZ, &ws) < 0) {
-        VSOCK_LOG_ERROR("Failed to set window size: %s", strerror(errno));
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        VSOCK_LOG_ERROR("Failed to watch fd %d: %s", fd, strerror(errno));
         return -1;
     }
     
+    session_table[fd] = session;
     return 0;
 }
 
 /*****************************************************************************/
-static int handle_client_data_message(ClientSession *session, Message *msg)
+static int set_write_interest(int fd, uint32_t events, int *armed, int wanted)
 {
-    ssize_t bytes_written;
+    struct epoll_event event;
     
-    if (session->pty_master_fd < 0) {
-        VSOCK_LOG_ERROR("PTY not initialized");
-        return -1;
+    if (*armed == wanted) {
+        return 0;
     }
     
-    bytes_written = write(session->pty_master_fd, msg->data, msg->length);
+    /* Re-arming also reports a descriptor that is writable already */
+    memset(&event, 0, sizeof(event));
+    event.events = wanted ? (events | EPOLLOUT) : events;
+    event.data.fd = fd;
     
-    if (bytes_written < 0) {
-        VSOCK_LOG_ERROR("Failed to write to PTY: %s", strerror(errno));
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+        VSOCK_LOG_ERROR("Failed to update events for fd %d: %s", 
+                 fd, strerror(errno));
         return -1;
     }
     
-    if (bytes_written != msg->length) {
-        VSOCK_LOG_ERROR("Partial write to PTY: %zd/%u", bytes_written, msg->length);
-    }
-    
+    *armed = wanted;
     return 0;
 }
 
 /*****************************************************************************/
-int terminal_server_handle_message(ClientSession *session, Message *msg)
+static void unwatch_session_fd(int fd)
 {
-    int result = 0;
-    
-    switch (msg->type) {
-        case MSG_TYPE_OPEN_BASH:
-            result = handle_open_bash_message(session);
-            break;
-            
-        case MSG_TYPE_OPEN_CMD:
-            result = handle_open_cmd_message(session, msg);
-            break;
-            
-        case MSG_TYPE_WINDOW_SIZE:
-            result = handle_window_size_message(session, msg);
-            break;
-            
-        case MSG_TYPE_CLIENT_DATA:
-            result = handle_client_data_message(session, msg);
-            break;
-            
-        case MSG_TYPE_FILE_UPLOAD_START:
-            result = file_transfer_handle_upload_start(session, msg);
-            break;
-            
-        case MSG_TYPE_FILE_DOWNLOAD_START:
-            result = file_transfer_handle_download_start(session, msg);
-            break;
-            
-        case MSG_TYPE_FILE_DATA:
-            result = file_transfer_handle_data(session, msg);
-            break;
-            
-        case MSG_TYPE_FILE_DATA_END:
-            result = file_transfer_handle_data_end(session);
-            break;
-            
-        default:
-            VSOCK_LOG_ERROR("Unknown message type: 0x%02X", msg->type);
-            result = -1;
-            break;
+    if (lookup_session(fd) == NULL) {
+        return;
     }
     
-    return result;
+    /* Forked shells may share the descriptor, so close() alone is not
+     * guaranteed to drop the registration */
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    session_table[fd] = NULL;
 }
 
 /*****************************************************************************/
-static void handle_pty_data(ClientSession *session)
+int terminal_server_watch_fd(ClientSession *session, int fd)
 {
-    Message msg;
-    ssize_t bytes_read;
-    
-    bytes_read = read(session->pty_master_fd, msg.data, MAX_MESSAGE_DATA);
-    
-    if (bytes_read > 0) {
-        msg.type = MSG_TYPE_PTY_DATA;
-        msg.length = bytes_read;
-        
-        if (message_queue_write(session->socket_fd, &msg) < 0) {
-            VSOCK_LOG_ERROR("Failed to queue PTY data");
-        }
-    } else if (bytes_read == 0) {
-        /* PTY closed (child process exited) */
-        VSOCK_LOG_INFO("PTY closed for session: socket=%d", session->socket_fd);
-        terminal_server_destroy_session(session);
-    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
-        VSOCK_LOG_ERROR("PTY read error: %s", strerror(errno));
-        terminal_server_destroy_session(session);
-    }
+    return watch_session_fd(session, fd, EPOLLIN | EPOLLET);
 }
 
 /*****************************************************************************/
-static int handle_session_message(void *context, int fd, Message *msg)
+void terminal_server_unwatch_fd(int fd)
 {
-    ClientSession *session = (ClientSession *)context;
-    
-    if (terminal_server_handle_message(session, msg) < 0) {
-        VSOCK_LOG_ERROR("Message handling failed");
-        return -1;
-    }
-    
-    return 0;
+    unwatch_session_fd(fd);
 }
 
 /*****************************************************************************/
-static void handle_session_error(void *context, const char *error)
+ClientSession *terminal_server_find_session_by_socket(int socket_fd)
 {
-    ClientSession *session = (ClientSession *)context;
-    VSOCK_LOG_ERROR("Session error (socket=%d): %s", session->socket_fd, error);
-    terminal_server_destroy_session(session);
+    ClientSession *session = lookup_session(socket_fd);
+    
+    if (session && session->socket_fd == socket_fd) {
+        return session;
+    }
+    
+    return NULL;
 }
 
 /*****************************************************************************/
-void terminal_server_setup_select(fd_set *read_fds, int *max_fd)
+ClientSession *terminal_server_find_session_by_pty(int pty_fd)
 {
-    ClientSession *session = session_list_head;
+    ClientSession *session = lookup_session(pty_fd);
     
-    while (session) {
-        FD_SET(session->socket_fd, read_fds);
-        if (session->socket_fd > *max_fd) {
-            *max_fd = session->socket_fd;
-        }
-        
-        if (session->pty_master_fd >= 0) {
-            FD_SET(session->pty_master_fd, read_fds);
-            if (session->pty_master_fd > *max_fd) {
-                *max_fd = session->pty_master_fd;
-            }
-        }
-        
-        session = session->next;
+    if (session && session->pty_master_fd == pty_fd) {
+        return session;
     }
+    
+    return NULL;
 }
 
 /*****************************************************************************/
-void terminal_server_handle_io(fd_set *read_fds)
+static int create_pty_session(ClientSession *session, const char *command)
 {
-    ClientSession *session = session_list_head;
-    ClientSession *next_session;
+    char *argv[4];
+    int pty_master_fd;
+    pid_t pid;
     
-    while (session) {
-        next_session = session->next;
-        
-        /* Handle socket data */
-        if (FD_ISSET(session->socket_fd, read_fds)) {
-            message_queue_read(session, session->socket_fd,
-                             handle_session_message, handle_session_error);
-        }
+    /* Adopt a warm shell if one is parked, otherwise start bash now */
+    if (shell_pool_take(command, session->window_size_pending ? 
+                        &session->window_size : NULL, 
+                        &pid, &pty_master_fd) < 0) {
+        argv[0] = "/bin/bash";
+        argv[1] = command ? "-c" : NULL;
+        argv[2] = (char *)command;
+        argv[3] = NULL;
         
-        /* Handle PTY data */
-        if (session->pty_master_fd >= 0 && 
-            FD_ISSET(session->pty_master_fd, read_fds)) {
-            handle_pty_data(session);
+        if (pty_spawn(argv, -1, &pid, &pty_master_fd) < 0) {
+            return -1;
         }
         
-        /* Handle file transfer */
-        if (session->file_fd >= 0 && !message_queue_is_saturated(session->socket_fd)) {
-            file_transfer_send_data(session);
+        if (session->window_size_pending &&
+            ioctl(pty_master_fd, TIOCSWINSZ, &session->window_size) < 0) {
+            VSOCK_LOG_ERROR("Failed to set window size: %s", strerror(errno));
         }
-        
-        /* Flush pending writes */
-        message_queue_flush_writes(session->socket_fd);
-        
-        session = next_session;
     }
+    
+    session->pid = pid;
+    session->pty_master_fd = pty_master_fd;
+    
+    /* On failure the caller tears the session down, child included */
+    if (watch_session_fd(session, pty_master_fd, PTY_EVENTS) < 0) {
+        return -1;
+    }
+    
+    VSOCK_LOG_INFO("Created PTY session: pid=%d, pty=%d", pid, pty_master_fd);
+    return 0;
 }
 
 /*****************************************************************************/
-void terminal_server_cleanup_dead_sessions(void)
+static int refuse_exec(ClientSession *session, const char *name, int error)
 {
-    ClientSession *session = session_list_head;
-    ClientSession *next_session;
-    int status;
-    pid_t result;
+    Message msg;
+    int length;
     
-    while (session) {
-        next_session = session->next;
-        
-        if (session->pid > 0) {
-            result = waitpid(session->pid, &status, WNOHANG);
-            
-            if (result > 0) {
-                VSOCK_LOG_INFO("Child process %d exited with status %d", 
-                        session->pid, WEXITSTATUS(status));
-                terminal_server_destroy_session(session);
-            }
-        }
-        
-        session = next_session;
+    /* Reported the way a shell would, the session then ends normally */
+    length = snprintf((char *)msg.data, MAX_MESSAGE_DATA, 
+                      "vsock-shell-server: %s: %s\n", name, strerror(error));
+    if (length >= MAX_MESSAGE_DATA) {
+        length = MAX_MESSAGE_DATA - 1;
     }
+    
+    msg.type = MSG_TYPE_STDERR_DATA;
+    msg.length = length;
+    
+    session->exit_status = error == ENOENT ? 127 : 126;
+    session->closing = 1;
+    return terminal_server_write(session, &msg);
 }
 
 /*****************************************************************************/
-void terminal_server_init(int signal_pipe_fd)
+static int create_exec_session(ClientSession *session, const char *program,
+                               char *const argv[], char *const env[], 
+                               const char *cwd)
 {
-    initialize_environment();
-    setup_signal_handlers(signal_pipe_fd);
-    VSOCK_LOG_INFO("Terminal server initialized");
+    int fds[3];
+    pid_t pid;
+    
+    if (pipe_spawn(program, argv, env, cwd, &pid, fds) < 0) {
+        return refuse_exec(session, argv[0], errno);
+    }
+    
+    session->pid = pid;
+    session->stdin_fd = fds[0];
+    session->stdout_fd = fds[1];
+    session->stderr_fd = fds[2];
+    
+    /* On failure the caller tears the session down, child included */
+    if (watch_session_fd(session, session->stdin_fd, STDIN_EVENTS) < 0 ||
+        watch_session_fd(session, session->stdout_fd, PIPE_EVENTS) < 0 ||
+        watch_session_fd(session, session->stderr_fd, PIPE_EVENTS) < 0) {
+        return -1;
+    }
+    
+    VSOCK_LOG_INFO("Created exec session: pid=%d", pid);
+    return 0;
+}
+
+/*****************************************************************************/
+static void close_session_fd(int *fd)
+{
+    if (*fd >= 0) {
+        unwatch_session_fd(*fd);
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+/*****************************************************************************/
+static int session_input_fd(ClientSession *session)
+{
+    return session->pty_master_fd >= 0 ? session->pty_master_fd : 
+                                         session->stdin_fd;
+}
+
+/*****************************************************************************/
+static ClientSession *new_session(int socket_fd)
+{
+    ClientSession *session;
+    
+    session = (ClientSession *)calloc(1, sizeof(ClientSession));
+    if (!session) {
+        VSOCK_LOG_ERROR("Failed to allocate session");
+        return NULL;
+    }
+    
+    session->socket_fd = socket_fd;
+    session->pty_master_fd = -1;
+    session->stdin_fd = -1;
+    session->stdout_fd = -1;
+    session->stderr_fd = -1;
+    session->file_fd = -1;
+    session->pid = -1;
+    session->connection_type = CONNECTION_TYPE_BASH;
+    session->max_frame_data = MAX_MESSAGE_DATA;
+    session->connection = session;
+    return session;
+}
+
+/*****************************************************************************/
+ClientSession *terminal_server_create_session(int socket_fd)
+{
+    ClientSession *session;
+    
+    session = new_session(socket_fd);
+    if (!session) {
+        return NULL;
+    }
+    
+    if (message_queue_init(socket_fd) < 0) {
+        VSOCK_LOG_ERROR("Failed to initialize message queue");
+        free(session);
+        return NULL;
+    }
+    
+    if (watch_session_fd(session, socket_fd, SOCKET_EVENTS) < 0) {
+        message_queue_destroy(socket_fd);
+        free(session);
+        return NULL;
+    }
+    
+    add_session_to_list(session);
+    VSOCK_LOG_INFO("Created new session: socket=%d", socket_fd);
+    
+    return session;
+}
+
+/*****************************************************************************/
+static ClientSession *find_channel(ClientSession *connection, uint16_t channel)
+{
+    ClientSession *session;
+    
+    if (channel == 0) {
+        return connection;
+    }
+    
+    for (session = connection->channels; session; 
+         session = session->channel_next) {
+        if (session->channel == channel) {
+            return session;
+        }
+    }
+    
+    return NULL;
+}
+
+/*****************************************************************************/
+static void attach_channel(ClientSession *connection, ClientSession *session,
+                           uint16_t channel)
+{
+    session->channel = channel;
+    session->connection = connection;
+    session->max_frame_data = connection->max_frame_data;
+    session->channel_next = connection->channels;
+    connection->channels = session;
+    
+    add_session_to_list(session);
+    VSOCK_LOG_INFO("Opened channel %u on socket %d", channel, 
+                   connection->socket_fd);
+}
+
+/*****************************************************************************/
+static int open_channel(ClientSession *connection, uint16_t channel)
+{
+    ClientSession *session;
+    ClientSession *other;
+    Message msg;
+    int count = 0;
+    
+    for (other = connection->channels; other; other = other->channel_next) {
+        count++;
+    }
+    
+    /* A batch numbers the channels of its connection itself */
+    session = NULL;
+    if (count >= MAX_CONNECTION_CHANNELS) {
+        VSOCK_LOG_ERROR("Too many channels on socket %d", connection->socket_fd);
+    } else if (connection->batch) {
+        VSOCK_LOG_ERROR("Channel %u opened during a batch", channel);
+    } else {
+        session = new_session(connection->socket_fd);
+    }
+    
+    /* Refused, the client sees the channel close right away */
+    if (!session) {
+        msg.type = MSG_TYPE_CHANNEL_CLOSE;
+        msg.length = 0;
+        return message_queue_write_channel(connection->socket_fd, channel, 
+                                           &msg);
+    }
+    
+    attach_channel(connection, session, channel);
+    return 0;
+}
+
+/*****************************************************************************/
+static void unlink_channel(ClientSession *session)
+{
+    ClientSession **link = &session->connection->channels;
+    
+    while (*link != session) {
+        link = &(*link)->channel_next;
+    }
+    
+    *link = session->channel_next;
+}
+
+/*****************************************************************************/
+Message *terminal_server_reserve(ClientSession *session, uint32_t type,
+                                 uint32_t max_length)
+{
+    Message *msg = message_queue_reserve(session->socket_fd, type, max_length);
+    
+    if (msg) {
+        msg->channel = session->channel;
+    }
+    
+    return msg;
+}
+
+/*****************************************************************************/
+int terminal_server_write(ClientSession *session, Message *msg)
+{
+    return message_queue_write_channel(session->socket_fd, session->channel, 
+                                       msg);
+}
+
+/*****************************************************************************/
+void terminal_server_destroy_session(ClientSession *session)
+{
+    Message msg;
+    
+    if (!session) {
+        return;
+    }
+    
+    VSOCK_LOG_INFO("Destroying session: socket=%d, channel=%u, pid=%d, "
+             "waited %llu us", session->socket_fd, session->channel, 
+             session->pid, (unsigned long long)session->wait_time_us);
+    
+    unschedule_session(session);
+    
+    if (session->connection != session) {
+        /* Only this channel ends, the connection carries on. The close
+         * queues behind its file frames, even those of a cut transfer. */
+        msg.type = MSG_TYPE_CHANNEL_CLOSE;
+        msg.length = 0;
+        terminal_server_write(session, &msg);
+        unlink_channel(session);
+    
+        /* Makes room for the next command of a batch */
+        if (session->connection->batch) {
+            session->connection->batch->running--;
+        }
+    
+        if (message_queue_flush_writes(session->socket_fd) > 0) {
+            set_write_interest(session->socket_fd, SOCKET_EVENTS,
+                               &session->connection->socket_write_armed, 1);
+        }
+    } else {
+        /* Channels go down with their connection, a batch stops first */
+        if (session->batch) {
+            free(session->batch->commands);
+            free(session->batch);
+            session->batch = NULL;
+        }
+    
+        while (session->channels) {
+            terminal_server_destroy_session(session->channels);
+        }
+    
+        /* Send end message to client */
+        msg.type = MSG_TYPE_CLIENT_END;
+        msg.length = 0;
+        terminal_server_write(session, &msg);
+        message_queue_flush_writes(session->socket_fd);
+    }
+    
+    /* Close PTY or pipes */
+    close_session_fd(&session->pty_master_fd);
+    close_session_fd(&session->stdin_fd);
+    close_session_fd(&session->stdout_fd);
+    close_session_fd(&session->stderr_fd);
+    
+    if (session->pty_input) {
+        chunk_pool_put(session->pty_input);
+    }
+    
+    /* Close file descriptor */
+    file_transfer_close(session);
+    
+    /* Kill child process */
+    if (session->pid > 0) {
+        kill(session->pid, SIGTERM);
+        waitpid(session->pid, NULL, WNOHANG);
+    }
+    
+    if (session->connection == session) {
+        /* Cleanup message queue */
+        message_queue_destroy(session->socket_fd);
+    
+        /* Close socket */
+        unwatch_session_fd(session->socket_fd);
+        close(session->socket_fd);
+    }
+    
+    /* Remove from list */
+    remove_session_from_list(session);
+    
+    free(session);
+}
+
+/*****************************************************************************/
+static int offer_pty_credit(ClientSession *session)
+{
+    Message msg;
+    
+    /* Nothing to offer to a client that granted credit up front, or for
+     * a command that was refused */
+    if (session->pty_credit_enabled || session->closing) {
+        return 0;
+    }
+    
+    /* An empty grant tells the client that its credit is understood,
+     * older clients ignore it and get their output unwindowed */
+    msg.type = MSG_TYPE_PTY_CREDIT;
+    msg.length = 0;
+    return terminal_server_write(session, &msg);
+}
+
+/*****************************************************************************/
+static int handle_open_bash_message(ClientSession *session)
+{
+    session->connection_type = CONNECTION_TYPE_BASH;
+    if (create_pty_session(session, NULL) < 0) {
+        return -1;
+    }
+    
+    return offer_pty_credit(session);
+}
+
+/*****************************************************************************/
+static int handle_open_cmd_message(ClientSession *session, Message *msg)
+{
+    char *command;
+    
+    command = message_payload_string(msg);
+    if (!command) {
+        VSOCK_LOG_ERROR("Invalid command message");
+        return -1;
+    }
+    
+    session->connection_type = CONNECTION_TYPE_CMD;
+    if (create_pty_session(session, command) < 0) {
+        return -1;
+    }
+    
+    return offer_pty_credit(session);
+}
+
+/*****************************************************************************/
+static int create_shell_exec_session(ClientSession *session, char *command)
+{
+    char *argv[4];
+    
+    argv[0] = "/bin/bash";
+    argv[1] = "-c";
+    argv[2] = command;
+    argv[3] = NULL;
+    
+    session->connection_type = CONNECTION_TYPE_EXEC;
+    return create_exec_session(session, argv[0], argv, NULL, NULL);
+}
+
+/*****************************************************************************/
+static int handle_open_exec_message(ClientSession *session, Message *msg)
+{
+    char *command;
+    
+    command = message_payload_string(msg);
+    if (!command) {
+        VSOCK_LOG_ERROR("Invalid exec message");
+        return -1;
+    }
+    
+    if (create_shell_exec_session(session, command) < 0) {
+        return -1;
+    }
+    
+    return offer_pty_credit(session);
+}
+
+/*****************************************************************************/
+static char *next_payload_string(Message *msg, uint32_t *offset)
+{
+    char *string = (char *)&msg->data[*offset];
+    char *end;
+    
+    if (*offset >= msg->length) {
+        return NULL;
+    }
+    
+    end = memchr(string, '\0', msg->length - *offset);
+    if (!end) {
+        return NULL;
+    }
+    
+    *offset += end - string + 1;
+    return string;
+}
+
+/*****************************************************************************/
+static int parse_argv_message(Message *msg, char **argv, char **env,
+                              char **cwd)
+{
+    uint32_t counts[2];
+    uint32_t offset = sizeof(counts);
+    uint32_t i;
+    
+    if (msg->length < sizeof(counts)) {
+        return -1;
+    }
+    
+    memcpy(counts, msg->data, sizeof(counts));
+    if (counts[0] < 1 || counts[0] > MAX_EXEC_ARGS || 
+        counts[1] > MAX_EXEC_ARGS) {
+        return -1;
+    }
+    
+    for (i = 0; i < counts[0]; i++) {
+        argv[i] = next_payload_string(msg, &offset);
+        if (!argv[i]) {
+            return -1;
+        }
+    }
+    argv[counts[0]] = NULL;
+    
+    for (i = 0; i < counts[1]; i++) {
+        env[i] = next_payload_string(msg, &offset);
+        if (!env[i] || env[i][0] == '=' || !strchr(env[i], '=')) {
+            return -1;
+        }
+    }
+    env[counts[1]] = NULL;
+    
+    /* The working directory is optional, empty means the default */
+    *cwd = NULL;
+    if (offset < msg->length) {
+        *cwd = next_payload_string(msg, &offset);
+        if (!*cwd || offset != msg->length) {
+            return -1;
+        }
+        if ((*cwd)[0] == '\0') {
+            *cwd = NULL;
+        }
+    }
+    
+    return argv[0][0] == '\0' ? -1 : 0;
+}
+
+/*****************************************************************************/
+static int handle_open_argv_message(ClientSession *session, Message *msg)
+{
+    char *argv[MAX_EXEC_ARGS + 1];
+    char *env[MAX_EXEC_ARGS + 1];
+    char path[MAX_PATH_LENGTH];
+    char *cwd;
+    
+    if (parse_argv_message(msg, argv, env, &cwd) < 0) {
+        VSOCK_LOG_ERROR("Invalid argv message");
+        return -1;
+    }
+    
+    session->connection_type = CONNECTION_TYPE_EXEC;
+    
+    /* No shell in between, the program is looked up here */
+    if (pty_spawn_find_program(argv[0], env, path, sizeof(path)) < 0) {
+        return refuse_exec(session, argv[0], errno);
+    }
+    
+    /* The child changes there itself, this only names the culprit */
+    if (cwd && access(cwd, X_OK) < 0) {
+        return refuse_exec(session, cwd, errno);
+    }
+    
+    if (create_exec_session(session, path, argv, env, cwd) < 0) {
+        return -1;
+    }
+    
+    return offer_pty_credit(session);
+}
+
+/*****************************************************************************/
+static int handle_open_batch_message(ClientSession *session, Message *msg)
+{
+    uint32_t header[2];
+    uint32_t offset = sizeof(header);
+    BatchRun *batch;
+    uint32_t i;
+    
+    /* Only a connection that runs nothing else yet can take a batch */
+    if (session->connection != session || session->batch || 
+        session->channels || session->pty_master_fd >= 0 ||
+        session->connection_type != CONNECTION_TYPE_BASH) {
+        VSOCK_LOG_ERROR("Batch on a connection already in use");
+        return -1;
+    }
+    
+    if (msg->length < sizeof(header)) {
+        VSOCK_LOG_ERROR("Invalid batch message");
+        return -1;
+    }
+    
+    memcpy(header, msg->data, sizeof(header));
+    if (header[1] < 1 || header[1] > MAX_BATCH_COMMANDS) {
+        VSOCK_LOG_ERROR("Invalid batch of %u commands", header[1]);
+        return -1;
+    }
+    
+    for (i = 0; i < header[1]; i++) {
+        if (!next_payload_string(msg, &offset)) {
+            VSOCK_LOG_ERROR("Invalid batch message");
+            return -1;
+        }
+    }
+    
+    batch = (BatchRun *)calloc(1, sizeof(BatchRun));
+    if (!batch || !(batch->commands = malloc(offset - sizeof(header)))) {
+        VSOCK_LOG_ERROR("Failed to allocate batch");
+        free(batch);
+        return -1;
+    }
+    
+    /* The commands themselves start as the session is serviced */
+    memcpy(batch->commands, &msg->data[sizeof(header)], 
+           offset - sizeof(header));
+    batch->next_command = batch->commands;
+    batch->count = header[1];
+    batch->parallelism = header[0];
+    if (batch->parallelism < 1) {
+        batch->parallelism = 1;
+    }
+    if (batch->parallelism > MAX_CONNECTION_CHANNELS) {
+        batch->parallelism = MAX_CONNECTION_CHANNELS;
+    }
+    
+    session->batch = batch;
+    VSOCK_LOG_INFO("Running batch of %u commands, %u at a time", 
+                   batch->count, batch->parallelism);
+    return 0;
+}
+
+/*****************************************************************************/
+static int start_batch_commands(ClientSession *connection)
+{
+    BatchRun *batch = connection->batch;
+    ClientSession *session;
+    char *command;
+    
+    while (batch->started < batch->count && 
+           batch->running < batch->parallelism) {
+        session = new_session(connection->socket_fd);
+        if (!session) {
+            return -1;
+        }
+    
+        attach_channel(connection, session, batch->started + 1);
+        batch->started++;
+        batch->running++;
+    
+        command = batch->next_command;
+        batch->next_command += strlen(command) + 1;
+    
+        if (create_shell_exec_session(session, command) < 0) {
+            terminal_server_destroy_session(session);
+            continue;
+        }
+    
+        /* Nothing comes from the client, the command sees EOF right away */
+        close_session_fd(&session->stdin_fd);
+    }
+    
+    /* The connection ends with the last command */
+    if (batch->started == batch->count && batch->running == 0) {
+        connection->closing = 1;
+    }
+    
+    return 0;
+}
+
+/*****************************************************************************/
+static int handle_window_size_message(ClientSession *session, Message *msg)
+{
+    struct winsize ws;
+    
+    if (msg->length != sizeof(struct winsize)) {
+        VSOCK_LOG_ERROR("Invalid window size message length: %u", msg->length);
+        return -1;
+    }
+    
+    memcpy(&ws, msg->data, sizeof(struct winsize));
+    
+    /* The client reports its size before opening the session */
+    if (session->pty_master_fd < 0) {
+        session->window_size = ws;
+        session->window_size_pending = 1;
+        return 0;
+    }
+    
+    if (ioctl(session->pty_master_fd, TIOCSWINSZ, &ws) < 0) {
+        VSOCK_LOG_ERROR("Failed to set window size: %s", strerror(errno));
+        return -1;
+    }
+    
+    return 0;
+}
+
+/*****************************************************************************/
+static void offer_max_frame_size(ClientSession *session)
+{
+    ClientSession *connection = session->connection;
+    uint32_t offered = MAX_LARGE_MESSAGE_DATA;
+    Message msg;
+    
+    if (connection->max_frame_offered || 
+        connection->max_frame_data != MAX_MESSAGE_DATA) {
+        return;
+    }
+    
+    /* Large frames are taken from now on and sent once the client
+     * accepts, older clients ignore the offer and keep the default */
+    if (message_queue_set_max_frame(session->socket_fd, offered) < 0) {
+        return;
+    }
+    
+    msg.type = MSG_TYPE_MAX_FRAME_SIZE;
+    msg.length = sizeof(uint32_t);
+    memcpy(msg.data, &offered, sizeof(uint32_t));
+    
+    if (terminal_server_write(session, &msg) < 0) {
+        VSOCK_LOG_ERROR("Failed to offer large frames");
+        return;
+    }
+    
+    connection->max_frame_offered = 1;
+}
+
+/*****************************************************************************/
+static int handle_max_frame_size_message(ClientSession *session, Message *msg)
+{
+    uint32_t requested;
+    Message response_msg;
+    
+    if (msg->length != sizeof(uint32_t)) {
+        VSOCK_LOG_ERROR("Invalid frame size message length: %u", msg->length);
+        return -1;
+    }
+    
+    memcpy(&requested, msg->data, sizeof(uint32_t));
+    
+    /* Grant at most what we support, never less than the default */
+    if (requested > MAX_LARGE_MESSAGE_DATA) {
+        requested = MAX_LARGE_MESSAGE_DATA;
+    }
+    if (requested < MAX_MESSAGE_DATA) {
+        requested = MAX_MESSAGE_DATA;
+    }
+    
+    if (message_queue_set_max_frame(session->socket_fd, 
+            session->connection->max_frame_offered ? 
+            MAX_LARGE_MESSAGE_DATA : requested) < 0) {
+        return -1;
+    }
+    
+    /* Channels opened from now on start out with it too */
+    session->max_frame_data = requested;
+    session->connection->max_frame_data = requested;
+    VSOCK_LOG_INFO("Maximum frame size for socket %d: %u", 
+             session->socket_fd, requested);
+    
+    /* The client accepted our offer, nothing to reply */
+    if (session->connection->max_frame_offered) {
+        return 0;
+    }
+    
+    /* Reply with the granted size, the peer may use it from now on */
+    response_msg.type = MSG_TYPE_MAX_FRAME_SIZE;
+    response_msg.length = sizeof(uint32_t);
+    memcpy(response_msg.data, &requested, sizeof(uint32_t));
+    
+    return terminal_server_write(session, &response_msg);
+}
+
+/*****************************************************************************/
+static int queue_pty_input(ClientSession *session, const void *data, 
+                           uint32_t length)
+{
+    Chunk *chunk = session->pty_input;
+    Chunk *larger;
+    int used = 0;
+    
+    if (chunk) {
+        used = chunk->end_offset - chunk->start_offset;
+    }
+    
+    /* The socket is paused while PTY input waits, so the backlog never
+     * exceeds what one read delivered. Exec input has a window instead. */
+    if (session->connection_type == CONNECTION_TYPE_EXEC && 
+        used + length > EXEC_INPUT_WINDOW) {
+        VSOCK_LOG_ERROR("Input beyond the credit granted");
+        return -1;
+    }
+    
+    if (!chunk || chunk->end_offset + (int)length > chunk->capacity) {
+        larger = chunk_pool_get_sized(used + length);
+        if (!larger) {
+            VSOCK_LOG_ERROR("PTY input backlog too large");
+            return -1;
+        }
+        
+        if (chunk) {
+            memcpy(larger->data, &chunk->data[chunk->start_offset], used);
+            chunk_pool_put(chunk);
+        }
+        
+        larger->end_offset = used;
+        chunk = larger;
+        session->pty_input = chunk;
+    }
+    
+    memcpy(&chunk->data[chunk->end_offset], data, length);
+    chunk->end_offset += length;
+    return 0;
+}
+
+/*****************************************************************************/
+static int return_input_credit(ClientSession *session, uint32_t written)
+{
+    Message msg;
+    
+    /* Returned in batches, like the client does with output credit */
+    session->input_consumed += written;
+    if (session->input_consumed < EXEC_INPUT_WINDOW / 4) {
+        return 0;
+    }
+    
+    msg.type = MSG_TYPE_INPUT_CREDIT;
+    msg.length = sizeof(uint32_t);
+    memcpy(msg.data, &session->input_consumed, sizeof(uint32_t));
+    session->input_consumed = 0;
+    return terminal_server_write(session, &msg);
+}
+
+/*****************************************************************************/
+static int flush_pty_input(ClientSession *session)
+{
+    Chunk *chunk = session->pty_input;
+    int input_fd = session_input_fd(session);
+    ssize_t bytes_written;
+    
+    while (chunk && chunk->start_offset < chunk->end_offset) {
+        bytes_written = write(input_fd, &chunk->data[chunk->start_offset],
+                              chunk->end_offset - chunk->start_offset);
+        
+        if (bytes_written > 0) {
+            chunk->start_offset += bytes_written;
+            if (input_fd == session->stdin_fd &&
+                return_input_credit(session, bytes_written) < 0) {
+                return -1;
+            }
+        } else if (bytes_written < 0 && errno == EINTR) {
+            continue;
+        } else if (bytes_written < 0 && 
+                   (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            /* The shell is not reading, wait for EPOLLOUT on the PTY */
+            return 0;
+        } else if (bytes_written < 0 && errno == EPIPE && 
+                   input_fd == session->stdin_fd) {
+            /* The command closed its stdin, the rest has nowhere to go */
+            session->input_closed = 1;
+            break;
+        } else {
+            VSOCK_LOG_ERROR("Failed to write to PTY: %s", strerror(errno));
+            return -1;
+        }
+    }
+    
+    if (chunk) {
+        chunk_pool_put(chunk);
+        session->pty_input = NULL;
+    }
+    
+    /* The command sees EOF once everything before it was written */
+    if (session->input_closed && session->stdin_fd >= 0) {
+        close_session_fd(&session->stdin_fd);
+        session->pty_write_armed = 0;
+    }
+    
+    return 0;
+}
+
+/*****************************************************************************/
+static int handle_client_data_message(ClientSession *session, Message *msg)
+{
+    /* Input a command has stopped reading is dropped */
+    if (session->connection_type == CONNECTION_TYPE_EXEC && 
+        session->stdin_fd < 0) {
+        return 0;
+    }
+    
+    if (session_input_fd(session) < 0) {
+        VSOCK_LOG_ERROR("PTY not initialized");
+        return -1;
+    }
+    
+    /* Whatever the PTY does not take now is written once it drains */
+    if (queue_pty_input(session, msg->data, msg->length) < 0) {
+        return -1;
+    }
+    
+    return flush_pty_input(session);
+}
+
+/*****************************************************************************/
+static int handle_client_eof_message(ClientSession *session)
+{
+    /* A terminal has no end of input, only exec sessions take it */
+    if (session->connection_type != CONNECTION_TYPE_EXEC) {
+        return 0;
+    }
+    
+    session->input_closed = 1;
+    return flush_pty_input(session);
+}
+
+/*****************************************************************************/
+static int handle_pty_credit_message(ClientSession *session, Message *msg)
+{
+    uint32_t credit;
+    
+    if (msg->length != sizeof(uint32_t)) {
+        VSOCK_LOG_ERROR("Invalid credit message length: %u", msg->length);
+        return -1;
+    }
+    
+    memcpy(&credit, msg->data, sizeof(uint32_t));
+    
+    /* A client that never sends credit is served without a window. One
+     * that grants it once offered counts the output sent meanwhile. */
+    if (!session->pty_credit_enabled) {
+        session->pty_credit_enabled = 1;
+        credit = credit > session->pty_output_unwindowed ? 
+                 credit - session->pty_output_unwindowed : 0;
+    }
+    
+    if (credit > UINT32_MAX - session->pty_credit) {
+        VSOCK_LOG_ERROR("PTY credit overflow");
+        return -1;
+    }
+    
+    session->pty_credit += credit;
+    return 0;
+}
+
+/*****************************************************************************/
+int terminal_server_handle_message(ClientSession *session, Message *msg)
+{
+    int result = 0;
+    
+    switch (msg->type) {
+        case MSG_TYPE_OPEN_BASH:
+            result = handle_open_bash_message(session);
+            break;
+            
+        case MSG_TYPE_OPEN_CMD:
+            result = handle_open_cmd_message(session, msg);
+            break;
+            
+        case MSG_TYPE_OPEN_EXEC:
+            result = handle_open_exec_message(session, msg);
+            break;
+            
+        case MSG_TYPE_OPEN_ARGV:
+            result = handle_open_argv_message(session, msg);
+            break;
+            
+        case MSG_TYPE_OPEN_BATCH:
+            result = handle_open_batch_message(session, msg);
+            break;
+            
+        case MSG_TYPE_WINDOW_SIZE:
+            result = handle_window_size_message(session, msg);
+            break;
+            
+        case MSG_TYPE_CLIENT_DATA:
+            result = handle_client_data_message(session, msg);
+            break;
+            
+        case MSG_TYPE_CLIENT_EOF:
+            result = handle_client_eof_message(session);
+            break;
+            
+        case MSG_TYPE_FILE_UPLOAD_START:
+            offer_max_frame_size(session);
+            result = file_transfer_handle_upload_start(session, msg);
+            break;
+            
+        case MSG_TYPE_FILE_DOWNLOAD_START:
+            offer_max_frame_size(session);
+            result = file_transfer_handle_download_start(session, msg);
+            break;
+            
+        case MSG_TYPE_MAX_FRAME_SIZE:
+            result = handle_max_frame_size_message(session, msg);
+            break;
+            
+        case MSG_TYPE_PTY_CREDIT:
+            result = handle_pty_credit_message(session, msg);
+            break;
+            
+        case MSG_TYPE_FILE_DATA_BEGIN:
+            /* Upload data follows, the file is already open */
+            break;
+            
+        case MSG_TYPE_FILE_DATA:
+            result = file_transfer_handle_data(session, msg);
+            break;
+            
+        case MSG_TYPE_FILE_DATA_END:
+            result = file_transfer_handle_data_end(session);
+            break;
+            
+        case MSG_TYPE_FILE_DATA_END_ACK:
+            /* Client confirmed the download, it closes the connection */
+            break;
+            
+        default:
+            VSOCK_LOG_ERROR("Unknown message type: 0x%02X", msg->type);
+            result = -1;
+            break;
+    }
+    
+    return result;
+}
+
+/*****************************************************************************/
+static int has_output_credit(ClientSession *session)
+{
+    return !session->pty_credit_enabled || session->pty_credit > 0;
+}
+
+/*****************************************************************************/
+static int can_read_output(ClientSession *session)
+{
+    return (session->pty_readable || session->stdout_readable || 
+            session->stderr_readable) && has_output_credit(session);
+}
+
+/*****************************************************************************/
+static int read_output(ClientSession *session, int fd, uint32_t type,
+                       int *readable)
+{
+    Message *msg;
+    ssize_t bytes_read;
+    uint32_t limit;
+    
+    /* Edge-triggered: keep reading until the PTY or pipe would block,
+     * pausing while the client is not keeping up with the output. Unread
+     * output stays in the kernel and throttles the producing process. */
+    while (*readable && has_output_credit(session) && 
+           !message_queue_is_saturated(session->socket_fd)) {
+        limit = MAX_MESSAGE_DATA;
+        if (session->pty_credit_enabled && session->pty_credit < limit) {
+            limit = session->pty_credit;
+        }
+        
+        /* Read straight into the outgoing frame */
+        msg = terminal_server_reserve(session, type, limit);
+        if (!msg) {
+            VSOCK_LOG_ERROR("Failed to queue PTY data");
+            return -1;
+        }
+        
+        bytes_read = read(fd, msg->data, limit);
+        if (bytes_read <= 0) {
+            message_queue_discard(session->socket_fd, msg);
+        }
+        
+        if (bytes_read > 0) {
+            if (session->pty_credit_enabled) {
+                session->pty_credit -= bytes_read;
+            } else if (session->pty_output_unwindowed <= 
+                       UINT32_MAX - bytes_read) {
+                session->pty_output_unwindowed += bytes_read;
+            }
+            
+            if (message_queue_commit(session->socket_fd, msg, bytes_read) < 0) {
+                VSOCK_LOG_ERROR("Failed to queue PTY data");
+                return -1;
+            }
+        } else if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            *readable = 0;
+        } else if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        } else if (bytes_read == 0 || errno == EIO) {
+            /* Writers are gone (child process exited) */
+            *readable = 0;
+            return 1;
+        } else {
+            VSOCK_LOG_ERROR("Output read error: %s", strerror(errno));
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+/*****************************************************************************/
+static int handle_pty_data(ClientSession *session)
+{
+    int result;
+    
+    result = read_output(session, session->pty_master_fd, MSG_TYPE_PTY_DATA,
+                         &session->pty_readable);
+    
+    if (result > 0) {
+        /* PTY closed, flush what we have */
+        VSOCK_LOG_INFO("PTY closed for session: socket=%d", 
+                 session->socket_fd);
+        session->closing = 1;
+    }
+    
+    return result < 0 ? -1 : 0;
+}
+
+/*****************************************************************************/
+static int handle_exec_output(ClientSession *session)
+{
+    int result;
+    
+    /* Each stream ends on its own, the exit status waits for both */
+    result = read_output(session, session->stdout_fd, MSG_TYPE_PTY_DATA,
+                         &session->stdout_readable);
+    if (result > 0) {
+        close_session_fd(&session->stdout_fd);
+    }
+    
+    if (result >= 0) {
+        result = read_output(session, session->stderr_fd, 
+                             MSG_TYPE_STDERR_DATA, &session->stderr_readable);
+        if (result > 0) {
+            close_session_fd(&session->stderr_fd);
+        }
+    }
+    
+    return result < 0 ? -1 : 0;
+}
+
+/*****************************************************************************/
+static int report_exit_status(ClientSession *session)
+{
+    Message msg;
+    int32_t status = session->exit_status;
+    
+    msg.type = MSG_TYPE_EXIT_STATUS;
+    msg.length = sizeof(int32_t);
+    memcpy(msg.data, &status, sizeof(int32_t));
+    
+    session->exit_reported = 1;
+    return terminal_server_write(session, &msg);
+}
+
+/*****************************************************************************/
+static int handle_session_message(void *context, int fd, Message *msg)
+{
+    ClientSession *connection = (ClientSession *)context;
+    ClientSession *session;
+    UNUSED(fd);
+    
+    session = find_channel(connection, msg->channel);
+    
+    if (msg->channel != 0 && msg->type == MSG_TYPE_CHANNEL_OPEN) {
+        if (!session) {
+            return open_channel(connection, msg->channel);
+        }
+    
+        /* Reopening a channel in use is the client's error, close it */
+        VSOCK_LOG_ERROR("Channel %u is already open", msg->channel);
+        terminal_server_destroy_session(session);
+        return 0;
+    }
+    
+    /* Frames still in flight for a channel that has just closed */
+    if (!session) {
+        return 0;
+    }
+    
+    /* Uploads spend the turn of the channel they arrive for */
+    if (msg->type == MSG_TYPE_FILE_DATA) {
+        session->bulk_deficit -= MESSAGE_HEADER_SIZE + msg->length;
+    }
+    
+    if (msg->channel != 0 && msg->type == MSG_TYPE_CHANNEL_CLOSE) {
+        terminal_server_destroy_session(session);
+        return 0;
+    }
+    
+    if (terminal_server_handle_message(session, msg) < 0) {
+        VSOCK_LOG_ERROR("Message handling failed (channel %u)", msg->channel);
+    
+        /* A failing channel is closed, the others are not affected */
+        if (session != connection) {
+            terminal_server_destroy_session(session);
+            return 0;
+        }
+        return -1;
+    }
+    
+    return 0;
+}
+
+/*****************************************************************************/
+static void handle_session_error(void *context, const char *error)
+{
+    ClientSession *session = (ClientSession *)context;
+    
+    /* message_queue_read() returns -1 next, the caller tears down */
+    VSOCK_LOG_ERROR("Session error (socket=%d): %s", session->socket_fd, error);
+}
+
+/*****************************************************************************/
+static int is_file_session(ClientSession *session)
+{
+    return session->connection_type == CONNECTION_TYPE_FILE_UPLOAD ||
+           session->connection_type == CONNECTION_TYPE_FILE_DOWNLOAD;
+}
+
+/*****************************************************************************/
+static int can_take_input(ClientSession *session)
+{
+    /* Exec input is bounded by its window and always finds room */
+    return (!session->pty_input || 
+            session->connection_type == CONNECTION_TYPE_EXEC) &&
+           file_transfer_can_receive(session);
+}
+
+/*****************************************************************************/
+static int has_upload_credit(ClientSession *session)
+{
+    return session->connection_type != CONNECTION_TYPE_FILE_UPLOAD ||
+           session->file_fd < 0 || session->bulk_deficit > 0;
+}
+
+/*****************************************************************************/
+static int can_read_socket(ClientSession *session, int need_credit)
+{
+    ClientSession *channel;
+    
+    /* Channel 0 reads for every channel of the connection */
+    if (session->connection != session || !session->socket_readable ||
+        !can_take_input(session) || 
+        (need_credit && !has_upload_credit(session))) {
+        return 0;
+    }
+    
+    /* Input for a stalled channel has nowhere to go until it catches up,
+     * nor for an upload that used up its turn, so the shared socket
+     * waits for it */
+    for (channel = session->channels; channel; channel = channel->channel_next) {
+        if (!can_take_input(channel) || 
+            (need_credit && !has_upload_credit(channel))) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+/*****************************************************************************/
+static int can_send_file(ClientSession *session)
+{
+    return session->file_fd >= 0 &&
+           session->connection_type == CONNECTION_TYPE_FILE_DOWNLOAD &&
+           file_transfer_has_data(session) &&
+           !message_queue_is_saturated(session->socket_fd);
+}
+
+/*****************************************************************************/
+static int has_file_work(ClientSession *session)
+{
+    /* Upload data waits on channel 0's socket, whichever channel it is for */
+    if (session->connection_type == CONNECTION_TYPE_FILE_UPLOAD) {
+        return session->file_fd >= 0 && 
+               can_read_socket(session->connection, 0);
+    }
+    
+    return can_send_file(session);
+}
+
+/*****************************************************************************/
+static int read_socket(ClientSession *session)
+{
+    int result;
+    
+    /* Handle socket data until it would block, or until the PTY or the
+     * disk stops keeping up so that it only stalls its own client. File
+     * uploads stop early once their turn is used up. */
+    while (can_read_socket(session, 1)) {
+        result = message_queue_read(session, session->socket_fd, 
+                                    handle_session_message, 
+                                    handle_session_error);
+        if (result < 0) {
+            return -1;
+        }
+        
+        if (result == 0) {
+            session->socket_readable = 0;
+        }
+    }
+    
+    return 0;
+}
+
+/*****************************************************************************/
+static int service_session(ClientSession *session, int *budget)
+{
+    int pending;
+    
+    while (1) {
+        /* Handle client input */
+        if (session->pty_input && flush_pty_input(session) < 0) {
+            return -1;
+        }
+        
+        if (read_socket(session) < 0) {
+            return -1;
+        }
+        
+        /* Start the batch commands there is room for */
+        if (session->batch && start_batch_commands(session) < 0) {
+            return -1;
+        }
+        
+        /* Handle PTY data */
+        if (handle_pty_data(session) < 0 || handle_exec_output(session) < 0) {
+            return -1;
+        }
+        
+        /* Once the child is gone and its output read, drop the PTY */
+        if (session->closing && !session->pty_readable && 
+            session->pty_master_fd >= 0) {
+            unwatch_session_fd(session->pty_master_fd);
+            close(session->pty_master_fd);
+            session->pty_master_fd = -1;
+            session->pty_write_armed = 0;
+        }
+        
+        /* An exec session ends with its status, after all of its output */
+        if (session->closing && !session->exit_reported &&
+            session->connection_type == CONNECTION_TYPE_EXEC &&
+            session->stdout_fd < 0 && session->stderr_fd < 0 &&
+            report_exit_status(session) < 0) {
+            return -1;
+        }
+        
+        /* Handle file transfer within its turn */
+        if (*budget > 0 && can_send_file(session)) {
+            *budget -= file_transfer_send_data(session, *budget);
+        }
+        
+        /* Flush pending writes */
+        pending = message_queue_flush_writes(session->socket_fd);
+        if (pending < 0) {
+            return -1;
+        }
+        
+        /* Tear down only after the client received everything. A channel
+         * is done once its frames are queued, its close goes out behind
+         * them, file data included. */
+        if (session->closing && 
+            (pending == 0 || session != session->connection) &&
+            session->pty_master_fd < 0 &&
+            session->stdout_fd < 0 && session->stderr_fd < 0) {
+            return -1;
+        }
+        
+        /* A socket that would block reports EPOLLOUT once it drains; one
+         * that took everything raises no new edge, so keep producing.
+         * Without credit we wait for the client instead. Uploads were
+         * read above as far as they could be. */
+        if (pending > 0 || (!can_read_output(session) && 
+                            (*budget <= 0 || !can_send_file(session)))) {
+            break;
+        }
+    }
+    
+    /* File work left over waits for the next round, and a transfer that
+     * went idle does not keep credit to burst with later. Uploads need
+     * no room in the socket queue. */
+    if (is_file_session(session) && has_file_work(session) &&
+        (pending == 0 || 
+         session->connection_type == CONNECTION_TYPE_FILE_UPLOAD)) {
+        schedule_session(session);
+    } else if (!session->scheduled && session->bulk_deficit > 0) {
+        session->bulk_deficit = 0;
+    }
+    
+    /* Only ask for writability while something is actually waiting */
+    if (set_write_interest(session->socket_fd, SOCKET_EVENTS, 
+                           &session->connection->socket_write_armed, 
+                           pending > 0) < 0) {
+        return -1;
+    }
+    
+    if (session->pty_master_fd >= 0 &&
+        set_write_interest(session->pty_master_fd, PTY_EVENTS, 
+                           &session->pty_write_armed, 
+                           session->pty_input != NULL) < 0) {
+        return -1;
+    }
+    
+    if (session->stdin_fd >= 0 &&
+        set_write_interest(session->stdin_fd, STDIN_EVENTS, 
+                           &session->pty_write_armed, 
+                           session->pty_input != NULL) < 0) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+/*****************************************************************************/
+void terminal_server_handle_event(int fd, uint32_t events)
+{
+    ClientSession *session = lookup_session(fd);
+    
+    if (!session) {
+        return;
+    }
+    
+    if (fd == session->pty_master_fd) {
+        /* Hangups are discovered by the read as well; EPOLLOUT only
+         * matters to pending input, which is retried anyway */
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            session->pty_readable = 1;
+        }
+    } else if (fd == session->stdout_fd) {
+        session->stdout_readable = 1;
+    } else if (fd == session->stderr_fd) {
+        session->stderr_readable = 1;
+    } else if (fd == session->socket_fd && 
+               (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        session->socket_readable = 1;
+    }
+    
+    terminal_server_wake_session(session);
+}
+
+/*****************************************************************************/
+static int batch_has_room(ClientSession *connection)
+{
+    BatchRun *batch = connection->batch;
+    
+    /* For its next command, or to end once the last one has */
+    if (!batch || connection->closing) {
+        return 0;
+    }
+    
+    return batch->started < batch->count ? 
+           batch->running < batch->parallelism : batch->running == 0;
+}
+
+/*****************************************************************************/
+void terminal_server_wake_session(ClientSession *session)
+{
+    ClientSession *connection = session->connection;
+    ClientSession *channel;
+    ClientSession *next_channel;
+    int budget = 0;
+    
+    /* Terminal traffic right away, file traffic is left to the scheduler */
+    if (session != connection) {
+        if (service_session(session, &budget) < 0) {
+            terminal_server_destroy_session(session);
+        }
+    
+        /* Reading the socket may have waited for this channel, and a
+         * batch for it to end */
+        if (connection->socket_readable || batch_has_room(connection)) {
+            terminal_server_wake_session(connection);
+        }
+        return;
+    }
+    
+    do {
+        if (service_session(connection, &budget) < 0) {
+            terminal_server_destroy_session(connection);
+            return;
+        }
+    
+        /* The channels share the socket, new input or room to write may
+         * be what they were waiting for */
+        for (channel = connection->channels; channel; channel = next_channel) {
+            next_channel = channel->channel_next;
+            budget = 0;
+            if (service_session(channel, &budget) < 0) {
+                terminal_server_destroy_session(channel);
+            }
+        }
+    
+        /* Commands that could not start end right away */
+        budget = 0;
+    } while (batch_has_room(connection));
+}
+
+/*****************************************************************************/
+void terminal_server_cleanup_dead_sessions(void)
+{
+    ClientSession *session = session_list_head;
+    int status;
+    pid_t result;
+    
+    while (session) {
+        if (session->pid > 0) {
+            result = waitpid(session->pid, &status, WNOHANG);
+            
+            if (result > 0) {
+                VSOCK_LOG_INFO("Child process %d exited with status %d", 
+                        session->pid, WEXITSTATUS(status));
+                
+                /* Shells report a signal as 128 plus its number */
+                session->exit_status = WIFSIGNALED(status) ? 
+                                       128 + WTERMSIG(status) : 
+                                       WEXITSTATUS(status);
+                
+                /* Deliver the remaining output before closing */
+                session->pid = -1;
+                session->closing = 1;
+                session->pty_readable = session->pty_master_fd >= 0;
+                session->stdout_readable = session->stdout_fd >= 0;
+                session->stderr_readable = session->stderr_fd >= 0;
+                terminal_server_wake_session(session);
+    
+                /* That may have torn down other channels as well, so
+                 * start over, reaped sessions are skipped next time */
+                session = session_list_head;
+                continue;
+            }
+        }
+        
+        session = session->next;
+    }
+    
+    /* Parked shells are not sessions yet */
+    shell_pool_reap();
+}
+
+/*****************************************************************************/
+void terminal_server_run_scheduler(void)
+{
+    ClientSession *session;
+    int round = run_queue_length;
+    
+    /* One round: every transfer queued so far earns a quantum and spends
+     * what it can, the ones with work left rejoin at the tail */
+    while (round-- > 0) {
+        session = next_scheduled_session();
+        if (!session) {
+            break;
+        }
+    
+        session->bulk_deficit += BULK_QUANTUM;
+        if (session->bulk_deficit > BULK_QUANTUM) {
+            session->bulk_deficit = BULK_QUANTUM;
+        }
+    
+        if (service_session(session, &session->bulk_deficit) < 0) {
+            terminal_server_destroy_session(session);
+        } else if (session != session->connection && 
+                   session->connection->socket_readable) {
+            /* Channel 0 reads the uploads of the other channels */
+            terminal_server_wake_session(session->connection);
+        }
+    }
+}
+
+/*****************************************************************************/
+int terminal_server_has_scheduled(void)
+{
+    return run_queue_head != NULL;
+}
+
+/*****************************************************************************/
+void terminal_server_init(int signal_pipe_fd)
+{
+    pty_spawn_init();
+    setup_signal_handlers(signal_pipe_fd);
+    VSOCK_LOG_INFO("Terminal server initialized");
+}
+
+/*****************************************************************************/
+void terminal_server_init_worker(int event_fd)
+{
+    epoll_fd = event_fd;
+}
+
+/*****************************************************************************/
+int terminal_server_session_count(void)
+{
+    return session_count;
 }
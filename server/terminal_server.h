@@ -4,6 +4,8 @@
 #ifndef VSOCK_SHELL_TERMINAL_SERVER_H
 #define VSOCK_SHELL_TERMINAL_SERVER_H
 
+#include <stdint.h>
+#include <sys/ioctl.h>
 #include "protocol.h"
 #include "../include/common.h"
 #include "../include/message.h"
@@ -16,6 +18,40 @@ typedef struct ClientSession {
     ConnectionType connection_type;
     int file_fd;
     int file_transfer_started;
+    off_t file_offset;                 /* Next upload write position */
+    struct FileIoTransfer *file_io;    /* Transfer run by the I/O threads */
+    uint32_t max_frame_data;
+    int max_frame_offered;             /* Channel 0: large frames offered */
+    struct winsize window_size;        /* Applied once the PTY exists */
+    int window_size_pending;
+    int socket_readable;               /* Socket not yet drained to EAGAIN */
+    int pty_readable;                  /* PTY not yet drained to EAGAIN */
+    int pty_credit_enabled;            /* Client grants PTY output credit */
+    uint32_t pty_credit;               /* PTY bytes we may still send */
+    uint32_t pty_output_unwindowed;    /* Sent before credit was granted */
+    struct Chunk *pty_input;           /* Client input the PTY did not take */
+    int socket_write_armed;            /* EPOLLOUT requested on the socket */
+    int pty_write_armed;               /* EPOLLOUT requested on the PTY */
+    int stdin_fd;                      /* Pipes of a command run by exec */
+    int stdout_fd;
+    int stderr_fd;
+    int stdout_readable;               /* Pipe not yet drained to EAGAIN */
+    int stderr_readable;
+    int input_closed;                  /* Client sent EOF, close stdin after */
+    uint32_t input_consumed;           /* Exec input written, not credited */
+    int exit_status;                   /* Exec: reported once output ended */
+    int exit_reported;
+    int closing;                       /* Child gone, destroy once flushed */
+    int bulk_deficit;                  /* File bytes it may send this turn */
+    int scheduled;                     /* On the run queue for file traffic */
+    uint64_t wait_start_us;            /* When it joined the run queue */
+    uint64_t wait_time_us;             /* Total time spent waiting for service */
+    struct ClientSession *run_next;
+    uint16_t channel;                  /* Channel it runs on, 0 comes first */
+    struct ClientSession *connection;  /* Channel 0 session, owns the socket */
+    struct ClientSession *channels;    /* Channel 0: the other channels */
+    struct ClientSession *channel_next;
+    struct BatchRun *batch;            /* Channel 0: commands to run */
     char file_path[MAX_PATH_LENGTH];
     struct ClientSession *prev;
     struct ClientSession *next;
@@ -30,9 +66,35 @@ ClientSession *terminal_server_find_session_by_pty(int pty_fd);
 /* Message handling */
 int terminal_server_handle_message(ClientSession *session, Message *msg);
 
-/* Main loop */
-void terminal_server_setup_select(fd_set *read_fds, int *max_fd);
-void terminal_server_handle_io(fd_set *read_fds);
+/* Session output, tagged with the channel the session runs on */
+Message *terminal_server_reserve(ClientSession *session, uint32_t type,
+                                 uint32_t max_length);
+int terminal_server_write(ClientSession *session, Message *msg);
+
+/* Process-wide setup, before any worker starts */
+void terminal_server_init(int signal_pipe_fd);
+
+/* Worker loop: sessions belong to the thread that created them and
+ * register their socket and PTY with that thread's epoll instance, set
+ * by terminal_server_init_worker(), to be dispatched by descriptor */
+void terminal_server_init_worker(int event_fd);
+void terminal_server_handle_event(int fd, uint32_t events);
 void terminal_server_cleanup_dead_sessions(void);
+int terminal_server_session_count(void);
+
+/* File transfers take turns by deficit round-robin instead of running
+ * from their events, so terminal traffic always goes first. The loop
+ * runs one round per pass and must not block while sessions wait. */
+void terminal_server_run_scheduler(void);
+int terminal_server_has_scheduled(void);
+
+/* Further descriptors a session waits on, such as file I/O wakeups */
+int terminal_server_watch_fd(ClientSession *session, int fd);
+void terminal_server_unwatch_fd(int fd);
+
+/* Services a session whose state changed outside its own events, and
+ * tears it down if that fails. Channels share their connection's socket,
+ * so waking channel 0 services the other channels as well. */
+void terminal_server_wake_session(ClientSession *session);
 
 #endif /* VSOCK_SHELL_TERMINAL_SERVER_H */
@@ -0,0 +1,389 @@
+/*****************************************************************************/
+/*    vsock-shell - Worker thread implementation                            */
+/*****************************************************************************/
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "worker.h"
+#include "terminal_server.h"
+#include "file_transfer_server.h"
+#include "shell_pool.h"
+#include "../include/common.h"
+
+#define MAX_EPOLL_EVENTS 64
+#define HANDOFF_RING_SIZE 256          /* Power of two */
+
+/* Accepted connections on their way to a worker. The accept thread is
+ * the only producer and the worker the only consumer, so publishing an
+ * index with release semantics is all the synchronization needed. */
+typedef struct {
+    int fds[HANDOFF_RING_SIZE];
+    unsigned int head;                 /* Next slot to take, worker side */
+    unsigned int tail;                 /* Next slot to fill, accept side */
+} HandoffRing;
+
+/* One event loop thread and the sessions it owns */
+typedef struct {
+    pthread_t thread;
+    int index;
+    int epoll_fd;
+    int wakeup_fd;                     /* eventfd, readable when told to act */
+    int io_event_fd;                   /* eventfd for I/O pool completions */
+    HandoffRing handoff;
+    int shell_pool_size;               /* Its share of the parked shells */
+    int session_count;                 /* Published after every loop pass */
+    int reap_requested;
+    int running;
+} Worker;
+
+static Worker *workers = NULL;
+static int worker_count = 0;
+static WorkerConfig worker_config;
+static unsigned int next_worker = 0;   /* Rotates ties between workers */
+
+/*****************************************************************************/
+static int handoff_push(HandoffRing *ring, int fd)
+{
+    unsigned int tail = ring->tail;
+    
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >=
+        HANDOFF_RING_SIZE) {
+        return -1;
+    }
+    
+    ring->fds[tail & (HANDOFF_RING_SIZE - 1)] = fd;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*****************************************************************************/
+static int handoff_pop(HandoffRing *ring)
+{
+    unsigned int head = ring->head;
+    int fd;
+    
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    
+    fd = ring->fds[head & (HANDOFF_RING_SIZE - 1)];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return fd;
+}
+
+/*****************************************************************************/
+static void wake_worker(Worker *worker)
+{
+    uint64_t count = 1;
+    
+    if (write(worker->wakeup_fd, &count, sizeof(count)) < 0 &&
+        errno != EAGAIN) {
+        VSOCK_LOG_ERROR("Failed to wake worker %d: %s", worker->index,
+                        strerror(errno));
+    }
+}
+
+/*****************************************************************************/
+static void handle_wakeup(Worker *worker)
+{
+    uint64_t count;
+    int client_fd;
+    
+    if (read(worker->wakeup_fd, &count, sizeof(count)) < 0 &&
+        errno != EAGAIN) {
+        VSOCK_LOG_ERROR("Failed to read worker wakeup: %s", strerror(errno));
+    }
+    
+    /* Adopt the connections handed over since the last wakeup */
+    while ((client_fd = handoff_pop(&worker->handoff)) >= 0) {
+        if (!terminal_server_create_session(client_fd)) {
+            VSOCK_LOG_ERROR("Failed to create session");
+            close(client_fd);
+        }
+    }
+    
+    if (__atomic_exchange_n(&worker->reap_requested, 0, __ATOMIC_ACQ_REL)) {
+        terminal_server_cleanup_dead_sessions();
+    }
+}
+
+/*****************************************************************************/
+static void run_worker_loop(Worker *worker)
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int event_count;
+    int timeout;
+    int i;
+    
+    while (__atomic_load_n(&worker->running, __ATOMIC_ACQUIRE)) {
+        /* Wait for events, only ready descriptors are reported. Queued
+         * file transfers only look for new events between rounds. */
+        timeout = terminal_server_has_scheduled() ? 0 : 
+                  shell_pool_refill_timeout();
+        event_count = epoll_wait(worker->epoll_fd, events, MAX_EPOLL_EVENTS,
+                                 timeout);
+        if (event_count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            VSOCK_LOG_ERROR("Epoll error: %s", strerror(errno));
+            break;
+        }
+    
+        for (i = 0; i < event_count; i++) {
+            if (events[i].data.fd == worker->wakeup_fd) {
+                handle_wakeup(worker);
+            } else if (events[i].data.fd == worker->io_event_fd) {
+                file_transfer_handle_completions();
+            } else {
+                terminal_server_handle_event(events[i].data.fd,
+                                             events[i].events);
+            }
+        }
+    
+        /* Terminal traffic was served above, file transfers take a turn */
+        terminal_server_run_scheduler();
+    
+        /* Refill the shell pool once the sessions have gone quiet, so a
+         * new bash does not compete with the one that was just adopted */
+        if (event_count == 0 && !terminal_server_has_scheduled()) {
+            shell_pool_refill();
+        }
+    
+        __atomic_store_n(&worker->session_count,
+                         terminal_server_session_count(), __ATOMIC_RELEASE);
+    }
+}
+
+/*****************************************************************************/
+static void watch_worker_fd(Worker *worker, int fd)
+{
+    struct epoll_event event;
+    
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        VSOCK_LOG_FATAL("Failed to watch fd %d: %s", fd, strerror(errno));
+    }
+}
+
+/*****************************************************************************/
+static void *worker_main(void *argument)
+{
+    Worker *worker = (Worker *)argument;
+    
+    watch_worker_fd(worker, worker->wakeup_fd);
+    
+    /* Everything below is per thread and owned by this worker */
+    terminal_server_init_worker(worker->epoll_fd);
+    
+    worker->io_event_fd = file_transfer_init_worker();
+    if (worker->io_event_fd >= 0) {
+        watch_worker_fd(worker, worker->io_event_fd);
+    }
+    
+    if (shell_pool_init(worker->shell_pool_size) < 0) {
+        VSOCK_LOG_ERROR("Worker %d continuing without a shell pool",
+                        worker->index);
+    }
+    
+    run_worker_loop(worker);
+    
+    shell_pool_cleanup();
+    file_transfer_cleanup();
+    return NULL;
+}
+
+/*****************************************************************************/
+static void raise_fd_limit(void)
+{
+    struct rlimit limit;
+    
+    /* Every session needs a socket and a PTY, allow as many as permitted */
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        VSOCK_LOG_ERROR("Failed to get fd limit: %s", strerror(errno));
+        return;
+    }
+    
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+            VSOCK_LOG_ERROR("Failed to raise fd limit: %s", strerror(errno));
+            return;
+        }
+    }
+    
+    VSOCK_LOG_INFO("File descriptor limit: %lu", 
+                   (unsigned long)limit.rlim_cur);
+}
+
+/*****************************************************************************/
+static void close_worker(Worker *worker)
+{
+    if (worker->wakeup_fd >= 0) {
+        close(worker->wakeup_fd);
+    }
+    if (worker->epoll_fd >= 0) {
+        close(worker->epoll_fd);
+    }
+}
+
+/*****************************************************************************/
+int worker_pool_start(int count, const WorkerConfig *config)
+{
+    sigset_t all_signals, saved_mask;
+    Worker *worker;
+    int result;
+    int i;
+    
+    if (count < 1) {
+        count = 1;
+    }
+    if (count > MAX_WORKERS) {
+        count = MAX_WORKERS;
+    }
+    
+    workers = (Worker *)calloc(count, sizeof(Worker));
+    if (!workers) {
+        VSOCK_LOG_ERROR("Failed to allocate workers");
+        return -1;
+    }
+    
+    /* Raised only here, epoll takes descriptors of any number */
+    raise_fd_limit();
+    
+    worker_config = *config;
+    
+    for (i = 0; i < count; i++) {
+        worker = &workers[i];
+        worker->index = i;
+        worker->running = 1;
+    
+        /* Exactly the total, the first workers take one more if need be */
+        worker->shell_pool_size = config->shell_pool_size / count +
+                                  (i < config->shell_pool_size % count);
+        worker->io_event_fd = -1;
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        worker->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    
+        if (worker->epoll_fd < 0 || worker->wakeup_fd < 0) {
+            VSOCK_LOG_ERROR("Failed to set up worker %d: %s", i,
+                            strerror(errno));
+            close_worker(worker);
+            break;
+        }
+    }
+    
+    /* Workers inherit a fully blocked mask, signals go to the caller */
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &saved_mask);
+    
+    for (worker_count = 0; worker_count < i; worker_count++) {
+        worker = &workers[worker_count];
+        result = pthread_create(&worker->thread, NULL, worker_main, worker);
+        if (result != 0) {
+            VSOCK_LOG_ERROR("Failed to start worker %d: %s", worker_count,
+                            strerror(result));
+            break;
+        }
+    }
+    
+    pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+    
+    /* Descriptors of workers that never started */
+    for (; i > worker_count; i--) {
+        close_worker(&workers[i - 1]);
+    }
+    
+    if (worker_count < count) {
+        worker_pool_stop();
+        return -1;
+    }
+    
+    VSOCK_LOG_INFO("Started %d worker threads", worker_count);
+    return 0;
+}
+
+/*****************************************************************************/
+void worker_pool_stop(void)
+{
+    int i;
+    
+    for (i = 0; i < worker_count; i++) {
+        __atomic_store_n(&workers[i].running, 0, __ATOMIC_RELEASE);
+        wake_worker(&workers[i]);
+    }
+    
+    for (i = 0; i < worker_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+        close_worker(&workers[i]);
+    }
+    
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+}
+
+/*****************************************************************************/
+static int worker_load(Worker *worker)
+{
+    HandoffRing *ring = &worker->handoff;
+    
+    /* Sessions it runs plus connections it has not picked up yet */
+    return __atomic_load_n(&worker->session_count, __ATOMIC_ACQUIRE) +
+           (int)(ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE));
+}
+
+/*****************************************************************************/
+int worker_pool_dispatch(int client_fd)
+{
+    Worker *chosen = NULL;
+    Worker *worker;
+    int chosen_load = 0;
+    int load;
+    int i;
+    
+    if (worker_count == 0) {
+        return -1;
+    }
+    
+    /* Least loaded wins, ties rotate so idle workers share new sessions */
+    for (i = 0; i < worker_count; i++) {
+        worker = &workers[(next_worker + i) % worker_count];
+        load = worker_load(worker);
+        if (!chosen || load < chosen_load) {
+            chosen = worker;
+            chosen_load = load;
+        }
+    }
+    next_worker++;
+    
+    if (handoff_push(&chosen->handoff, client_fd) < 0) {
+        VSOCK_LOG_ERROR("Worker %d is backed up", chosen->index);
+        return -1;
+    }
+    
+    wake_worker(chosen);
+    return 0;
+}
+
+/*****************************************************************************/
+void worker_pool_reap_children(void)
+{
+    int i;
+    
+    /* Each worker waits only for the children of its own sessions */
+    for (i = 0; i < worker_count; i++) {
+        __atomic_store_n(&workers[i].reap_requested, 1, __ATOMIC_RELEASE);
+        wake_worker(&workers[i]);
+    }
+}
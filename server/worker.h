@@ -0,0 +1,28 @@
+/*****************************************************************************/
+/*    vsock-shell - Worker thread interface                                 */
+/*****************************************************************************/
+#ifndef VSOCK_SHELL_WORKER_H
+#define VSOCK_SHELL_WORKER_H
+
+#define MAX_WORKERS 256
+
+/* Settings applied by every worker to its own state */
+typedef struct {
+    int shell_pool_size;               /* Parked shells, split over workers */
+} WorkerConfig;
+
+/* Starts count worker threads, each running its own event loop over the
+ * sessions it owns. Signals stay with the calling thread. */
+int worker_pool_start(int count, const WorkerConfig *config);
+
+/* Stops and joins every worker */
+void worker_pool_stop(void);
+
+/* Hands an accepted connection to the least loaded worker, which then
+ * owns it. Returns -1 if every worker is backed up. */
+int worker_pool_dispatch(int client_fd);
+
+/* Asks every worker to reap its exited children, called on SIGCHLD */
+void worker_pool_reap_children(void);
+
+#endif /* VSOCK_SHELL_WORKER_H */